@@ -0,0 +1,990 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#include "qtty.h"
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+
+#define BENCH_MAX_SAMPLES (1024 * 1024)
+#define BENCH_PATTERN "0123456789 abcdefghij\n"
+#define BENCH_WPAT_CHARS "aAbB*?[]^-\\x\xe9"
+#define BENCH_WSTR_CHARS "aAbBxz-]^\\\xe9"
+#define BENCH_WNAMES 1024
+#define BENCH_SHA1_MIL 1000000
+#define BENCH_SHA1_BUF (1024 * 1024)
+#define BENCH_SHA1_MB 8
+
+
+typedef struct s_bench_cfg {
+	char const *mode;
+	int size, count;
+	unsigned long total;
+	int queue, zlevel, sobuf, uring;
+} bench_cfg_t;
+
+typedef struct s_bench_lat {
+	double *samples;
+	int count;
+	double last;
+} bench_lat_t;
+
+typedef struct s_bench_res {
+	unsigned long bytes, pkts;
+	double secs, cpu;
+	unsigned long syscalls;
+} bench_res_t;
+
+
+
+static void bench_usage(char const *prg);
+static double bench_now(void);
+static unsigned long bench_syscalls(void);
+static double bench_cpu(void);
+static void lat_init(bench_lat_t *lat);
+static void lat_mark(bench_lat_t *lat);
+static int lat_cmp(void const *p1, void const *p2);
+static double lat_pct(bench_lat_t *lat, double pct);
+static void bench_fill(char *buf, int size);
+static int bench_dproc(void *priv, void const *data, int size);
+static int bench_rproc(void *priv, void *data, int size);
+static void bench_server(int fd, bench_cfg_t const *cfg);
+static int bench_pkt(qtty_conn_t *qc, bench_cfg_t const *cfg, bench_lat_t *lat,
+		     bench_res_t *res);
+static int ref_read(bt_sock_t fd, char *buf, int size);
+static int ref_recv_pkt(bt_sock_t fd, char **data, int *size);
+static int bench_pktref(qtty_conn_t *qc, bench_cfg_t const *cfg, bench_lat_t *lat,
+			bench_res_t *res);
+static int bench_echo(qtty_conn_t *qc, bench_cfg_t const *cfg, bench_lat_t *lat,
+		      bench_res_t *res);
+static int bench_get(qtty_conn_t *qc, bench_cfg_t const *cfg, bench_lat_t *lat,
+		     bench_res_t *res);
+static int bench_put(qtty_conn_t *qc, bench_cfg_t const *cfg, bench_lat_t *lat,
+		     bench_res_t *res);
+static FILE *bench_mkfile(unsigned long total);
+static int bench_putfile(qtty_conn_t *qc, bench_cfg_t const *cfg, FILE *file,
+			 bench_lat_t *lat, bench_res_t *res);
+static int bench_getfile(qtty_conn_t *qc, bench_cfg_t const *cfg, FILE *file,
+			 bench_lat_t *lat, bench_res_t *res);
+static int bench_run(bench_cfg_t const *cfg);
+static int ref_wildmatch(char const *str, char const *match);
+static int ref_wildmatchi(char const *str, char const *match);
+static void wild_rand(char *buf, int size, char const *chars);
+static int wild_check(char const *str, char const *match, int flags);
+static double wild_time(char const *match, int flags, char **names, int count, int ref,
+			int *hits);
+static int bench_wild(bench_cfg_t const *cfg);
+static void sha1_hex(char const *data, unsigned long size, unsigned int chunk, char *hex);
+static int sha1_kat(char const *mil);
+static int sha1_mb_check(char const *data);
+static double sha1_rate(char const *data, unsigned long total, int mb);
+static int bench_sha1(bench_cfg_t const *cfg);
+
+
+
+static char bench_data[QTTY_PKT_MAXSIZE];
+
+
+
+static void bench_usage(char const *prg) {
+
+	fprintf(stderr,
+		"use: %s [-m pkt|pktref|echo|get|put|getfile|putfile|wild|sha1] [-s SIZE] [-n COUNT]\n"
+		"\t[-t MBYTES] [-q QUEUE] [-z LEVEL] [-b SOBUF] [-u]\n\n"
+		"Results are printed as one JSON object per run. A put SIZE of 0 uses\n"
+		"the adaptive chunk sizing. The putfile mode uploads a temporary file\n"
+		"through the zero-copy path, and the getfile mode downloads to one\n"
+		"through the file sink. With -u both go through io_uring instead.\n"
+		"The pktref mode receives the pkt stream with the per packet header\n"
+		"read and allocation the buffered receive path replaced.\n", prg);
+}
+
+static double bench_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Read and write system calls issued by this process, from the kernel
+ * I/O accounting. The peer runs in a separate process, and is not counted.
+ */
+static unsigned long bench_syscalls(void) {
+	unsigned long val, count = 0;
+	FILE *file;
+	char buf[128];
+
+	if ((file = fopen("/proc/self/io", "r")) == NULL)
+		return 0;
+	while (fgets(buf, sizeof(buf), file) != NULL)
+		if (sscanf(buf, "syscr: %lu", &val) == 1 ||
+		    sscanf(buf, "syscw: %lu", &val) == 1)
+			count += val;
+	fclose(file);
+
+	return count;
+}
+
+/*
+ * User and system CPU time of this process, threads included.
+ */
+static double bench_cpu(void) {
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0;
+
+	return (double) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) +
+		1e-6 * (double) (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+static void lat_init(bench_lat_t *lat) {
+
+	lat->count = 0;
+	lat->last = bench_now();
+}
+
+static void lat_mark(bench_lat_t *lat) {
+	double now = bench_now();
+
+	if (lat->count < BENCH_MAX_SAMPLES)
+		lat->samples[lat->count++] = now - lat->last;
+	lat->last = now;
+}
+
+static int lat_cmp(void const *p1, void const *p2) {
+	double d1 = *(double const *) p1, d2 = *(double const *) p2;
+
+	return d1 < d2 ? -1: d1 > d2 ? 1: 0;
+}
+
+static double lat_pct(bench_lat_t *lat, double pct) {
+	int idx;
+
+	if (lat->count == 0)
+		return 0;
+	idx = (int) (pct * (lat->count - 1) / 100.0 + 0.5);
+
+	return lat->samples[idx];
+}
+
+/*
+ * Text-like content, so compressed runs are not all-zero best cases.
+ */
+static void bench_fill(char *buf, int size) {
+	int i;
+
+	for (i = 0; i < size; i++)
+		buf[i] = BENCH_PATTERN[(i * 7 + i / 97) % STRSIZE(BENCH_PATTERN)];
+}
+
+static int bench_dproc(void *priv, void const *data, int size) {
+
+	lat_mark((bench_lat_t *) priv);
+
+	return size;
+}
+
+static int bench_rproc(void *priv, void *data, int size) {
+
+	memcpy(data, bench_data, size);
+	lat_mark((bench_lat_t *) priv);
+
+	return size;
+}
+
+/*
+ * Minimal in-memory peer: no disk, no login, so that only the framing
+ * engine of the client side is measured.
+ */
+static void bench_server(int fd, bench_cfg_t const *cfg) {
+	int i, size, chunk;
+	unsigned long tsize;
+	char const *data;
+	bt_sock_t sk;
+	qtty_conn_t *qc;
+	char buf[QTTY_PKT_MAXSIZE];
+
+	if ((sk = bt_sock_fdopen(fd)) == INVALID_BT_SOCK)
+		return;
+	if ((qc = qconn_open(sk)) == NULL)
+		return;
+	while (next_pkt(qc, &data, &size) == 0) {
+		if (size == 4 && memcmp(data, "quit", 4) == 0)
+			break;
+		if (size > 5 && memcmp(data, "$zip ", 5) == 0) {
+			SNPRINTF(buf, sizeof(buf), "%.*s", size - 5, data + 5);
+			buf[sizeof(buf) - 1] = 0;
+			qconn_zip_accept(qc, buf, cfg->zlevel);
+		} else if (size == 3 && memcmp(data, "pkt", 3) == 0) {
+			pkt_batch_begin(qc);
+			for (i = 0; i < cfg->count; i++)
+				send_pkt(qc, bench_data, cfg->size);
+			send_pkt(qc, "", 0);
+			pkt_batch_end(qc);
+		} else if (size == 3 && memcmp(data, "get", 3) == 0) {
+			pkt_batch_begin(qc);
+			send_pkt(qc, "", 0);
+			PUT_LE32((unsigned int) cfg->total, qc->zbuf);
+			send_pkt(qc, qc->zbuf, 4);
+			chunk = qc->zip != NULL && cfg->size > QTTY_ZIP_MAXRAW ?
+				QTTY_ZIP_MAXRAW: cfg->size;
+			for (tsize = 0; tsize < cfg->total; tsize += size) {
+				size = cfg->total - tsize < (unsigned long) chunk ?
+					(int) (cfg->total - tsize): chunk;
+				if (qc->zip != NULL)
+					send_pkt(qc, qc->zbuf, zip_encode(qc->zip, bench_data,
+									  size, qc->zbuf));
+				else
+					send_pkt(qc, bench_data, size);
+			}
+			send_pkt(qc, "", 0);
+			pkt_batch_end(qc);
+		} else if (size == 3 && memcmp(data, "put", 3) == 0) {
+			send_pkt(qc, "", 0);
+			do {
+				if (next_pkt(qc, &data, &size) < 0)
+					break;
+				if (size > 4 && qc->zip != NULL)
+					zip_decode(qc->zip, data, size, buf, sizeof(buf));
+			} while (size);
+			send_pkt(qc, "", 0);
+		} else
+			send_pkt(qc, data, size);
+	}
+	qconn_close(qc);
+}
+
+static int bench_pkt(qtty_conn_t *qc, bench_cfg_t const *cfg, bench_lat_t *lat,
+		     bench_res_t *res) {
+	int size;
+	char const *data;
+
+	if (send_pkt(qc, "pkt", 3) < 0)
+		return -1;
+	for (lat_init(lat);;) {
+		if (next_pkt(qc, &data, &size) < 0)
+			return -1;
+		if (!size)
+			break;
+		if (size != cfg->size || memcmp(data, bench_data, size) != 0) {
+			fprintf(stderr, "pkt payload %lu mismatch\n", res->pkts);
+			return -1;
+		}
+		lat_mark(lat);
+		res->bytes += size;
+		res->pkts++;
+	}
+
+	return 0;
+}
+
+static int ref_read(bt_sock_t fd, char *buf, int size) {
+	int curr, cnt;
+
+	for (cnt = 0; cnt < size; cnt += curr)
+		if ((curr = bt_sock_read(fd, buf + cnt, size - cnt)) <= 0)
+			return -1;
+
+	return cnt;
+}
+
+/*
+ * The receive path the buffered one replaced, kept as the reference for
+ * the pktref mode: a read for the header and one for the payload, into a
+ * fresh allocation, for every packet.
+ */
+static int ref_recv_pkt(bt_sock_t fd, char **data, int *size) {
+	unsigned int wsize;
+	char buf[8];
+
+	if (ref_read(fd, buf, 3) != 3)
+		return -1;
+	GET_LE16(wsize, buf + 1);
+	if ((*data = (char *) malloc(wsize + 1)) == NULL)
+		return -1;
+	if (wsize && ref_read(fd, *data, wsize) != (int) wsize) {
+		free(*data);
+		return -1;
+	}
+	(*data)[wsize] = 0;
+	*size = (int) wsize;
+
+	return 0;
+}
+
+/*
+ * Same stream as bench_pkt(), read with ref_recv_pkt() straight from the
+ * socket. The connection has not buffered anything yet, as the request
+ * is the first packet of the run.
+ */
+static int bench_pktref(qtty_conn_t *qc, bench_cfg_t const *cfg, bench_lat_t *lat,
+			bench_res_t *res) {
+	int size;
+	char *data;
+
+	if (send_pkt(qc, "pkt", 3) < 0)
+		return -1;
+	for (lat_init(lat);;) {
+		if (ref_recv_pkt(qc->fd, &data, &size) < 0)
+			return -1;
+		if (!size) {
+			free(data);
+			break;
+		}
+		if (size != cfg->size || memcmp(data, bench_data, size) != 0) {
+			free(data);
+			fprintf(stderr, "pktref payload %lu mismatch\n", res->pkts);
+			return -1;
+		}
+		free(data);
+		lat_mark(lat);
+		res->bytes += size;
+		res->pkts++;
+	}
+
+	return 0;
+}
+
+static int bench_echo(qtty_conn_t *qc, bench_cfg_t const *cfg, bench_lat_t *lat,
+		      bench_res_t *res) {
+	int i, size;
+	char const *data;
+	char buf[QTTY_PKT_MAXSIZE];
+
+	memset(buf, 'e', cfg->size);
+	for (i = 0, lat_init(lat); i < cfg->count; i++) {
+		if (send_pkt(qc, buf, cfg->size) < 0 ||
+		    next_pkt(qc, &data, &size) < 0 || size != cfg->size)
+			return -1;
+		lat_mark(lat);
+		res->bytes += 2 * size;
+		res->pkts += 2;
+	}
+
+	return 0;
+}
+
+static int bench_get(qtty_conn_t *qc, bench_cfg_t const *cfg, bench_lat_t *lat,
+		     bench_res_t *res) {
+
+	lat_init(lat);
+	if (get_cmd(qc, "get", bench_dproc, lat, stderr) != 0)
+		return -1;
+	res->bytes = cfg->total;
+	res->pkts = lat->count;
+
+	return 0;
+}
+
+static int bench_put(qtty_conn_t *qc, bench_cfg_t const *cfg, bench_lat_t *lat,
+		     bench_res_t *res) {
+
+	lat_init(lat);
+	if (put_cmd(qc, "put", (unsigned int) cfg->total, bench_rproc, lat, stderr) != 0)
+		return -1;
+	res->bytes = cfg->total;
+	res->pkts = lat->count;
+
+	return 0;
+}
+
+/*
+ * The upload source for the putfile mode, written before the timed run,
+ * so that it sits in the page cache.
+ */
+static FILE *bench_mkfile(unsigned long total) {
+	unsigned long tsize;
+	int size;
+	FILE *file;
+
+	if ((file = tmpfile()) == NULL) {
+		perror("tmpfile");
+		return NULL;
+	}
+	for (tsize = 0; tsize < total; tsize += size) {
+		size = total - tsize < sizeof(bench_data) ? (int) (total - tsize):
+			(int) sizeof(bench_data);
+		if (fwrite(bench_data, 1, size, file) != (size_t) size) {
+			fclose(file);
+			return NULL;
+		}
+	}
+	fflush(file);
+	rewind(file);
+
+	return file;
+}
+
+static int bench_putfile(qtty_conn_t *qc, bench_cfg_t const *cfg, FILE *file,
+			 bench_lat_t *lat, bench_res_t *res) {
+	unsigned long pkts = qc->st.tx_pkts;
+
+	lat_init(lat);
+	if (put_cmd_file(qc, "put", (unsigned int) cfg->total, file, stderr) != 0)
+		return -1;
+	res->bytes = cfg->total;
+	res->pkts = qc->st.tx_pkts - pkts;
+
+	return 0;
+}
+
+static int bench_getfile(qtty_conn_t *qc, bench_cfg_t const *cfg, FILE *file,
+			 bench_lat_t *lat, bench_res_t *res) {
+	int err;
+	unsigned int fsize;
+	unsigned long pkts;
+	file_sink_t fs;
+
+	lat_init(lat);
+	if (get_cmd_open(qc, "get", &fsize, stderr) != 0)
+		return -1;
+	pkts = qc->st.rx_pkts;
+	sink_open(&fs, file, 0, fsize, 0);
+	err = get_cmd_sink(qc, "get", fsize, &fs, stderr);
+	sink_close(&fs);
+	if (err != 0)
+		return -1;
+	res->bytes = cfg->total;
+	res->pkts = qc->st.rx_pkts - pkts;
+
+	return 0;
+}
+
+static int bench_run(bench_cfg_t const *cfg) {
+	int sv[2], i, err;
+	unsigned long sysc, enters;
+	double t0, cpu;
+	pid_t pid;
+	FILE *file = NULL;
+	bt_sock_t sk;
+	qtty_conn_t *qc;
+	bench_lat_t lat;
+	bench_res_t res;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		perror("socketpair");
+		return -1;
+	}
+	for (i = 0; i < 2 && cfg->sobuf > 0; i++) {
+		setsockopt(sv[i], SOL_SOCKET, SO_SNDBUF, &cfg->sobuf, sizeof(int));
+		setsockopt(sv[i], SOL_SOCKET, SO_RCVBUF, &cfg->sobuf, sizeof(int));
+	}
+	if ((pid = fork()) == 0) {
+		close(sv[0]);
+		bench_server(sv[1], cfg);
+		exit(0);
+	}
+	close(sv[1]);
+	if (pid < 0 || (sk = bt_sock_fdopen(sv[0])) == INVALID_BT_SOCK) {
+		close(sv[0]);
+		return -1;
+	}
+	if ((qc = qconn_open(sk)) == NULL) {
+		bt_sock_close(sk);
+		return -1;
+	}
+	qc->getq = qc->putq = cfg->queue;
+	qc->putchunk = cfg->size;
+	if (cfg->zlevel > 0 &&
+	    qconn_zip(qc, QTTY_ZIP_CAPS, cfg->zlevel, stderr) < 0) {
+		qconn_close(qc);
+		return -1;
+	}
+	if (cfg->uring && qconn_uring(qc) < 0) {
+		fprintf(stderr, "io_uring not available\n");
+		qconn_close(qc);
+		return -1;
+	}
+	if ((lat.samples = (double *) malloc(BENCH_MAX_SAMPLES * sizeof(double))) == NULL) {
+		qconn_close(qc);
+		return -1;
+	}
+	if ((strcmp(cfg->mode, "putfile") == 0 &&
+	     (file = bench_mkfile(cfg->total)) == NULL) ||
+	    (strcmp(cfg->mode, "getfile") == 0 && (file = tmpfile()) == NULL)) {
+		free(lat.samples);
+		qconn_close(qc);
+		return -1;
+	}
+	memset(&res, 0, sizeof(res));
+	sysc = bench_syscalls();
+	enters = qc->ring != NULL ? uring_enters(qc->ring): 0;
+	cpu = bench_cpu();
+	t0 = bench_now();
+
+	if (strcmp(cfg->mode, "pkt") == 0)
+		err = bench_pkt(qc, cfg, &lat, &res);
+	else if (strcmp(cfg->mode, "pktref") == 0)
+		err = bench_pktref(qc, cfg, &lat, &res);
+	else if (strcmp(cfg->mode, "echo") == 0)
+		err = bench_echo(qc, cfg, &lat, &res);
+	else if (strcmp(cfg->mode, "get") == 0)
+		err = bench_get(qc, cfg, &lat, &res);
+	else if (strcmp(cfg->mode, "getfile") == 0)
+		err = bench_getfile(qc, cfg, file, &lat, &res);
+	else if (file != NULL)
+		err = bench_putfile(qc, cfg, file, &lat, &res);
+	else
+		err = bench_put(qc, cfg, &lat, &res);
+
+	res.secs = bench_now() - t0;
+	res.cpu = bench_cpu() - cpu;
+	res.syscalls = bench_syscalls() - sysc;
+	if (qc->ring != NULL)
+		res.syscalls += uring_enters(qc->ring) - enters;
+	if (file != NULL)
+		fclose(file);
+	send_pkt(qc, "quit", 4);
+	qconn_close(qc);
+	waitpid(pid, NULL, 0);
+	if (err < 0) {
+		fprintf(stderr, "%s run failed\n", cfg->mode);
+		free(lat.samples);
+		return -1;
+	}
+	qsort(lat.samples, lat.count, sizeof(double), lat_cmp);
+
+	printf("{\"mode\": \"%s\", \"size\": %d, \"queue\": %d, \"zlevel\": %d, "
+	       "\"uring\": %d, \"bytes\": %lu, \"packets\": %lu, \"secs\": %.6f, "
+	       "\"mbps\": %.2f, \"pps\": %.0f, \"syscalls_per_mb\": %.1f, "
+	       "\"cpu_us_per_mb\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f}\n", cfg->mode, cfg->size, cfg->queue,
+	       cfg->zlevel, cfg->uring, res.bytes, res.pkts, res.secs,
+	       res.bytes / res.secs / 1e6, res.pkts / res.secs, res.bytes ? res.syscalls * 1e6 / res.bytes: 0.0,
+	       res.bytes ? res.cpu * 1e12 / res.bytes: 0.0,
+	       lat_pct(&lat, 50) * 1e6, lat_pct(&lat, 99) * 1e6);
+	fflush(stdout);
+	free(lat.samples);
+
+	return 0;
+}
+
+/*
+ * The recursive matcher the compiled one replaced, kept as the reference
+ * for the differential check. The only change is the end of string test
+ * in the class case, where the original read past the terminator.
+ */
+static int ref_wildmatch(char const *str, char const *match)
+{
+	int prev, mhit, revr, esc;
+
+	for (; *match; str++, match++) {
+		switch (*match) {
+		case '\\':
+			if (!*++match)
+				return 0;
+		default:
+			if (*str != *match)
+				return 0;
+			continue;
+		case '?':
+			if (*str == '\0')
+				return 0;
+			continue;
+		case '*':
+			while (*(++match) == '*');
+			if (!*match)
+				return 1;
+			while (*str)
+				if (ref_wildmatch(str++, match))
+					return 1;
+			return 0;
+		case '[':
+			if (*str == '\0')
+				return 0;
+			esc = 0;
+			revr = match[1] == '^' ? 1 : 0;
+			if (revr)
+				match++;
+			for (prev = 256, mhit = 0; *++match &&
+			     (esc || *match != ']');
+			     prev = esc ? prev : *match) {
+				if (!esc && (esc = *match == '\\'))
+					continue;
+				if (!esc && *match == '-') {
+					if (!*++match)
+						return 0;
+					if (*match == '\\')
+						if (!*++match)
+							return 0;
+					mhit = mhit || (*str <= *match &&
+							*str >= prev);
+				}
+				else
+					mhit = mhit || *str == *match;
+				esc = 0;
+			}
+			if (prev == 256 || esc || *match != ']' || mhit == revr)
+				return 0;
+			continue;
+		}
+	}
+
+	return *str == '\0' ? 1 : 0;
+}
+
+static int ref_wildmatchi(char const *str, char const *match) {
+	int res, i, slen, mlen;
+	char *lstr, *lmatch;
+
+	slen = strlen(str);
+	mlen = strlen(match);
+	if ((lstr = (char *) malloc(slen + mlen + 2)) == NULL)
+		return 0;
+	lmatch = lstr + slen + 1;
+	for (i = 0; i < slen; i++)
+		lstr[i] = LOCHAR(str[i]);
+	lstr[i] = 0;
+	for (i = 0; i < mlen; i++)
+		lmatch[i] = LOCHAR(match[i]);
+	lmatch[i] = 0;
+
+	res = ref_wildmatch(lstr, lmatch);
+
+	free(lstr);
+
+	return res;
+}
+
+static void wild_rand(char *buf, int size, char const *chars) {
+	int i, n = rand() % size, nchars = strlen(chars);
+
+	for (i = 0; i < n; i++)
+		buf[i] = chars[rand() % nchars];
+	buf[i] = 0;
+}
+
+static int wild_check(char const *str, char const *match, int flags) {
+	int res, ref;
+	qtty_wild_t *wp;
+
+	if ((wp = wild_compile(match, flags)) == NULL)
+		return -1;
+	res = wild_match(wp, str);
+	wild_free(wp);
+	ref = (flags & QTTY_WILD_ICASE) ? ref_wildmatchi(str, match):
+		ref_wildmatch(str, match);
+	if (res != ref) {
+		fprintf(stderr, "wild mismatch: str='%s' match='%s' flags=%d ref=%d res=%d\n",
+			str, match, flags, ref, res);
+		return 0;
+	}
+
+	return 1;
+}
+
+static double wild_time(char const *match, int flags, char **names, int count, int ref,
+			int *hits) {
+	int i;
+	double t0;
+	qtty_wild_t *wp;
+
+	if ((wp = wild_compile(match, flags)) == NULL)
+		return -1;
+	*hits = 0;
+	t0 = bench_now();
+	for (i = 0; i < count; i++) {
+		if (!ref)
+			*hits += wild_match(wp, names[i % BENCH_WNAMES]);
+		else if (flags & QTTY_WILD_ICASE)
+			*hits += ref_wildmatchi(names[i % BENCH_WNAMES], match);
+		else
+			*hits += ref_wildmatch(names[i % BENCH_WNAMES], match);
+	}
+	t0 = bench_now() - t0;
+	wild_free(wp);
+
+	return t0 * 1e9 / count;
+}
+
+/*
+ * Differential check of the compiled glob matcher against the recursive
+ * reference on random patterns, followed by the per-name match cost over
+ * a synthetic directory listing, and over a backtracking heavy pattern.
+ */
+static int bench_wild(bench_cfg_t const *cfg) {
+	int i, res, checks = 0, errs = 0;
+	int hits[6];
+	double ns[6];
+	char *names[BENCH_WNAMES];
+	char pat[16], str[24], evil[40];
+	static char const * const exts[] = { "txt", "JPG", "jpg", "c", "tar.gz" };
+
+	srand(1);
+	for (i = 0; i < cfg->count; i++) {
+		wild_rand(pat, 10, BENCH_WPAT_CHARS);
+		wild_rand(str, 12, BENCH_WSTR_CHARS);
+		if ((res = wild_check(str, pat, i & 1 ? QTTY_WILD_ICASE: 0)) < 0)
+			return -1;
+		checks++;
+		errs += !res;
+	}
+	for (i = 0; i < BENCH_WNAMES; i++) {
+		if ((names[i] = (char *) malloc(64)) == NULL)
+			return -1;
+		sprintf(names[i], "%s_%04d_%x.%s", i & 2 ? "IMG": "file", i, i * 7919,
+			exts[i % 5]);
+	}
+	for (i = 0; i < 4; i++)
+		ns[i] = wild_time("*_0[0-4]*.jpg", i & 2 ? QTTY_WILD_ICASE: 0, names,
+				  1000000, !(i & 1), &hits[i]);
+	memset(evil, 'a', sizeof(evil) - 1);
+	evil[sizeof(evil) - 1] = 0;
+	for (i = 0; i < BENCH_WNAMES; i++)
+		strcpy(names[i], evil);
+	ns[4] = wild_time("*a*a*a*a*a*b", 0, names, 4, 1, &hits[4]);
+	ns[5] = wild_time("*a*a*a*a*a*b", 0, names, 100000, 0, &hits[5]);
+	for (i = 0; i < BENCH_WNAMES; i++)
+		free(names[i]);
+	if (hits[0] != hits[1] || hits[2] != hits[3] || hits[4] || hits[5])
+		errs++;
+
+	printf("{\"mode\": \"wild\", \"checks\": %d, \"mismatches\": %d, "
+	       "\"ref_ns\": %.1f, \"wild_ns\": %.1f, \"ref_icase_ns\": %.1f, "
+	       "\"wild_icase_ns\": %.1f, \"ref_evil_ns\": %.1f, \"wild_evil_ns\": %.1f}\n",
+	       checks, errs, ns[0], ns[1], ns[2], ns[3], ns[4], ns[5]);
+	fflush(stdout);
+
+	return errs ? -1: 0;
+}
+
+static void sha1_hex(char const *data, unsigned long size, unsigned int chunk, char *hex) {
+	unsigned int n;
+	sha1_ctx_t ctx;
+	unsigned char digest[SHA1_DIGEST_SIZE];
+
+	sha1_init(&ctx);
+	for (; size > 0; size -= n, data += n) {
+		n = size < chunk ? (unsigned int) size: chunk;
+		sha1_update(&ctx, (unsigned char const *) data, n);
+	}
+	sha1_final(digest, &ctx);
+	for (n = 0; n < SHA1_DIGEST_SIZE; n++)
+		sprintf(hex + 2 * n, "%02x", digest[n]);
+}
+
+/*
+ * Known answer tests for the currently selected implementation, fed in
+ * a few different chunk sizes so that the buffered paths are exercised.
+ */
+static int sha1_kat(char const *mil) {
+	int i, j, errs = 0;
+	char hex[2 * SHA1_DIGEST_SIZE + 1];
+	static unsigned int const chunks[] = { 1, 63, 64, 1000, ~0U };
+	static struct {
+		char const *data, *hex;
+	} const kats[] = {
+		{ "", "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+		{ "abc", "a9993e364706816aba3e25717850c26c9cd0d89d" },
+		{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+		  "84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+		{ NULL, "34aa973cd4c4daa4f61eeb2bdbad27316534016f" }
+	};
+
+	for (i = 0; i < (int) COUNT_OF(kats); i++)
+		for (j = 0; j < (int) COUNT_OF(chunks); j++) {
+			sha1_hex(kats[i].data != NULL ? kats[i].data: mil,
+				 kats[i].data != NULL ? strlen(kats[i].data): BENCH_SHA1_MIL,
+				 chunks[j], hex);
+			if (strcmp(hex, kats[i].hex)) {
+				fprintf(stderr, "sha1 %s KAT %d/%u failed: %s\n",
+					sha1_impl_name(sha1_impl()), i, chunks[j], hex);
+				errs++;
+			}
+		}
+
+	return errs;
+}
+
+/*
+ * Hashes buffers of mixed lengths, in two rounds and with partially
+ * filled contexts, through sha1_update_mb() and checks the digests
+ * against the ones of the portable code.
+ */
+static int sha1_mb_check(char const *data) {
+	int i, j, errs = 0;
+	unsigned int lens[BENCH_SHA1_MB], split[BENCH_SHA1_MB];
+	unsigned char const *ptrs[BENCH_SHA1_MB];
+	sha1_ctx_t ctxs[BENCH_SHA1_MB], rctx;
+	sha1_ctx_t *cptrs[BENCH_SHA1_MB];
+	unsigned char digest[SHA1_DIGEST_SIZE], rdigest[SHA1_DIGEST_SIZE];
+
+	for (i = 0; i < 200; i++) {
+		for (j = 0; j < BENCH_SHA1_MB; j++) {
+			lens[j] = rand() % (j & 1 ? 300: 9000);
+			split[j] = rand() % 100;
+			ptrs[j] = (unsigned char const *) data + rand() % 1000;
+			cptrs[j] = &ctxs[j];
+			sha1_init(&ctxs[j]);
+			sha1_update(&ctxs[j], ptrs[j], split[j]);
+			ptrs[j] += split[j];
+		}
+		sha1_update_mb(cptrs, ptrs, lens, BENCH_SHA1_MB - i % 5);
+		for (j = 0; j < BENCH_SHA1_MB; j++)
+			ptrs[j] += lens[j];
+		sha1_update_mb(cptrs, ptrs, lens, BENCH_SHA1_MB - i % 5);
+		for (j = 0; j < BENCH_SHA1_MB - i % 5; j++) {
+			sha1_final(digest, &ctxs[j]);
+			sha1_impl_select(SHA1_IMPL_C);
+			sha1_init(&rctx);
+			sha1_update(&rctx, ptrs[j] - lens[j] - split[j], split[j] + 2 * lens[j]);
+			sha1_final(rdigest, &rctx);
+			sha1_impl_select(-1);
+			if (memcmp(digest, rdigest, SHA1_DIGEST_SIZE)) {
+				fprintf(stderr, "sha1 multi-buffer mismatch: lane=%d len=%u\n",
+					j, lens[j]);
+				errs++;
+			}
+		}
+	}
+
+	return errs;
+}
+
+static double sha1_rate(char const *data, unsigned long total, int mb) {
+	int i;
+	unsigned long done;
+	double t0;
+	unsigned int lens[BENCH_SHA1_MB];
+	unsigned char const *ptrs[BENCH_SHA1_MB];
+	sha1_ctx_t ctxs[BENCH_SHA1_MB];
+	sha1_ctx_t *cptrs[BENCH_SHA1_MB];
+	unsigned char digest[SHA1_DIGEST_SIZE];
+
+	for (i = 0; i < BENCH_SHA1_MB; i++) {
+		sha1_init(&ctxs[i]);
+		cptrs[i] = &ctxs[i];
+		ptrs[i] = (unsigned char const *) data + i * (BENCH_SHA1_BUF / BENCH_SHA1_MB);
+		lens[i] = BENCH_SHA1_BUF / BENCH_SHA1_MB;
+	}
+	t0 = bench_now();
+	for (done = 0; done < total; done += BENCH_SHA1_BUF) {
+		if (mb)
+			sha1_update_mb(cptrs, ptrs, lens, BENCH_SHA1_MB);
+		else
+			sha1_update(&ctxs[0], (unsigned char const *) data, BENCH_SHA1_BUF);
+	}
+	t0 = bench_now() - t0;
+	sha1_final(digest, &ctxs[0]);
+
+	return t0 > 0 ? done / t0 / (1024.0 * 1024.0): 0;
+}
+
+/*
+ * KATs and throughput of every SHA-1 implementation the CPU supports,
+ * single buffer ones and the AVX2 multi-buffer lanes.
+ */
+static int bench_sha1(bench_cfg_t const *cfg) {
+	int i, kats = 0, errs = 0;
+	double mbs[SHA1_IMPL_AVX2 + 1];
+	char *data;
+
+	if ((data = (char *) malloc(BENCH_SHA1_BUF + BENCH_SHA1_MIL)) == NULL)
+		return -1;
+	memset(data, 'a', BENCH_SHA1_MIL);
+	srand(1);
+	for (i = BENCH_SHA1_MIL; i < BENCH_SHA1_BUF + BENCH_SHA1_MIL; i++)
+		data[i] = (char) rand();
+	for (i = 0; i <= SHA1_IMPL_SHANI; i++) {
+		mbs[i] = 0;
+		if (sha1_impl_select(i) < 0)
+			continue;
+		errs += sha1_kat(data);
+		kats++;
+		mbs[i] = sha1_rate(data + BENCH_SHA1_MIL, cfg->total, 0);
+	}
+	sha1_impl_select(-1);
+	mbs[SHA1_IMPL_AVX2] = 0;
+	if (sha1_mb_select(1) == 0) {
+		errs += sha1_mb_check(data + BENCH_SHA1_MIL);
+		kats++;
+		mbs[SHA1_IMPL_AVX2] = sha1_rate(data + BENCH_SHA1_MIL, cfg->total, 1);
+		sha1_mb_select(0);
+		errs += sha1_mb_check(data + BENCH_SHA1_MIL);
+		sha1_mb_select(-1);
+	}
+	free(data);
+
+	printf("{\"mode\": \"sha1\", \"impl\": \"%s\", \"tested\": %d, \"failures\": %d, "
+	       "\"c_mbs\": %.1f, \"ssse3_mbs\": %.1f, \"shani_mbs\": %.1f, "
+	       "\"avx2_x8_mbs\": %.1f}\n", sha1_impl_name(sha1_impl()), kats, errs,
+	       mbs[SHA1_IMPL_C], mbs[SHA1_IMPL_SSSE3], mbs[SHA1_IMPL_SHANI],
+	       mbs[SHA1_IMPL_AVX2]);
+	fflush(stdout);
+
+	return errs ? -1: 0;
+}
+
+int main(int ac, char **av) {
+	int i;
+	bench_cfg_t cfg;
+
+	sha1_setup();
+	cfg.mode = "get";
+	cfg.size = QTTY_PKT_MAXSIZE;
+	cfg.count = 0;
+	cfg.total = 256 * 1024 * 1024;
+	cfg.queue = cfg.zlevel = cfg.sobuf = cfg.uring = 0;
+	for (i = 1; i < ac; i++) {
+		if (!strcmp(av[i], "-m") && i + 1 < ac)
+			cfg.mode = av[++i];
+		else if (!strcmp(av[i], "-s") && i + 1 < ac)
+			cfg.size = atoi(av[++i]);
+		else if (!strcmp(av[i], "-n") && i + 1 < ac)
+			cfg.count = atoi(av[++i]);
+		else if (!strcmp(av[i], "-t") && i + 1 < ac)
+			cfg.total = strtoul(av[++i], NULL, 10) * 1024 * 1024;
+		else if (!strcmp(av[i], "-q") && i + 1 < ac)
+			cfg.queue = atoi(av[++i]);
+		else if (!strcmp(av[i], "-z") && i + 1 < ac)
+			cfg.zlevel = atoi(av[++i]);
+		else if (!strcmp(av[i], "-b") && i + 1 < ac)
+			cfg.sobuf = atoi(av[++i]);
+		else if (!strcmp(av[i], "-u"))
+			cfg.uring = 1;
+		else {
+			bench_usage(av[0]);
+			return 1;
+		}
+	}
+	if (strcmp(cfg.mode, "wild") == 0) {
+		if (cfg.count <= 0)
+			cfg.count = 1000000;
+		return bench_wild(&cfg) < 0 ? 2: 0;
+	}
+	if (strcmp(cfg.mode, "sha1") == 0)
+		return bench_sha1(&cfg) < 0 ? 2: 0;
+	if (cfg.size < (strncmp(cfg.mode, "put", 3) ? 1: 0) || cfg.size > QTTY_PKT_MAXSIZE ||
+	    (strcmp(cfg.mode, "pktref") == 0 && (cfg.zlevel > 0 || cfg.uring)) ||
+	    (strcmp(cfg.mode, "pkt") && strcmp(cfg.mode, "pktref") && strcmp(cfg.mode, "echo") &&
+	     strcmp(cfg.mode, "get") && strcmp(cfg.mode, "put") &&
+	     strcmp(cfg.mode, "getfile") && strcmp(cfg.mode, "putfile"))) {
+		bench_usage(av[0]);
+		return 1;
+	}
+	if (cfg.count <= 0)
+		cfg.count = strcmp(cfg.mode, "echo") ?
+			(int) (cfg.total / (cfg.size ? cfg.size: QTTY_PKT_MAXSIZE)) + 1: 10000;
+	signal(SIGPIPE, SIG_IGN);
+	bench_fill(bench_data, sizeof(bench_data));
+
+	return bench_run(&cfg) < 0 ? 2: 0;
+}
+
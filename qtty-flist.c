@@ -0,0 +1,241 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+
+#include "qtty.h"
+
+
+#define FLIST_ALIGN(n) (((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+
+
+static void *flist_alloc(flist_t *fl, int size);
+static int flist_qcmp(void const *p1, void const *p2);
+
+
+
+/*
+ * Entries and interned directories are carved out of chunks, which are
+ * only released all together by flist_free().
+ */
+static void *flist_alloc(flist_t *fl, int size) {
+	int csize;
+	void *ptr;
+	flist_chunk_t *chunk = fl->chunks;
+
+	size = (int) FLIST_ALIGN(size);
+	if (chunk == NULL || chunk->used + size > chunk->size) {
+		csize = size > QTTY_FLIST_CHUNK ? size: QTTY_FLIST_CHUNK;
+		if ((chunk = (flist_chunk_t *)
+		     malloc(sizeof(flist_chunk_t) + csize)) == NULL)
+			return NULL;
+		chunk->size = csize;
+		chunk->used = 0;
+		chunk->next = fl->chunks;
+		fl->chunks = chunk;
+	}
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+
+	return ptr;
+}
+
+static int flist_qcmp(void const *p1, void const *p2) {
+
+	return flist_cmp(*(file_list_t const * const *) p1,
+			 *(file_list_t const * const *) p2);
+}
+
+void flist_init(flist_t *fl) {
+
+	memset(fl, 0, sizeof(flist_t));
+}
+
+void flist_free(flist_t *fl) {
+	flist_chunk_t *chunk;
+
+	while ((chunk = fl->chunks) != NULL) {
+		fl->chunks = chunk->next;
+		free(chunk);
+	}
+	flist_init(fl);
+}
+
+/*
+ * Returns the arena copy of the "len" bytes directory prefix "dir",
+ * trailing separator included. Entries come in directory order, so a
+ * match against the last interned prefix shares it among all the files
+ * of the same directory.
+ */
+char const *flist_dir(flist_t *fl, char const *dir, int len) {
+	char *idir;
+
+	if (len == 0)
+		return "";
+	if (fl->ldir != NULL && fl->ldlen == len && memcmp(fl->ldir, dir, len) == 0)
+		return fl->ldir;
+	if ((idir = (char *) flist_alloc(fl, len + 1)) == NULL)
+		return NULL;
+	memcpy(idir, dir, len);
+	idir[len] = 0;
+	fl->ldir = idir;
+	fl->ldlen = len;
+
+	return idir;
+}
+
+/*
+ * Appends a new entry, with "dir" coming from flist_dir(), and the "len"
+ * bytes "name" being the last path component.
+ */
+file_list_t *flist_add(flist_t *fl, char const *dir, char const *name, int len,
+		       unsigned long size) {
+	file_list_t *fent;
+
+	if ((fent = (file_list_t *)
+	     flist_alloc(fl, (int) offsetof(file_list_t, name) + len + 1)) == NULL)
+		return NULL;
+	fent->next = NULL;
+	fent->size = size;
+	fent->dir = dir;
+	fent->dlen = (int) strlen(dir);
+	memcpy(fent->name, name, len);
+	fent->name[len] = 0;
+	if (fl->last != NULL)
+		fl->last->next = fent;
+	else
+		fl->head = fent;
+	fl->last = fent;
+	fl->count++;
+
+	return fent;
+}
+
+file_list_t *flist_add_path(flist_t *fl, char const *path, int len, int sc,
+			    unsigned long size) {
+	int dlen;
+	char const *dir;
+
+	for (dlen = len; dlen > 0 && path[dlen - 1] != sc; dlen--);
+	if ((dir = flist_dir(fl, path, dlen)) == NULL)
+		return NULL;
+
+	return flist_add(fl, dir, path + dlen, len - dlen, size);
+}
+
+/*
+ * Moves all the entries of "src" at the end of "fl", and leaves "src"
+ * empty.
+ */
+void flist_merge(flist_t *fl, flist_t *src) {
+	flist_chunk_t *chunk;
+
+	if (src->chunks != NULL) {
+		for (chunk = src->chunks; chunk->next != NULL; chunk = chunk->next);
+		chunk->next = fl->chunks;
+		fl->chunks = src->chunks;
+	}
+	if (src->head != NULL) {
+		if (fl->last != NULL)
+			fl->last->next = src->head;
+		else
+			fl->head = src->head;
+		fl->last = src->last;
+		fl->count += src->count;
+	}
+	flist_init(src);
+}
+
+/*
+ * Same result of a strcmp() of the two full paths, without building them.
+ * Only when one directory is a prefix of the other, the comparison has to
+ * walk across the directory and name boundary.
+ */
+int flist_cmp(file_list_t const *f1, file_list_t const *f2) {
+	int res;
+	char const *s1 = f1->dir, *s2 = f2->dir;
+	char const *n1 = f1->name, *n2 = f2->name;
+
+	if (s1 == s2)
+		return strcmp(n1, n2);
+	if ((res = memcmp(s1, s2, f1->dlen < f2->dlen ? f1->dlen: f2->dlen)) != 0)
+		return res;
+	if (f1->dlen == f2->dlen)
+		return strcmp(n1, n2);
+	if (f1->dlen < f2->dlen)
+		s1 += f1->dlen, s2 += f1->dlen;
+	else
+		s1 += f2->dlen, s2 += f2->dlen;
+	for (;;) {
+		if (*s1 == '\0' && n1 != NULL)
+			s1 = n1, n1 = NULL;
+		if (*s2 == '\0' && n2 != NULL)
+			s2 = n2, n2 = NULL;
+		if (*s1 != *s2 || *s1 == '\0')
+			return (int) (unsigned char) *s1 - (int) (unsigned char) *s2;
+		s1++;
+		s2++;
+	}
+}
+
+int flist_sort(flist_t *fl) {
+	unsigned long i;
+	file_list_t *fcur, **fidx;
+
+	if (fl->count < 2)
+		return 0;
+	if ((fidx = (file_list_t **) malloc(fl->count * sizeof(file_list_t *))) == NULL)
+		return -1;
+	for (i = 0, fcur = fl->head; fcur != NULL; fcur = fcur->next)
+		fidx[i++] = fcur;
+	qsort(fidx, fl->count, sizeof(file_list_t *), flist_qcmp);
+	for (i = 0; i < fl->count - 1; i++)
+		fidx[i]->next = fidx[i + 1];
+	fidx[i]->next = NULL;
+	fl->head = fidx[0];
+	fl->last = fidx[i];
+	free(fidx);
+
+	return 0;
+}
+
+/*
+ * Drops entries with the same path of the previous one, so it expects a
+ * sorted list.
+ */
+void flist_dedupe(flist_t *fl) {
+	file_list_t *fcur;
+
+	for (fcur = fl->head; fcur != NULL && fcur->next != NULL;) {
+		if (flist_cmp(fcur, fcur->next) == 0) {
+			fcur->next = fcur->next->next;
+			fl->count--;
+		} else
+			fcur = fcur->next;
+	}
+	fl->last = fcur;
+}
+
+char *flist_path(file_list_t const *fent, char *buf, int size) {
+
+	SNPRINTF(buf, size - 1, "%s%s", fent->dir, fent->name);
+	buf[size - 1] = 0;
+
+	return buf;
+}
+
+
@@ -0,0 +1,66 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+
+#if !defined(_QTTY_FLIST_H)
+#define _QTTY_FLIST_H
+
+
+#define QTTY_FLIST_CHUNK (64 * 1024)
+
+
+typedef struct s_file_list {
+	struct s_file_list *next;
+	unsigned long size;
+	char const *dir;
+	int dlen;
+	char name[1];
+} file_list_t;
+
+typedef struct s_flist_chunk {
+	struct s_flist_chunk *next;
+	int size, used;
+	char data[1];
+} flist_chunk_t;
+
+typedef struct s_flist {
+	flist_chunk_t *chunks;
+	file_list_t *head, *last;
+	unsigned long count;
+	char const *ldir;
+	int ldlen;
+} flist_t;
+
+
+
+void flist_init(flist_t *fl);
+void flist_free(flist_t *fl);
+char const *flist_dir(flist_t *fl, char const *dir, int len);
+file_list_t *flist_add(flist_t *fl, char const *dir, char const *name, int len,
+		       unsigned long size);
+file_list_t *flist_add_path(flist_t *fl, char const *path, int len, int sc,
+			    unsigned long size);
+void flist_merge(flist_t *fl, flist_t *src);
+int flist_cmp(file_list_t const *f1, file_list_t const *f2);
+int flist_sort(flist_t *fl);
+void flist_dedupe(flist_t *fl);
+char *flist_path(file_list_t const *fent, char *buf, int size);
+int fglob_get_list(char const *path, char const *match, int recurse, flist_t *fl);
+
+
+#endif
+
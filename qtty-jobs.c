@@ -0,0 +1,446 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#include "qtty.h"
+
+
+
+typedef struct s_jobs_mgr {
+	qtty_cfg_t const *cfg;
+	qtty_stats_t *st;
+	void (*notify)(void *);
+	void *priv;
+	sys_mutex_t mtx;
+	sys_event_t wevt, devt;
+	sys_thread_t thr;
+	int init, started, stop, nextid;
+	qtty_job_t *jobs;
+	qtty_conn_t *qc;
+} jobs_mgr_t;
+
+
+
+static qtty_job_t *jobs_next_queued(void);
+static unsigned long jobs_conn_bytes(qtty_conn_t const *qc);
+static void jobs_abort(qtty_job_t *job);
+static void *jobs_worker_proc(void *priv);
+static qtty_job_t *jobs_find(int id);
+static int jobs_parse_id(char const *line);
+static int jobs_pending(int id);
+
+
+
+static char const * const job_states[] = {
+	"Queued", "Running", "Done", "Failed", "Killed"
+};
+static jobs_mgr_t jmgr;
+
+
+
+/*
+ * Background jobs run one at a time, in submission order, on a worker
+ * thread which owns a second authenticated session, opened on the first
+ * job and kept across jobs. The "notify" callback (if not NULL) is invoked
+ * from the worker thread every time a job ends. The counters of each job
+ * are folded into "st", the main session ones, when the job is reaped.
+ */
+void jobs_init(qtty_cfg_t const *cfg, qtty_stats_t *st, void (*notify)(void *),
+	       void *priv) {
+
+	if (sys_mutex_init(&jmgr.mtx) < 0)
+		return;
+	if (sys_event_init(&jmgr.wevt) < 0) {
+		sys_mutex_free(&jmgr.mtx);
+		return;
+	}
+	if (sys_event_init(&jmgr.devt) < 0) {
+		sys_event_free(&jmgr.wevt);
+		sys_mutex_free(&jmgr.mtx);
+		return;
+	}
+	jmgr.cfg = cfg;
+	jmgr.st = st;
+	jmgr.notify = notify;
+	jmgr.priv = priv;
+	jmgr.nextid = 1;
+	jmgr.init = 1;
+}
+
+/*
+ * Kills whatever is still queued or running, stops the worker, and reports
+ * the final state of all the jobs not reported yet.
+ */
+void jobs_cleanup(FILE *fout) {
+	qtty_job_t *job;
+
+	if (!jmgr.init)
+		return;
+	sys_mutex_lock(&jmgr.mtx);
+	jmgr.stop = 1;
+	for (job = jmgr.jobs; job != NULL; job = job->next)
+		if (job->state == QTTY_JOB_QUEUED) {
+			job->state = QTTY_JOB_KILLED;
+			job->t0 = job->t1 = sys_now();
+		} else if (job->state == QTTY_JOB_RUNNING)
+			jobs_abort(job);
+	sys_mutex_unlock(&jmgr.mtx);
+	if (jmgr.started) {
+		sys_event_signal(&jmgr.wevt);
+		sys_thread_join(jmgr.thr);
+	}
+	if (jmgr.qc != NULL)
+		qconn_close(jmgr.qc);
+	jobs_reap(fout);
+	sys_event_free(&jmgr.devt);
+	sys_event_free(&jmgr.wevt);
+	sys_mutex_free(&jmgr.mtx);
+	jmgr.init = 0;
+}
+
+static qtty_job_t *jobs_next_queued(void) {
+	qtty_job_t *job;
+
+	for (job = jmgr.jobs; job != NULL; job = job->next)
+		if (job->state == QTTY_JOB_QUEUED)
+			return job;
+
+	return NULL;
+}
+
+/*
+ * Unlocked read of counters the worker keeps bumping, which is good enough
+ * for progress reporting.
+ */
+static unsigned long jobs_conn_bytes(qtty_conn_t const *qc) {
+
+	return qc->st.rx_bytes + qc->st.tx_bytes;
+}
+
+/*
+ * Marks the running job as killed and, if its session is open, aborts it
+ * and shuts its socket down, so that a transfer blocked on a stalled link
+ * returns too. Called with the manager lock held, which is also what the
+ * worker takes to publish or drop its session.
+ */
+static void jobs_abort(qtty_job_t *job) {
+
+	job->kill = 1;
+	if (jmgr.qc != NULL) {
+		SYS_STORE_REL(&jmgr.qc->abort, 1);
+		bt_sock_shutdown(jmgr.qc->fd);
+	}
+}
+
+static void *jobs_worker_proc(void *priv) {
+	int res, kill, ready;
+	qtty_job_t *job;
+	qtty_conn_t *qc;
+
+	trace_thread("job-worker");
+	sys_mutex_lock(&jmgr.mtx);
+	for (;;) {
+		while (!jmgr.stop && (job = jobs_next_queued()) == NULL) {
+			sys_mutex_unlock(&jmgr.mtx);
+			sys_event_wait(&jmgr.wevt);
+			sys_mutex_lock(&jmgr.mtx);
+		}
+		if (jmgr.stop)
+			break;
+		job->state = QTTY_JOB_RUNNING;
+		job->t0 = sys_now();
+		sys_mutex_unlock(&jmgr.mtx);
+
+		/*
+		 * A new session is published before the login, so that a kill
+		 * from then on can shut it down. One arriving earlier only
+		 * marks the job, and is seen right after.
+		 */
+		res = -1;
+		ready = jmgr.qc != NULL;
+		if (!ready && (qc = qconn_dial(jmgr.cfg)) != NULL) {
+			sys_mutex_lock(&jmgr.mtx);
+			jmgr.qc = qc;
+			kill = job->kill;
+			sys_mutex_unlock(&jmgr.mtx);
+			ready = !kill && qconn_login(qc, NULL, job->fout) == 0;
+		}
+		sys_mutex_lock(&jmgr.mtx);
+		kill = job->kill;
+		sys_mutex_unlock(&jmgr.mtx);
+		if (kill)
+			fprintf(job->fout, "Killed\n");
+		else if (!ready)
+			fprintf(job->fout, "Unable to open the background session\n");
+		else {
+			job->bytes0 = jobs_conn_bytes(jmgr.qc);
+			res = handle_command(jmgr.qc, job->line, job->fout);
+		}
+
+		/*
+		 * The job takes the session counters with it, and the session
+		 * starts over for the next one.
+		 */
+		sys_mutex_lock(&jmgr.mtx);
+		qc = NULL;
+		if (jmgr.qc != NULL) {
+			if (ready)
+				job->bytes = jobs_conn_bytes(jmgr.qc) - job->bytes0;
+			job->st = jmgr.qc->st;
+			stats_init(&jmgr.qc->st);
+			if (res < 0 || job->kill) {
+				qc = jmgr.qc;
+				jmgr.qc = NULL;
+			}
+		}
+		job->t1 = sys_now();
+		job->state = job->kill ? QTTY_JOB_KILLED:
+			(res == 0 ? QTTY_JOB_DONE: QTTY_JOB_FAILED);
+		sys_mutex_unlock(&jmgr.mtx);
+		if (qc != NULL)
+			qconn_close(qc);
+		sys_event_signal(&jmgr.devt);
+		if (jmgr.notify != NULL)
+			(*jmgr.notify)(jmgr.priv);
+		sys_mutex_lock(&jmgr.mtx);
+	}
+	sys_mutex_unlock(&jmgr.mtx);
+
+	return NULL;
+}
+
+/*
+ * A job line is a get or put command terminated by "&". Anything else,
+ * "&" or not, goes to the device as is.
+ */
+int is_job_line(char const *line) {
+	int len = strlen(line);
+
+	return len > 0 && line[len - 1] == '&' &&
+		(ISCMD(line, len, "get") || ISCMD(line, len, "put"));
+}
+
+int jobs_submit(char const *line, FILE *flerr) {
+	int len;
+	qtty_job_t *job, **pjob;
+
+	if (!jmgr.init) {
+		fprintf(flerr, "Background jobs are not available\n");
+		return 1;
+	}
+	/*
+	 * Jobs run on their own session, which an inherited descriptor
+	 * cannot provide.
+	 */
+	if (!bt_sock_redialable(jmgr.cfg->qcaddr)) {
+		fprintf(flerr, "Background jobs are not available over %s\n",
+			jmgr.cfg->qcaddr);
+		return 1;
+	}
+	len = strlen(line);
+	if ((job = (qtty_job_t *) malloc(sizeof(qtty_job_t) + len)) == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	memcpy(job->line, line, len + 1);
+	trim_line(job->line, " \t&");
+	len = strlen(job->line);
+	if (!ISCMD(job->line, len, "get") && !ISCMD(job->line, len, "put")) {
+		fprintf(flerr, "Only get and put can run in background\n");
+		free(job);
+		return 1;
+	}
+	if ((job->fout = tmpfile()) == NULL) {
+		perror("tmpfile");
+		free(job);
+		return 1;
+	}
+	job->next = NULL;
+	job->state = QTTY_JOB_QUEUED;
+	job->kill = 0;
+	job->t0 = job->t1 = 0;
+	job->bytes0 = job->bytes = 0;
+	stats_init(&job->st);
+
+	sys_mutex_lock(&jmgr.mtx);
+	if (!jmgr.started) {
+		if (sys_thread_create(&jmgr.thr, jobs_worker_proc, NULL) < 0) {
+			sys_mutex_unlock(&jmgr.mtx);
+			fprintf(flerr, "Unable to start the job worker\n");
+			fclose(job->fout);
+			free(job);
+			return 1;
+		}
+		jmgr.started = 1;
+	}
+	job->id = jmgr.nextid++;
+	for (pjob = &jmgr.jobs; *pjob != NULL; pjob = &(*pjob)->next);
+	*pjob = job;
+	sys_mutex_unlock(&jmgr.mtx);
+	sys_event_signal(&jmgr.wevt);
+	fprintf(flerr, "[%d] %s\n", job->id, job->line);
+
+	return 0;
+}
+
+void jobs_list(FILE *fout) {
+	unsigned long bytes;
+	double secs;
+	qtty_job_t *job;
+
+	if (!jmgr.init)
+		return;
+	sys_mutex_lock(&jmgr.mtx);
+	for (job = jmgr.jobs; job != NULL; job = job->next) {
+		bytes = job->bytes;
+		secs = job->t1 - job->t0;
+		if (job->state == QTTY_JOB_RUNNING) {
+			bytes = jmgr.qc != NULL ? jobs_conn_bytes(jmgr.qc) - job->bytes0: 0;
+			secs = sys_now() - job->t0;
+		}
+		fprintf(fout, "[%d] %-8s", job->id, job_states[job->state]);
+		if (job->state != QTTY_JOB_QUEUED)
+			fprintf(fout, " %lu bytes, %.1f s, %.2f MB/s", bytes, secs,
+				secs > 0 ? bytes / (1048576.0 * secs): 0.0);
+		fprintf(fout, "  %s\n", job->line);
+	}
+	sys_mutex_unlock(&jmgr.mtx);
+}
+
+static qtty_job_t *jobs_find(int id) {
+	qtty_job_t *job;
+
+	for (job = jmgr.jobs; job != NULL; job = job->next)
+		if (job->id == id)
+			return job;
+
+	return NULL;
+}
+
+/*
+ * Parses the optional job argument of wait/kill, either "N" or "%N".
+ * Returns 0 if missing, and -1 if invalid.
+ */
+static int jobs_parse_id(char const *line) {
+	char const *arg;
+
+	if ((arg = strpbrk(line, " \t")) == NULL)
+		return 0;
+	arg += strspn(arg, " \t");
+	if (*arg == '%')
+		arg++;
+	if (!*arg)
+		return 0;
+
+	return *arg >= '0' && *arg <= '9' ? atoi(arg): -1;
+}
+
+static int jobs_pending(int id) {
+	qtty_job_t *job;
+
+	for (job = jmgr.jobs; job != NULL; job = job->next)
+		if ((id == 0 || job->id == id) &&
+		    (job->state == QTTY_JOB_QUEUED || job->state == QTTY_JOB_RUNNING))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Waits for the job given in the "wait [%N]" command line, or for all of
+ * them, and reports what ended.
+ */
+int jobs_wait(char const *line, FILE *fout) {
+	int id = jobs_parse_id(line);
+
+	if (!jmgr.init)
+		return 0;
+	sys_mutex_lock(&jmgr.mtx);
+	if (id < 0 || (id > 0 && jobs_find(id) == NULL)) {
+		sys_mutex_unlock(&jmgr.mtx);
+		fprintf(fout, "No such job: %s\n", line);
+		return 1;
+	}
+	while (jobs_pending(id)) {
+		sys_mutex_unlock(&jmgr.mtx);
+		sys_event_wait(&jmgr.devt);
+		sys_mutex_lock(&jmgr.mtx);
+	}
+	sys_mutex_unlock(&jmgr.mtx);
+	jobs_reap(fout);
+
+	return 0;
+}
+
+/*
+ * Queued jobs are simply dropped, while a running one has its session
+ * aborted and its socket shut down.
+ */
+int jobs_kill(char const *line, FILE *fout) {
+	int id = jobs_parse_id(line);
+	qtty_job_t *job;
+
+	if (!jmgr.init)
+		return 0;
+	sys_mutex_lock(&jmgr.mtx);
+	if (id <= 0 || (job = jobs_find(id)) == NULL) {
+		sys_mutex_unlock(&jmgr.mtx);
+		fprintf(fout, "No such job: %s\n", line);
+		return 1;
+	}
+	if (job->state == QTTY_JOB_QUEUED) {
+		job->state = QTTY_JOB_KILLED;
+		job->t0 = job->t1 = sys_now();
+	} else if (job->state == QTTY_JOB_RUNNING)
+		jobs_abort(job);
+	sys_mutex_unlock(&jmgr.mtx);
+	jobs_reap(fout);
+
+	return 0;
+}
+
+/*
+ * Reports the jobs which ended since the last call, together with their
+ * captured output, and drops them.
+ */
+void jobs_reap(FILE *fout) {
+	int size;
+	qtty_job_t *job, **pjob;
+	char buf[1024];
+
+	if (!jmgr.init)
+		return;
+	sys_mutex_lock(&jmgr.mtx);
+	for (pjob = &jmgr.jobs; (job = *pjob) != NULL;) {
+		if (job->state == QTTY_JOB_QUEUED || job->state == QTTY_JOB_RUNNING) {
+			pjob = &job->next;
+			continue;
+		}
+		*pjob = job->next;
+		fprintf(fout, "[%d] %s (%lu bytes, %.1f s)  %s\n", job->id,
+			job_states[job->state], job->bytes, job->t1 - job->t0, job->line);
+		if (jmgr.st != NULL)
+			stats_merge(jmgr.st, &job->st);
+		rewind(job->fout);
+		while ((size = (int) fread(buf, 1, sizeof(buf), job->fout)) > 0)
+			fwrite(buf, 1, size, fout);
+		fclose(job->fout);
+		free(job);
+	}
+	sys_mutex_unlock(&jmgr.mtx);
+	fflush(fout);
+}
+
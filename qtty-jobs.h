@@ -0,0 +1,55 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#if !defined(_QTTY_JOBS_H)
+#define _QTTY_JOBS_H
+
+
+#define QTTY_JOB_QUEUED 0
+#define QTTY_JOB_RUNNING 1
+#define QTTY_JOB_DONE 2
+#define QTTY_JOB_FAILED 3
+#define QTTY_JOB_KILLED 4
+
+#define ISJOBKILL(p, n) (ISCMD(p, n, "kill") && strchr(p, '%') != NULL)
+
+
+typedef struct s_qtty_job {
+	struct s_qtty_job *next;
+	int id, state, kill;
+	double t0, t1;
+	unsigned long bytes0, bytes;
+	qtty_stats_t st;
+	FILE *fout;
+	char line[1];
+} qtty_job_t;
+
+
+
+void jobs_init(qtty_cfg_t const *cfg, qtty_stats_t *st, void (*notify)(void *),
+	       void *priv);
+void jobs_cleanup(FILE *fout);
+int is_job_line(char const *line);
+int jobs_submit(char const *line, FILE *flerr);
+void jobs_list(FILE *fout);
+int jobs_wait(char const *line, FILE *fout);
+int jobs_kill(char const *line, FILE *fout);
+void jobs_reap(FILE *fout);
+
+
+#endif
+
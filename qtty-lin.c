@@ -19,114 +19,422 @@
 
 
 #define QTTY_HISTORY_FILE ".qtty_history"
+#define QTTY_PROMPT "$ "
+#define QTTY_HANGUP_MSG "\nRemote server shut down\n"
 
 
-static bt_sock_t qcfd;
+typedef struct s_line_ent {
+	struct s_line_ent *next;
+	char line[1];
+} line_ent_t;
+
+
+
+static char *rdln_hide(int *point);
+static void rdln_show(char *text, int point);
+static void rdln_print(char const *data, int size);
+static void break_handler(int sig);
+static void job_notify(void *priv);
+static void job_events(void);
+static int remote_input(void);
+static int drain_pending(void);
+static int run_line(char *line);
+static void run_queue(void);
+static void line_handler(char *line);
+static int run_batch(char * const *cmds, int ncmds, char const *bfile, int window,
+		     char const *sfile);
+
+
+
+static qtty_cfg_t qcfg;
+static qtty_conn_t *qconn;
 static volatile int qquit, sigexit;
+static int qeof, jpipe[2] = { -1, -1 };
+static double qpend_t0;
+static char *qpend;
+static line_ent_t *lhead, **ltail = &lhead;
 
 
 
-static int rdln_event_hook(void) {
-	struct pollfd pfd;
+/*
+ * Output is printed without mangling the line being edited: the input
+ * line is taken off the screen, the data written, and the line restored.
+ */
+static char *rdln_hide(int *point) {
+	char *text;
 
-	pfd.fd = qcfd;
-	pfd.events = POLLIN | POLLOUT;
-	pfd.revents = 0;
-	poll(&pfd, 1, 0);
+	*point = rl_point;
+	text = rl_copy_text(0, rl_end);
+	rl_save_prompt();
+	rl_replace_line("", 0);
+	rl_redisplay();
 
-	if (pfd.revents & (POLLERR | POLLHUP)) {
-		fprintf(stderr, "\nRemote server shut down\n");
-		rl_done = 1;
-		qquit++;
-	}
+	return text;
+}
 
-	return 0;
+static void rdln_show(char *text, int point) {
+
+	fflush(stderr);
+	rl_restore_prompt();
+	rl_replace_line(text != NULL ? text: "", 0);
+	rl_point = point;
+	rl_redisplay();
+	free(text);
+}
+
+static void rdln_print(char const *data, int size) {
+	int point;
+	char *text;
+
+	text = rdln_hide(&point);
+	fwrite(data, 1, size, stderr);
+	rdln_show(text, point);
 }
 
 static void break_handler(int sig) {
 
-	rl_done = 1;
 	qquit++;
 	sigexit++;
 }
 
+/*
+ * Called by the job worker thread, it only wakes up the event loop.
+ */
+static void job_notify(void *priv) {
+	char c = 0;
+
+	if (write(jpipe[1], &c, 1) < 0)
+		return;
+}
+
+static void job_events(void) {
+	int point;
+	char *text;
+	char buf[64];
+
+	while (read(jpipe[0], buf, sizeof(buf)) > 0);
+	text = rdln_hide(&point);
+	jobs_reap(stderr);
+	rdln_show(text, point);
+}
+
+/*
+ * Consumes what the socket has ready, printing the output of the pending
+ * command (or any unsolicited data) as it arrives. The empty packet which
+ * ends the pending command brings back the prompt and starts the next
+ * queued line. Returns -1 when the remote side is gone.
+ */
+static int remote_input(void) {
+	int size;
+	char const *data;
+
+	if (qconn_read_avail(qconn) <= 0)
+		return -1;
+	while (qconn_pkt_ready(qconn)) {
+		if (next_pkt(qconn, &data, &size) < 0)
+			return -1;
+		if (size) {
+			rdln_print(data, size);
+			continue;
+		}
+		if (qpend != NULL) {
+			TRACE_EVENT("bounce", qpend_t0, 0, qpend);
+			free(qpend);
+			qpend = NULL;
+			run_queue();
+			if (qpend == NULL && !qquit) {
+				rl_set_prompt(QTTY_PROMPT);
+				rl_forced_update_display();
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Waits for the pending command to end, still echoing its output, so that
+ * the connection can be used synchronously again.
+ */
+static int drain_pending(void) {
+	int size;
+	char const *data;
+
+	for (; qpend != NULL;) {
+		if (next_pkt(qconn, &data, &size) < 0)
+			return -1;
+		if (size) {
+			fwrite(data, 1, size, stderr);
+			continue;
+		}
+		free(qpend);
+		qpend = NULL;
+	}
+
+	return 0;
+}
+
+/*
+ * Plain remote commands are sent and left running, with their output
+ * handled by remote_input(), while the rest go through handle_command()
+ * synchronously. Returns -1 when the session is over.
+ */
+static int run_line(char *line) {
+
+	if (!is_bounce_cmd(line))
+		return handle_command(qconn, line, stderr);
+	if ((qpend = strdup(line)) == NULL) {
+		perror("malloc");
+		return 0;
+	}
+	if (send_cmd(qconn, line) < 0 || flush_pkts(qconn) < 0) {
+		fprintf(stderr, "Remote server shut down\n");
+		return -1;
+	}
+	qpend_t0 = qconn->st.cur.t0;
+	rl_set_prompt("");
+
+	return 0;
+}
+
+static void run_queue(void) {
+	line_ent_t *lent;
+
+	while (qpend == NULL && !qquit && (lent = lhead) != NULL) {
+		if ((lhead = lent->next) == NULL)
+			ltail = &lhead;
+		if (run_line(lent->line) < 0)
+			qquit++;
+		free(lent);
+	}
+	if (qpend == NULL && lhead == NULL && qeof)
+		qquit++;
+}
+
+/*
+ * Lines typed while a command is running are queued, and run in order as
+ * the previous ones complete.
+ */
+static void line_handler(char *line) {
+	line_ent_t *lent;
+
+	if (line == NULL) {
+		qeof++;
+		run_queue();
+		return;
+	}
+	trim_line(line, " \r\n\t");
+	if (*line) {
+		add_history(line);
+		if ((lent = (line_ent_t *)
+		     malloc(sizeof(line_ent_t) + strlen(line))) == NULL)
+			perror("malloc");
+		else {
+			strcpy(lent->line, line);
+			lent->next = NULL;
+			*ltail = lent;
+			ltail = &lent->next;
+		}
+	}
+	free(line);
+	run_queue();
+	if (qquit)
+		rl_callback_handler_remove();
+}
+
+/*
+ * Non-interactive mode, running the "-c" commands and then the "-f" script
+ * lines with do_batch(), with output going to stdout.
+ */
+static int run_batch(char * const *cmds, int ncmds, char const *bfile, int window,
+		     char const *sfile) {
+	int res;
+	FILE *fin = NULL;
+
+	if (bfile != NULL &&
+	    (fin = strcmp(bfile, "-") ? fopen(bfile, "rt"): stdin) == NULL) {
+		perror(bfile);
+		return 1;
+	}
+	if ((res = qconn_connect(&qcfg, NULL, stderr, &qconn)) < 0) {
+		if (fin != NULL && fin != stdin)
+			fclose(fin);
+		return -res;
+	}
+	res = do_batch(qconn, cmds, ncmds, fin, window, stdout);
+	if (sfile != NULL)
+		stats_export(&qconn->st, qcfg.qcaddr, sfile);
+	qconn_close(qconn);
+	trace_close();
+	if (fin != NULL && fin != stdin)
+		fclose(fin);
+
+	return res < 0 ? 1: res;
+}
+
 int main(int ac, char **av) {
-	int i, size, channel = -1;
-	char *prompt = "$ ", *line, *user = NULL, *passwd = NULL, *qcaddr = NULL;
-	char const *home;
-	char hfile[256];
+	int i, res, epfd, nevt, ncmds = 0, window = QTTY_BATCH_WINDOW;
+	char const *home, *sfile = NULL, *tfile = NULL, *bfile = NULL;
+	char **cmds;
+	struct epoll_event evt, evts[3];
+	line_ent_t *lent;
+	char hfile[256], xlfile[256];
 
-	signal(SIGQUIT, break_handler);
-	signal(SIGINT, break_handler);
-	rl_initialize();
-	rl_event_hook = rdln_event_hook;
-	if ((home = getenv("HOME")) != NULL)
-		SNPRINTF(hfile, sizeof(hfile), "%s/%s", home, QTTY_HISTORY_FILE);
-	else
-		SNPRINTF(hfile, sizeof(hfile), "%s", QTTY_HISTORY_FILE);
-	hfile[sizeof(hfile) - 1] = 0;
-	read_history_range(hfile, 0, -1);
+	sha1_setup();
+	if ((cmds = (char **) malloc(ac * sizeof(char *))) == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	qcfg.channel = -1;
 	for (i = 1; i < ac; i++) {
 		if (!strcmp(av[i], "--user")) {
 			if (++i < ac)
-				user = av[i];
+				qcfg.user = av[i];
 		} else if (!strcmp(av[i], "--pass")) {
 			if (++i < ac)
-				passwd = av[i];
+				qcfg.passwd = av[i];
 		} else if (!strcmp(av[i], "--qc-addr")) {
 			if (++i < ac)
-				qcaddr = av[i];
+				qcfg.qcaddr = av[i];
 		} else if (!strcmp(av[i], "--qc-channel")) {
 			if (++i < ac)
-				channel = atoi(av[i]);
+				qcfg.channel = atoi(av[i]);
+		} else if (!strcmp(av[i], "--get-queue")) {
+			if (++i < ac)
+				qcfg.getq = atoi(av[i]);
+		} else if (!strcmp(av[i], "--put-queue")) {
+			if (++i < ac)
+				qcfg.putq = atoi(av[i]);
+		} else if (!strcmp(av[i], "--put-chunk")) {
+			if (++i < ac)
+				qcfg.putchunk = atoi(av[i]);
+		} else if (!strcmp(av[i], "--get-mmap")) {
+			qcfg.getsink |= QTTY_SINK_MMAP;
+		} else if (!strcmp(av[i], "--get-nocache")) {
+			qcfg.getsink |= QTTY_SINK_NOCACHE;
+		} else if (!strcmp(av[i], "--uring")) {
+			qcfg.uring = 1;
+		} else if (!strcmp(av[i], "--compress")) {
+			if (++i < ac)
+				qcfg.zlevel = atoi(av[i]);
+		} else if (!strcmp(av[i], "--stats-file")) {
+			if (++i < ac)
+				sfile = av[i];
+		} else if (!strcmp(av[i], "--trace")) {
+			if (++i < ac)
+				tfile = av[i];
+		} else if (!strcmp(av[i], "--xfer-log")) {
+			if (++i < ac)
+				qcfg.xlog = av[i];
+		} else if (!strcmp(av[i], "-c")) {
+			if (++i < ac)
+				cmds[ncmds++] = av[i];
+		} else if (!strcmp(av[i], "-f")) {
+			if (++i < ac)
+				bfile = av[i];
+		} else if (!strcmp(av[i], "--window")) {
+			if (++i < ac)
+				window = atoi(av[i]);
 		} else {
 			usage(av[0]);
+			free(cmds);
 			return 1;
 		}
 	}
-	if (!qcaddr || channel < 0 || !user || !passwd) {
+	if (!qcfg.qcaddr || !qcfg.user || !qcfg.passwd) {
 		usage(av[0]);
+		free(cmds);
 		return 1;
 	}
+	if (qcfg.xlog == NULL)
+		qcfg.xlog = xlog_path(xlfile, sizeof(xlfile));
+	else if (!*qcfg.xlog)
+		qcfg.xlog = NULL;
 
-	fprintf(stderr, "Opening connection to %s (%d)\n", qcaddr, channel);
-	fflush(stderr);
-	if ((qcfd = bt_sock_open(qcaddr, channel)) == INVALID_BT_SOCK)
+	if (trace_open(tfile) < 0) {
+		fprintf(stderr, "Unable to start tracing\n");
+		free(cmds);
 		return 1;
-	if (recv_pkt(qcfd, &line, &size) < 0) {
-		bt_sock_close(qcfd);
+	}
+	if (ncmds > 0 || bfile != NULL) {
+		res = run_batch(cmds, ncmds, bfile, window, sfile);
+		free(cmds);
+		return res;
+	}
+	free(cmds);
+
+	signal(SIGQUIT, break_handler);
+	signal(SIGINT, break_handler);
+	if ((home = getenv("HOME")) != NULL)
+		SNPRINTF(hfile, sizeof(hfile), "%s/%s", home, QTTY_HISTORY_FILE);
+	else
+		SNPRINTF(hfile, sizeof(hfile), "%s", QTTY_HISTORY_FILE);
+	hfile[sizeof(hfile) - 1] = 0;
+	read_history_range(hfile, 0, -1);
+
+	fprintf(stderr, "Opening connection to %s (%d)\n", qcfg.qcaddr, qcfg.channel);
+	fflush(stderr);
+	if ((res = qconn_connect(&qcfg, stderr, stderr, &qconn)) < 0)
+		return -res;
+
+	if ((epfd = epoll_create1(0)) < 0) {
+		perror("epoll_create1");
+		qconn_close(qconn);
 		return 1;
 	}
-	fprintf(stderr, "%s", line);
-	if (do_login(qcfd, line, user, passwd, stderr) < 0) {
-		free(line);
-		bt_sock_close(qcfd);
-		return 2;
+	evt.events = EPOLLIN;
+	evt.data.fd = fileno(stdin);
+	epoll_ctl(epfd, EPOLL_CTL_ADD, fileno(stdin), &evt);
+	evt.events = EPOLLIN | EPOLLRDHUP;
+	evt.data.fd = bt_sock_fd(qconn->fd);
+	epoll_ctl(epfd, EPOLL_CTL_ADD, evt.data.fd, &evt);
+	if (pipe(jpipe) == 0) {
+		fcntl(jpipe[0], F_SETFL, O_NONBLOCK);
+		fcntl(jpipe[1], F_SETFL, O_NONBLOCK);
+		evt.events = EPOLLIN;
+		evt.data.fd = jpipe[0];
+		epoll_ctl(epfd, EPOLL_CTL_ADD, jpipe[0], &evt);
+		jobs_init(&qcfg, &qconn->st, job_notify, NULL);
 	}
-	free(line);
+	rl_callback_handler_install(QTTY_PROMPT, line_handler);
 
-	for (; !qquit;) {
-		line = readline(prompt);
-		if (!line)
+	while (!qquit) {
+		if ((nevt = epoll_wait(epfd, evts, 3, -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
 			break;
-		trim_line(line, " \r\n\t");
-		if (!*line) {
-			free(line);
-			continue;
 		}
-		add_history(line);
-
-		if (handle_command(qcfd, line, stderr) < 0) {
-			free(line);
-			break;
+		for (i = 0; i < nevt && !qquit; i++) {
+			if (evts[i].data.fd == jpipe[0])
+				job_events();
+			else if (evts[i].data.fd != bt_sock_fd(qconn->fd))
+				rl_callback_read_char();
+			else if (remote_input() < 0) {
+				rdln_print(QTTY_HANGUP_MSG, STRSIZE(QTTY_HANGUP_MSG));
+				qquit++;
+				sigexit = 0;
+			}
 		}
-
-		free(line);
+	}
+	rl_callback_handler_remove();
+	close(epfd);
+	jobs_cleanup(stderr);
+	if (jpipe[0] >= 0) {
+		close(jpipe[0]);
+		close(jpipe[1]);
+	}
+	while ((lent = lhead) != NULL) {
+		lhead = lent->next;
+		free(lent);
 	}
 
-	if (sigexit)
-		handle_bounce_cmd(qcfd, "exit", stderr);
-	bt_sock_close(qcfd);
+	if (sigexit && drain_pending() == 0)
+		handle_bounce_cmd(qconn, "exit", stderr);
+	if (sfile != NULL)
+		stats_export(&qconn->st, qcfg.qcaddr, sfile);
+	qconn_close(qconn);
+	trace_close();
 	write_history(hfile);
 
 	return 0;
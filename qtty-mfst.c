@@ -0,0 +1,291 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#include "qtty.h"
+
+
+
+static int mfst_ent_cmp(void const *p1, void const *p2);
+static int mfst_add(mfst_t *mf, char const *rpath, unsigned long size,
+		    unsigned long mtime, unsigned char const *digest);
+static int hex2bin(char const *hex, unsigned char *bin, int size);
+
+
+
+static int mfst_ent_cmp(void const *p1, void const *p2) {
+
+	return strcmp(((mfst_ent_t const *) p1)->rpath,
+		      ((mfst_ent_t const *) p2)->rpath);
+}
+
+static int mfst_add(mfst_t *mf, char const *rpath, unsigned long size,
+		    unsigned long mtime, unsigned char const *digest) {
+	int nalloc;
+	mfst_ent_t *ents, *ent;
+
+	if (mf->count == mf->alloc) {
+		nalloc = mf->alloc ? 2 * mf->alloc: 256;
+		if ((ents = (mfst_ent_t *)
+		     realloc(mf->ents, nalloc * sizeof(mfst_ent_t))) == NULL)
+			return -1;
+		mf->ents = ents;
+		mf->alloc = nalloc;
+	}
+	ent = &mf->ents[mf->count];
+	if ((ent->rpath = strdup(rpath)) == NULL)
+		return -1;
+	ent->size = size;
+	ent->mtime = mtime;
+	memcpy(ent->digest, digest, SHA1_DIGEST_SIZE);
+	mf->count++;
+
+	return 0;
+}
+
+static int hex2bin(char const *hex, unsigned char *bin, int size) {
+	int i;
+	unsigned int byte;
+
+	for (i = 0; i < size; i++, hex += 2) {
+		if (sscanf(hex, "%2x", &byte) != 1)
+			return -1;
+		bin[i] = (unsigned char) byte;
+	}
+
+	return 0;
+}
+
+/*
+ * Manifests are kept per device, under $HOME/.qtty-manifests, in a file
+ * named after the device address and channel.
+ */
+char *mfst_path(qtty_cfg_t const *cfg, char *path, int size) {
+	int i, len;
+	char const *home;
+
+	if ((home = getenv("HOME")) == NULL)
+		home = ".";
+	SNPRINTF(path, size, "%s%s%s", home, SYS_SLASHS, QTTY_MFST_DIR);
+	path[size - 1] = 0;
+	if (!PATH_EXIST(path))
+		MKDIR(path, 0775);
+	len = strlen(path);
+	if (cfg != NULL)
+		SNPRINTF(path + len, size - len, "%s%s-%d", SYS_SLASHS,
+			 cfg->qcaddr, cfg->channel);
+	else
+		SNPRINTF(path + len, size - len, "%sdefault", SYS_SLASHS);
+	path[size - 1] = 0;
+	for (i = len + 1; path[i]; i++)
+		if (!((path[i] >= 'a' && path[i] <= 'z') ||
+		      (path[i] >= 'A' && path[i] <= 'Z') ||
+		      (path[i] >= '0' && path[i] <= '9') ||
+		      path[i] == '-' || path[i] == '.'))
+			path[i] = '_';
+
+	return path;
+}
+
+/*
+ * Loads the manifest at "path". A missing manifest is not an error, and
+ * simply yields an empty one.
+ */
+int mfst_load(mfst_t *mf, char const *path) {
+	int len;
+	unsigned long size, mtime;
+	FILE *file;
+	unsigned char digest[SHA1_DIGEST_SIZE];
+	char hex[2 * SHA1_DIGEST_SIZE + 1];
+	char buf[1200];
+
+	memset(mf, 0, sizeof(*mf));
+	SNPRINTF(mf->path, sizeof(mf->path), "%s", path);
+	mf->path[sizeof(mf->path) - 1] = 0;
+	if ((file = fopen(path, "rt")) == NULL)
+		return 0;
+	if (fgets(buf, sizeof(buf), file) == NULL ||
+	    strcmp(buf, QTTY_MFST_MAGIC "\n") != 0) {
+		fclose(file);
+		return 0;
+	}
+	while (fgets(buf, sizeof(buf), file) != NULL) {
+		if ((len = strlen(buf)) > 0 && buf[len - 1] == '\n')
+			buf[--len] = 0;
+		if (sscanf(buf, "%lu %lu %40s %n", &size, &mtime, hex, &len) != 3 ||
+		    hex2bin(hex, digest, SHA1_DIGEST_SIZE) < 0)
+			continue;
+		if (mfst_add(mf, buf + len, size, mtime, digest) < 0) {
+			fclose(file);
+			mfst_free(mf);
+			return -1;
+		}
+	}
+	fclose(file);
+	qsort(mf->ents, mf->count, sizeof(mfst_ent_t), mfst_ent_cmp);
+	mf->nsorted = mf->count;
+
+	return 0;
+}
+
+void mfst_free(mfst_t *mf) {
+	int i;
+
+	for (i = 0; i < mf->count; i++)
+		free(mf->ents[i].rpath);
+	free(mf->ents);
+	mf->ents = NULL;
+	mf->count = mf->nsorted = mf->alloc = 0;
+}
+
+/*
+ * Entries added during a run are appended past the sorted range, and are
+ * not searched: a run never visits the same remote path twice.
+ */
+mfst_ent_t *mfst_find(mfst_t *mf, char const *rpath) {
+	mfst_ent_t key;
+
+	key.rpath = (char *) rpath;
+
+	return (mfst_ent_t *) bsearch(&key, mf->ents, mf->nsorted, sizeof(mfst_ent_t),
+				      mfst_ent_cmp);
+}
+
+int mfst_set(mfst_t *mf, char const *rpath, unsigned long size, unsigned long mtime,
+	     unsigned char const *digest) {
+	mfst_ent_t *ent;
+
+	mf->dirty = 1;
+	if ((ent = mfst_find(mf, rpath)) == NULL)
+		return mfst_add(mf, rpath, size, mtime, digest);
+	ent->size = size;
+	ent->mtime = mtime;
+	memcpy(ent->digest, digest, SHA1_DIGEST_SIZE);
+
+	return 0;
+}
+
+int mfst_save(mfst_t *mf) {
+	int i, j;
+	FILE *file;
+	char tpath[1100];
+
+	if (!mf->dirty)
+		return 0;
+	qsort(mf->ents, mf->count, sizeof(mfst_ent_t), mfst_ent_cmp);
+	mf->nsorted = mf->count;
+	SNPRINTF(tpath, sizeof(tpath), "%s.tmp", mf->path);
+	tpath[sizeof(tpath) - 1] = 0;
+	if ((file = fopen(tpath, "wt")) == NULL) {
+		perror(tpath);
+		return -1;
+	}
+	fprintf(file, "%s\n", QTTY_MFST_MAGIC);
+	for (i = 0; i < mf->count; i++) {
+		fprintf(file, "%lu %lu ", mf->ents[i].size, mf->ents[i].mtime);
+		for (j = 0; j < SHA1_DIGEST_SIZE; j++)
+			fprintf(file, "%02x", (unsigned int) mf->ents[i].digest[j]);
+		fprintf(file, " %s\n", mf->ents[i].rpath);
+	}
+	if (fclose(file)) {
+		perror(tpath);
+		remove(tpath);
+		return -1;
+	}
+	if (rename(tpath, mf->path)) {
+		remove(mf->path);
+		if (rename(tpath, mf->path)) {
+			perror(mf->path);
+			remove(tpath);
+			return -1;
+		}
+	}
+	mf->dirty = 0;
+
+	return 0;
+}
+
+int sha1_file(char const *path, unsigned char *digest) {
+	int size;
+	FILE *file;
+	sha1_ctx_t sctx;
+	unsigned char buf[1024 * 16];
+
+	if ((file = fopen(path, "rb")) == NULL)
+		return -1;
+	sha1_init(&sctx);
+	while ((size = (int) fread(buf, 1, sizeof(buf), file)) > 0)
+		sha1_update(&sctx, buf, (unsigned int) size);
+	if (ferror(file)) {
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+	sha1_final(digest, &sctx);
+
+	return 0;
+}
+
+/*
+ * sha1_file() over up to MFST_HASH_FILES files, read in step so that
+ * sha1_update_mb() hashes them side by side. The result of each file goes
+ * in the "res" of its "hs" entry.
+ */
+int sha1_files(char const * const *paths, int n, mfst_hash_t *hs) {
+	int i, k, left, size;
+	unsigned int lens[MFST_HASH_FILES];
+	FILE *files[MFST_HASH_FILES];
+	sha1_ctx_t sctxs[MFST_HASH_FILES];
+	sha1_ctx_t *cptrs[MFST_HASH_FILES];
+	unsigned char const *dptrs[MFST_HASH_FILES];
+	unsigned char *buf;
+
+	if (n > MFST_HASH_FILES ||
+	    (buf = (unsigned char *) malloc(n * MFST_HASH_BUF)) == NULL)
+		return -1;
+	for (i = left = 0; i < n; i++) {
+		sha1_init(&sctxs[i]);
+		if ((files[i] = fopen(paths[i], "rb")) != NULL)
+			left++;
+		hs[i].res = files[i] != NULL ? 0: -1;
+	}
+	while (left > 0) {
+		for (i = k = 0; i < n; i++) {
+			if (files[i] == NULL)
+				continue;
+			if ((size = (int) fread(buf + i * MFST_HASH_BUF, 1, MFST_HASH_BUF,
+						files[i])) > 0) {
+				cptrs[k] = &sctxs[i];
+				dptrs[k] = buf + i * MFST_HASH_BUF;
+				lens[k++] = (unsigned int) size;
+			} else {
+				if (ferror(files[i]))
+					hs[i].res = -1;
+				fclose(files[i]);
+				files[i] = NULL;
+				left--;
+			}
+		}
+		sha1_update_mb(cptrs, dptrs, lens, k);
+	}
+	for (i = 0; i < n; i++)
+		if (hs[i].res == 0)
+			sha1_final(hs[i].digest, &sctxs[i]);
+	free(buf);
+
+	return 0;
+}
+
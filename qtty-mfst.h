@@ -0,0 +1,62 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#if !defined(_QTTY_MFST_H)
+#define _QTTY_MFST_H
+
+
+#define QTTY_MFST_DIR ".qtty-manifests"
+#define QTTY_MFST_MAGIC "QTTYM1"
+#define MFST_HASH_FILES 8
+#define MFST_HASH_BUF (1024 * 64)
+
+
+typedef struct s_mfst_ent {
+	char *rpath;
+	unsigned long size, mtime;
+	unsigned char digest[SHA1_DIGEST_SIZE];
+} mfst_ent_t;
+
+typedef struct s_mfst {
+	char path[1024];
+	int count, nsorted, alloc, dirty;
+	mfst_ent_t *ents;
+	unsigned long nsent, nskip;
+	unsigned long bsent, bskip;
+} mfst_t;
+
+typedef struct s_mfst_hash {
+	int res;
+	unsigned long size, mtime;
+	unsigned char digest[SHA1_DIGEST_SIZE];
+} mfst_hash_t;
+
+
+
+char *mfst_path(qtty_cfg_t const *cfg, char *path, int size);
+int mfst_load(mfst_t *mf, char const *path);
+void mfst_free(mfst_t *mf);
+mfst_ent_t *mfst_find(mfst_t *mf, char const *rpath);
+int mfst_set(mfst_t *mf, char const *rpath, unsigned long size, unsigned long mtime,
+	     unsigned char const *digest);
+int mfst_save(mfst_t *mf);
+int sha1_file(char const *path, unsigned char *digest);
+int sha1_files(char const * const *paths, int n, mfst_hash_t *hs);
+
+
+#endif
+
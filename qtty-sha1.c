@@ -19,6 +19,12 @@
 #include <string.h>
 #include "qtty-sha1.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(SHA1_NO_SIMD)
+#define SHA1_X86_SIMD
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 
 
 #define ROL(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
@@ -39,6 +45,17 @@
 #define R3(v, w, x, y, z, i) z += (((w | x) & y) | (w & x)) + BLK(i) + 0x8F1BBCDC + ROL(v, 5); w = ROL(w, 30);
 #define R4(v, w, x, y, z, i) z += (w ^ x ^ y) + BLK(i) + 0xCA62C1D6 + ROL(v, 5); w = ROL(w, 30);
 
+/* Rounds over a precomputed W[i] + K schedule */
+#define RW0(v, w, x, y, z, i) z += ((w & (x ^ y)) ^ y) + wk[i] + ROL(v, 5); w = ROL(w, 30);
+#define RW2(v, w, x, y, z, i) z += (w ^ x ^ y) + wk[i] + ROL(v, 5); w = ROL(w, 30);
+#define RW3(v, w, x, y, z, i) z += (((w | x) & y) | (w & x)) + wk[i] + ROL(v, 5); w = ROL(w, 30);
+#define RW5(r, v, w, x, y, z, i) r(v, w, x, y, z, i); r(z, v, w, x, y, i + 1); \
+	r(y, z, v, w, x, i + 2); r(x, y, z, v, w, i + 3); r(w, x, y, z, v, i + 4);
+#define RW20(r, i) RW5(r, a, b, c, d, e, i); RW5(r, a, b, c, d, e, i + 5); \
+	RW5(r, a, b, c, d, e, i + 10); RW5(r, a, b, c, d, e, i + 15);
+
+#define SHA1_MB_LANES 8
+
 
 
 typedef union {
@@ -46,9 +63,40 @@ typedef union {
 	sha1_int32 l[16];
 } char64long16_t;
 
+typedef void (*sha1_blocks_t)(sha1_int32 state[5], unsigned char const *data,
+			      unsigned int nblocks);
+
 
 
 static void sha1_transform(sha1_int32 state[5], unsigned char const *buffer);
+static void sha1_blocks_c(sha1_int32 state[5], unsigned char const *data,
+			  unsigned int nblocks);
+#if defined(SHA1_X86_SIMD)
+static int sha1_cpu_caps(void);
+static void sha1_blocks_ssse3(sha1_int32 state[5], unsigned char const *data,
+			      unsigned int nblocks);
+static void sha1_blocks_shani(sha1_int32 state[5], unsigned char const *data,
+			      unsigned int nblocks);
+static void sha1_blocks_x8(sha1_int32 *states[SHA1_MB_LANES],
+			   unsigned char const *data[SHA1_MB_LANES], unsigned int nblocks);
+#endif
+static void sha1_count(sha1_ctx_t *context, unsigned int len);
+
+
+
+static char const * const sha1_impl_names[] = {
+	"c", "ssse3", "shani", "avx2"
+};
+static sha1_blocks_t const sha1_impl_procs[] = {
+	sha1_blocks_c,
+#if defined(SHA1_X86_SIMD)
+	sha1_blocks_ssse3, sha1_blocks_shani
+#else
+	NULL, NULL
+#endif
+};
+static sha1_blocks_t sha1_blocks = sha1_blocks_c;
+static int sha1_impl_cur = SHA1_IMPL_C, sha1_mb_on = 0;
 
 
 
@@ -161,6 +209,297 @@ static void sha1_transform(sha1_int32 state[5], unsigned char const *buffer)
 	a = b = c = d = e = 0;
 }
 
+static void sha1_blocks_c(sha1_int32 state[5], unsigned char const *data,
+			  unsigned int nblocks) {
+
+	for (; nblocks > 0; nblocks--, data += 64)
+		sha1_transform(state, data);
+}
+
+#if defined(SHA1_X86_SIMD)
+
+#if !defined(bit_SHA)
+#define bit_SHA (1 << 29)
+#endif
+
+#define SHA1_CAP_SSSE3 (1 << 0)
+#define SHA1_CAP_SHANI (1 << 1)
+#define SHA1_CAP_AVX2 (1 << 2)
+
+#define X4_ROL1(x) _mm_or_si128(_mm_slli_epi32(x, 1), _mm_srli_epi32(x, 31))
+
+#define NI_LOAD(m, i) m = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (data + 16 * (i))), bswap)
+#define NI_GROUP(ein, eout, m0, m1, m2, m3, f) \
+	ein = _mm_sha1nexte_epu32(ein, m0); \
+	eout = abcd; \
+	m1 = _mm_sha1msg2_epu32(m1, m0); \
+	abcd = _mm_sha1rnds4_epu32(abcd, ein, f); \
+	m3 = _mm_sha1msg1_epu32(m3, m0); \
+	m2 = _mm_xor_si128(m2, m0)
+
+#define X8_ROL(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+#define X8_ADD3(x, y, z) _mm256_add_epi32(_mm256_add_epi32(x, y), z)
+#define X8_F0(b, c, d) _mm256_xor_si256(_mm256_and_si256(b, _mm256_xor_si256(c, d)), d)
+#define X8_F1(b, c, d) _mm256_xor_si256(_mm256_xor_si256(b, c), d)
+#define X8_F2(b, c, d) _mm256_or_si256(_mm256_and_si256(_mm256_or_si256(b, c), d), \
+				       _mm256_and_si256(b, c))
+#define X8_W(i) (i < 16 ? w[i]: (w[(i) & 15] = \
+	X8_ROL(_mm256_xor_si256(_mm256_xor_si256(w[((i) + 13) & 15], w[((i) + 8) & 15]), \
+				_mm256_xor_si256(w[((i) + 2) & 15], w[(i) & 15])), 1)))
+#define X8_ROUNDS(f, k, i0) \
+	for (i = i0; i < i0 + 20; i++) { \
+		t = X8_ADD3(X8_ROL(a, 5), f(b, c, d), X8_ADD3(e, k, X8_W(i))); \
+		e = d; \
+		d = c; \
+		c = X8_ROL(b, 30); \
+		b = a; \
+		a = t; \
+	}
+
+
+
+static int sha1_cpu_caps(void) {
+	static int caps = -1;
+	int lcaps = 0;
+	unsigned int eax, ebx, ecx, edx, ecx1, xcr0 = 0;
+
+	if (caps >= 0)
+		return caps;
+	if (__get_cpuid(1, &eax, &ebx, &ecx1, &edx)) {
+		if (ecx1 & bit_SSSE3)
+			lcaps |= SHA1_CAP_SSSE3;
+		if (ecx1 & bit_OSXSAVE)
+			__asm__ ("xgetbv" : "=a" (xcr0) : "c" (0) : "edx");
+		if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+			if ((ebx & bit_SHA) && (ecx1 & bit_SSE4_1) && (lcaps & SHA1_CAP_SSSE3))
+				lcaps |= SHA1_CAP_SHANI;
+			if ((ebx & bit_AVX2) && (xcr0 & 6) == 6)
+				lcaps |= SHA1_CAP_AVX2;
+		}
+	}
+	caps = lcaps;
+
+	return caps;
+}
+
+/*
+ * The message schedule is computed four words at a time, with the
+ * W[t - 3] dependency inside the vector fixed up on the last lane, and
+ * stored with the round constants already added. The rounds stay scalar,
+ * and dominate, so this is no faster than sha1_blocks_c().
+ */
+__attribute__((target("ssse3")))
+static void sha1_blocks_ssse3(sha1_int32 state[5], unsigned char const *data,
+			      unsigned int nblocks) {
+	int i;
+	sha1_int32 a, b, c, d, e;
+	__m128i x, w[20];
+	__m128i const bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+					   4, 5, 6, 7, 0, 1, 2, 3);
+	__m128i const kv[4] = {
+		_mm_set1_epi32(0x5A827999), _mm_set1_epi32(0x6ED9EBA1),
+		_mm_set1_epi32(0x8F1BBCDC), _mm_set1_epi32(0xCA62C1D6)
+	};
+	sha1_int32 wk[80] __attribute__((aligned(16)));
+
+	for (; nblocks > 0; nblocks--, data += 64) {
+		for (i = 0; i < 4; i++) {
+			w[i] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (data + 16 * i)),
+						bswap);
+			_mm_store_si128((__m128i *) (wk + 4 * i), _mm_add_epi32(w[i], kv[0]));
+		}
+		for (; i < 20; i++) {
+			x = _mm_xor_si128(_mm_xor_si128(w[i - 2], w[i - 4]),
+					  _mm_alignr_epi8(w[i - 3], w[i - 4], 8));
+			x = X4_ROL1(_mm_xor_si128(x, _mm_srli_si128(w[i - 1], 4)));
+			w[i] = _mm_xor_si128(x, X4_ROL1(_mm_slli_si128(x, 12)));
+			_mm_store_si128((__m128i *) (wk + 4 * i), _mm_add_epi32(w[i], kv[i / 5]));
+		}
+
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+		e = state[4];
+
+		RW20(RW0, 0);
+		RW20(RW2, 20);
+		RW20(RW3, 40);
+		RW20(RW2, 60);
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+	}
+}
+
+/*
+ * Intel SHA extensions: four rounds per sha1rnds4, with the message
+ * schedule rolling over four registers.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_shani(sha1_int32 state[5], unsigned char const *data,
+			      unsigned int nblocks) {
+	__m128i abcd, abcd_save, e0, e0_save, e1, m0, m1, m2, m3;
+	__m128i const bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					   8, 9, 10, 11, 12, 13, 14, 15);
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((__m128i const *) state), 0x1B);
+	e0 = _mm_set_epi32((int) state[4], 0, 0, 0);
+	for (; nblocks > 0; nblocks--, data += 64) {
+		abcd_save = abcd;
+		e0_save = e0;
+
+		NI_LOAD(m0, 0);
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		NI_LOAD(m1, 1);
+		e1 = _mm_sha1nexte_epu32(e1, m1);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+		m0 = _mm_sha1msg1_epu32(m0, m1);
+
+		NI_LOAD(m2, 2);
+		e0 = _mm_sha1nexte_epu32(e0, m2);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		m1 = _mm_sha1msg1_epu32(m1, m2);
+		m0 = _mm_xor_si128(m0, m2);
+
+		NI_LOAD(m3, 3);
+		NI_GROUP(e1, e0, m3, m0, m1, m2, 0);
+		NI_GROUP(e0, e1, m0, m1, m2, m3, 0);
+		NI_GROUP(e1, e0, m1, m2, m3, m0, 1);
+		NI_GROUP(e0, e1, m2, m3, m0, m1, 1);
+		NI_GROUP(e1, e0, m3, m0, m1, m2, 1);
+		NI_GROUP(e0, e1, m0, m1, m2, m3, 1);
+		NI_GROUP(e1, e0, m1, m2, m3, m0, 1);
+		NI_GROUP(e0, e1, m2, m3, m0, m1, 2);
+		NI_GROUP(e1, e0, m3, m0, m1, m2, 2);
+		NI_GROUP(e0, e1, m0, m1, m2, m3, 2);
+		NI_GROUP(e1, e0, m1, m2, m3, m0, 2);
+		NI_GROUP(e0, e1, m2, m3, m0, m1, 2);
+		NI_GROUP(e1, e0, m3, m0, m1, m2, 3);
+		NI_GROUP(e0, e1, m0, m1, m2, m3, 3);
+
+		e1 = _mm_sha1nexte_epu32(e1, m1);
+		e0 = abcd;
+		m2 = _mm_sha1msg2_epu32(m2, m1);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+		m3 = _mm_xor_si128(m3, m1);
+
+		e0 = _mm_sha1nexte_epu32(e0, m2);
+		e1 = abcd;
+		m3 = _mm_sha1msg2_epu32(m3, m2);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+		e1 = _mm_sha1nexte_epu32(e1, m3);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+	_mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1B));
+	state[4] = (sha1_int32) _mm_extract_epi32(e0, 3);
+}
+
+__attribute__((target("avx2")))
+static void sha1_x8_load(__m256i *w, unsigned char const *data[SHA1_MB_LANES], int offs) {
+	int i;
+	__m256i r[8], t[8], u[8];
+	__m256i const bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+					      4, 5, 6, 7, 0, 1, 2, 3,
+					      12, 13, 14, 15, 8, 9, 10, 11,
+					      4, 5, 6, 7, 0, 1, 2, 3);
+
+	for (i = 0; i < 8; i++)
+		r[i] = _mm256_loadu_si256((__m256i const *) (data[i] + offs));
+	for (i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	for (i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (i = 0; i < 4; i++) {
+		w[i] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i], u[i + 4], 0x20),
+					   bswap);
+		w[i + 4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i], u[i + 4], 0x31),
+					       bswap);
+	}
+}
+
+/*
+ * Eight independent messages, one per 32 bit lane of the AVX2 registers,
+ * all advancing by "nblocks" blocks.
+ */
+__attribute__((target("avx2")))
+static void sha1_blocks_x8(sha1_int32 *states[SHA1_MB_LANES],
+			   unsigned char const *data[SHA1_MB_LANES], unsigned int nblocks) {
+	int i, l;
+	__m256i a, b, c, d, e, t, sa, sb, sc, sd, se, w[16];
+	unsigned char const *ptrs[SHA1_MB_LANES];
+	sha1_int32 st[5][SHA1_MB_LANES] __attribute__((aligned(32)));
+
+	for (l = 0; l < SHA1_MB_LANES; l++) {
+		ptrs[l] = data[l];
+		for (i = 0; i < 5; i++)
+			st[i][l] = states[l][i];
+	}
+	a = _mm256_load_si256((__m256i const *) st[0]);
+	b = _mm256_load_si256((__m256i const *) st[1]);
+	c = _mm256_load_si256((__m256i const *) st[2]);
+	d = _mm256_load_si256((__m256i const *) st[3]);
+	e = _mm256_load_si256((__m256i const *) st[4]);
+	for (; nblocks > 0; nblocks--) {
+		sha1_x8_load(w, ptrs, 0);
+		sha1_x8_load(w + 8, ptrs, 32);
+		for (l = 0; l < SHA1_MB_LANES; l++)
+			ptrs[l] += 64;
+		sa = a;
+		sb = b;
+		sc = c;
+		sd = d;
+		se = e;
+
+		X8_ROUNDS(X8_F0, _mm256_set1_epi32(0x5A827999), 0);
+		X8_ROUNDS(X8_F1, _mm256_set1_epi32(0x6ED9EBA1), 20);
+		X8_ROUNDS(X8_F2, _mm256_set1_epi32((int) 0x8F1BBCDC), 40);
+		X8_ROUNDS(X8_F1, _mm256_set1_epi32((int) 0xCA62C1D6), 60);
+
+		a = _mm256_add_epi32(a, sa);
+		b = _mm256_add_epi32(b, sb);
+		c = _mm256_add_epi32(c, sc);
+		d = _mm256_add_epi32(d, sd);
+		e = _mm256_add_epi32(e, se);
+	}
+	_mm256_store_si256((__m256i *) st[0], a);
+	_mm256_store_si256((__m256i *) st[1], b);
+	_mm256_store_si256((__m256i *) st[2], c);
+	_mm256_store_si256((__m256i *) st[3], d);
+	_mm256_store_si256((__m256i *) st[4], e);
+	for (l = 0; l < SHA1_MB_LANES; l++)
+		for (i = 0; i < 5; i++)
+			states[l][i] = st[i][l];
+}
+
+#endif
+
+static void sha1_count(sha1_ctx_t *context, unsigned int len) {
+
+	if ((context->count[0] += len << 3) < (len << 3))
+		context->count[1]++;
+	context->count[1] += (len >> 29);
+}
+
 /* sha1_init - Initialize new context */
 
 void sha1_init(sha1_ctx_t *context)
@@ -180,14 +519,14 @@ void sha1_update(sha1_ctx_t *context, unsigned char const *data, unsigned int le
 	unsigned int i, j;
 
 	j = (context->count[0] >> 3) & 63;
-	if ((context->count[0] += len << 3) < (len << 3))
-		context->count[1]++;
-	context->count[1] += (len >> 29);
+	sha1_count(context, len);
 	if ((j + len) > 63) {
 		memcpy(&context->buffer[j], data, (i = 64 - j));
-		sha1_transform(context->state, context->buffer);
-		for (; i + 63 < len; i += 64)
-			sha1_transform(context->state, &data[i]);
+		(*sha1_blocks)(context->state, context->buffer, 1);
+		if (len - i >= 64) {
+			(*sha1_blocks)(context->state, &data[i], (len - i) / 64);
+			i += (len - i) & ~63U;
+		}
 		j = 0;
 	}
 	else
@@ -218,6 +557,134 @@ void sha1_final(unsigned char digest[SHA1_DIGEST_SIZE], sha1_ctx_t *context) {
 	memset(context->count, 0, 8);
 	memset(&finalcount, 0, 8);
 
-	sha1_transform(context->state, context->buffer);
+	(*sha1_blocks)(context->state, context->buffer, 1);
+}
+
+int sha1_impl_supported(int impl) {
+#if defined(SHA1_X86_SIMD)
+	int caps = sha1_cpu_caps();
+
+	switch (impl) {
+	case SHA1_IMPL_C:
+		return 1;
+	case SHA1_IMPL_SSSE3:
+		return (caps & SHA1_CAP_SSSE3) != 0;
+	case SHA1_IMPL_SHANI:
+		return (caps & SHA1_CAP_SHANI) != 0;
+	case SHA1_IMPL_AVX2:
+		return (caps & SHA1_CAP_AVX2) != 0;
+	}
+
+	return 0;
+#else
+	return impl == SHA1_IMPL_C;
+#endif
+}
+
+/*
+ * Selects the single buffer implementation, or the fastest supported one
+ * when "impl" is negative. The SSSE3 one, with its scalar rounds, measures
+ * the same as the C one, and is only used when asked for.
+ */
+int sha1_impl_select(int impl) {
+
+	if (impl < 0)
+		impl = sha1_impl_supported(SHA1_IMPL_SHANI) ? SHA1_IMPL_SHANI: SHA1_IMPL_C;
+	if (impl > SHA1_IMPL_SHANI || !sha1_impl_supported(impl))
+		return -1;
+	sha1_blocks = sha1_impl_procs[impl];
+	sha1_impl_cur = impl;
+
+	return 0;
+}
+
+/*
+ * Picks the fastest implementations for this CPU. The selection is plain
+ * global state, so this is meant to be called once at startup, before any
+ * thread hashes: until then everything runs on the C code.
+ */
+void sha1_setup(void) {
+
+	sha1_impl_select(-1);
+	sha1_mb_select(-1);
+}
+
+int sha1_impl(void) {
+
+	return sha1_impl_cur;
+}
+
+char const *sha1_impl_name(int impl) {
+
+	return impl >= 0 && impl <= SHA1_IMPL_AVX2 ? sha1_impl_names[impl]: "none";
+}
+
+/*
+ * Turns the AVX2 lanes of sha1_update_mb() on or off. By default they are
+ * only used without SHA extensions, which beat them one buffer at a time.
+ */
+int sha1_mb_select(int on) {
+
+	if (on < 0)
+		on = sha1_impl_supported(SHA1_IMPL_AVX2) &&
+			!sha1_impl_supported(SHA1_IMPL_SHANI);
+	if (on && !sha1_impl_supported(SHA1_IMPL_AVX2))
+		return -1;
+	sha1_mb_on = on;
+
+	return 0;
+}
+
+/*
+ * Same as calling sha1_update() on each of the "n" contexts. The blocks
+ * the contexts have in common are hashed in parallel lanes, and the rest
+ * goes through the single buffer path.
+ */
+void sha1_update_mb(sha1_ctx_t * const *ctxs, unsigned char const * const *data,
+		    unsigned int const *lens, int n) {
+	int i, l, nl;
+	unsigned int j, off[SHA1_MB_LANES];
+#if defined(SHA1_X86_SIMD)
+	int na, idx[SHA1_MB_LANES];
+	unsigned int m;
+	sha1_int32 dstate[5];
+	sha1_int32 *states[SHA1_MB_LANES];
+	unsigned char const *ptrs[SHA1_MB_LANES];
+#endif
+
+	for (i = 0; i < n; i += SHA1_MB_LANES) {
+		nl = n - i < SHA1_MB_LANES ? n - i: SHA1_MB_LANES;
+		for (l = 0; l < nl; l++) {
+			off[l] = 0;
+			if ((j = (ctxs[i + l]->count[0] >> 3) & 63) != 0) {
+				off[l] = lens[i + l] < 64 - j ? lens[i + l]: 64 - j;
+				sha1_update(ctxs[i + l], data[i + l], off[l]);
+			}
+		}
+#if defined(SHA1_X86_SIMD)
+		for (na = 2; sha1_mb_on && na > 1;) {
+			for (l = na = 0, m = ~0U; l < nl; l++)
+				if (lens[i + l] - off[l] >= 64) {
+					idx[na++] = l;
+					if ((lens[i + l] - off[l]) / 64 < m)
+						m = (lens[i + l] - off[l]) / 64;
+				}
+			if (na < 2)
+				break;
+			memset(dstate, 0, sizeof(dstate));
+			for (l = 0; l < SHA1_MB_LANES; l++) {
+				states[l] = l < na ? ctxs[i + idx[l]]->state: dstate;
+				ptrs[l] = data[i + idx[l < na ? l: 0]] + off[idx[l < na ? l: 0]];
+			}
+			sha1_blocks_x8(states, ptrs, m);
+			for (l = 0; l < na; l++) {
+				sha1_count(ctxs[i + idx[l]], m * 64);
+				off[idx[l]] += m * 64;
+			}
+		}
+#endif
+		for (l = 0; l < nl; l++)
+			sha1_update(ctxs[i + l], data[i + l] + off[l], lens[i + l] - off[l]);
+	}
 }
 
@@ -31,6 +31,11 @@
 
 #define SHA1_DIGEST_SIZE 20
 
+#define SHA1_IMPL_C 0
+#define SHA1_IMPL_SSSE3 1
+#define SHA1_IMPL_SHANI 2
+#define SHA1_IMPL_AVX2 3
+
 
 typedef unsigned SHA1_INT32TYPE sha1_int32;
 
@@ -45,6 +50,14 @@ SHA1_EXTC void sha1_init(sha1_ctx_t *context);
 SHA1_EXTC void sha1_update(sha1_ctx_t *context, unsigned char const *data,
 			   unsigned int len);
 SHA1_EXTC void sha1_final(unsigned char digest[SHA1_DIGEST_SIZE], sha1_ctx_t *context);
+SHA1_EXTC void sha1_update_mb(sha1_ctx_t * const *ctxs, unsigned char const * const *data,
+			      unsigned int const *lens, int n);
+SHA1_EXTC void sha1_setup(void);
+SHA1_EXTC int sha1_impl_supported(int impl);
+SHA1_EXTC int sha1_impl_select(int impl);
+SHA1_EXTC int sha1_impl(void);
+SHA1_EXTC char const *sha1_impl_name(int impl);
+SHA1_EXTC int sha1_mb_select(int on);
 
 #endif
 
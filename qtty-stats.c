@@ -0,0 +1,248 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#include "qtty.h"
+
+
+
+static void stats_escape(char const *str, char *buf, int size);
+static void stats_prom(qtty_stats_t const *st, char const *dev, FILE *file);
+static void stats_json(qtty_stats_t const *st, char const *dev, FILE *file);
+
+
+
+static char const * const xdirs[2] = { "get", "put" };
+
+
+
+void stats_init(qtty_stats_t *st) {
+
+	memset(st, 0, sizeof(*st));
+	st->t0 = sys_now();
+}
+
+/*
+ * Marks a command going out. The command round trip is closed by the first
+ * reply packet, while the transfer snapshot stays around until the command
+ * data is done with, by stats_xfer().
+ */
+void stats_cmd(qtty_stats_t *st) {
+
+	st->cmds++;
+	st->cmd_t0 = st->cur.t0 = sys_now();
+	st->cur.pkts = st->tx_pkts + st->rx_pkts;
+	st->cur.sock_secs = st->sock_secs;
+	st->cur.disk_secs = st->disk_secs;
+}
+
+void stats_reply(qtty_stats_t *st) {
+	double rtt;
+
+	rtt = sys_now() - st->cmd_t0;
+	st->cmd_t0 = 0;
+	st->rtts++;
+	st->rtt_secs += rtt;
+	if (rtt > st->rtt_max)
+		st->rtt_max = rtt;
+}
+
+void stats_xfer(qtty_stats_t *st, int dir, unsigned long bytes, int res) {
+	qtty_xstat_t *xs = &st->last;
+
+	xs->dir = dir;
+	xs->res = res;
+	xs->bytes = bytes;
+	xs->pkts = st->tx_pkts + st->rx_pkts - st->cur.pkts;
+	xs->t0 = st->cur.t0;
+	xs->secs = sys_now() - st->cur.t0;
+	xs->sock_secs = st->sock_secs - st->cur.sock_secs;
+	xs->disk_secs = st->disk_secs - st->cur.disk_secs;
+	st->xfers[dir]++;
+	st->xbytes[dir] += bytes;
+	st->xsecs[dir] += xs->secs;
+	if (res)
+		st->xerrs++;
+}
+
+/*
+ * Folds the counters of a side session (parallel get workers, background
+ * jobs) into the main one. Session wall time and last transfer stay the
+ * main session ones.
+ */
+void stats_merge(qtty_stats_t *st, qtty_stats_t const *sst) {
+	int i;
+
+	st->tx_bytes += sst->tx_bytes;
+	st->tx_pkts += sst->tx_pkts;
+	st->rx_bytes += sst->rx_bytes;
+	st->rx_pkts += sst->rx_pkts;
+	st->cmds += sst->cmds;
+	st->rtts += sst->rtts;
+	st->rtt_secs += sst->rtt_secs;
+	if (sst->rtt_max > st->rtt_max)
+		st->rtt_max = sst->rtt_max;
+	st->sock_secs += sst->sock_secs;
+	st->disk_secs += sst->disk_secs;
+	for (i = 0; i < 2; i++) {
+		st->xfers[i] += sst->xfers[i];
+		st->xbytes[i] += sst->xbytes[i];
+		st->xsecs[i] += sst->xsecs[i];
+	}
+	st->xerrs += sst->xerrs;
+	st->allocs += sst->allocs;
+}
+
+void stats_print(qtty_stats_t const *st, FILE *fout) {
+	int i;
+	qtty_xstat_t const *xs = &st->last;
+
+	fprintf(fout, "session   %.3f s\n", sys_now() - st->t0);
+	fprintf(fout, "tx        %lu bytes, %lu packets\n", st->tx_bytes, st->tx_pkts);
+	fprintf(fout, "rx        %lu bytes, %lu packets\n", st->rx_bytes, st->rx_pkts);
+	fprintf(fout, "commands  %lu, rtt avg %.3f ms, max %.3f ms\n", st->cmds,
+		st->rtts ? 1e3 * st->rtt_secs / st->rtts: 0.0, 1e3 * st->rtt_max);
+	fprintf(fout, "blocked   socket %.3f s, disk %.3f s\n", st->sock_secs,
+		st->disk_secs);
+	for (i = 0; i < 2; i++)
+		fprintf(fout, "%-9s %lu files, %lu bytes, %.3f s, %.2f MB/s\n", xdirs[i],
+			st->xfers[i], st->xbytes[i], st->xsecs[i],
+			st->xsecs[i] > 0 ? st->xbytes[i] / (1048576.0 * st->xsecs[i]): 0.0);
+	fprintf(fout, "errors    %lu\n", st->xerrs);
+	fprintf(fout, "allocs    %lu\n", st->allocs);
+	if (st->xfers[0] + st->xfers[1] > 0)
+		fprintf(fout, "last      %s %s, %lu bytes, %lu packets, %.3f s "
+			"(socket %.3f s, disk %.3f s)\n", xdirs[xs->dir],
+			xs->res ? "failed": "ok", xs->bytes, xs->pkts, xs->secs,
+			xs->sock_secs, xs->disk_secs);
+}
+
+static void stats_escape(char const *str, char *buf, int size) {
+	int i;
+
+	for (i = 0; *str && i < size - 2; str++) {
+		if (*str == '\\' || *str == '"')
+			buf[i++] = '\\';
+		else if (*str == '\n' || *str == '\r')
+			continue;
+		buf[i++] = *str;
+	}
+	buf[i] = 0;
+}
+
+static void stats_prom(qtty_stats_t const *st, char const *dev, FILE *file) {
+	int i;
+
+	fprintf(file, "# TYPE qtty_session_seconds gauge\n"
+		"qtty_session_seconds{device=\"%s\"} %.6f\n", dev, sys_now() - st->t0);
+	fprintf(file, "# TYPE qtty_tx_bytes_total counter\n"
+		"qtty_tx_bytes_total{device=\"%s\"} %lu\n", dev, st->tx_bytes);
+	fprintf(file, "# TYPE qtty_tx_packets_total counter\n"
+		"qtty_tx_packets_total{device=\"%s\"} %lu\n", dev, st->tx_pkts);
+	fprintf(file, "# TYPE qtty_rx_bytes_total counter\n"
+		"qtty_rx_bytes_total{device=\"%s\"} %lu\n", dev, st->rx_bytes);
+	fprintf(file, "# TYPE qtty_rx_packets_total counter\n"
+		"qtty_rx_packets_total{device=\"%s\"} %lu\n", dev, st->rx_pkts);
+	fprintf(file, "# TYPE qtty_commands_total counter\n"
+		"qtty_commands_total{device=\"%s\"} %lu\n", dev, st->cmds);
+	fprintf(file, "# TYPE qtty_command_rtt_seconds summary\n"
+		"qtty_command_rtt_seconds_sum{device=\"%s\"} %.6f\n"
+		"qtty_command_rtt_seconds_count{device=\"%s\"} %lu\n",
+		dev, st->rtt_secs, dev, st->rtts);
+	fprintf(file, "# TYPE qtty_command_rtt_max_seconds gauge\n"
+		"qtty_command_rtt_max_seconds{device=\"%s\"} %.6f\n", dev, st->rtt_max);
+	fprintf(file, "# TYPE qtty_blocked_seconds_total counter\n"
+		"qtty_blocked_seconds_total{device=\"%s\",on=\"socket\"} %.6f\n"
+		"qtty_blocked_seconds_total{device=\"%s\",on=\"disk\"} %.6f\n",
+		dev, st->sock_secs, dev, st->disk_secs);
+	fprintf(file, "# TYPE qtty_transfers_total counter\n");
+	for (i = 0; i < 2; i++)
+		fprintf(file, "qtty_transfers_total{device=\"%s\",dir=\"%s\"} %lu\n",
+			dev, xdirs[i], st->xfers[i]);
+	fprintf(file, "# TYPE qtty_transfer_bytes_total counter\n");
+	for (i = 0; i < 2; i++)
+		fprintf(file, "qtty_transfer_bytes_total{device=\"%s\",dir=\"%s\"} %lu\n",
+			dev, xdirs[i], st->xbytes[i]);
+	fprintf(file, "# TYPE qtty_transfer_seconds_total counter\n");
+	for (i = 0; i < 2; i++)
+		fprintf(file, "qtty_transfer_seconds_total{device=\"%s\",dir=\"%s\"} %.6f\n",
+			dev, xdirs[i], st->xsecs[i]);
+	fprintf(file, "# TYPE qtty_transfer_errors_total counter\n"
+		"qtty_transfer_errors_total{device=\"%s\"} %lu\n", dev, st->xerrs);
+	fprintf(file, "# TYPE qtty_allocs_total counter\n"
+		"qtty_allocs_total{device=\"%s\"} %lu\n", dev, st->allocs);
+}
+
+static void stats_json(qtty_stats_t const *st, char const *dev, FILE *file) {
+	int i;
+	qtty_xstat_t const *xs = &st->last;
+
+	fprintf(file, "{\"device\":\"%s\",\"session_secs\":%.6f,"
+		"\"tx_bytes\":%lu,\"tx_pkts\":%lu,\"rx_bytes\":%lu,\"rx_pkts\":%lu,"
+		"\"cmds\":%lu,\"rtt_count\":%lu,\"rtt_secs\":%.6f,\"rtt_max\":%.6f,"
+		"\"sock_secs\":%.6f,\"disk_secs\":%.6f,\"errors\":%lu,\"allocs\":%lu",
+		dev, sys_now() - st->t0, st->tx_bytes, st->tx_pkts, st->rx_bytes,
+		st->rx_pkts, st->cmds, st->rtts, st->rtt_secs, st->rtt_max,
+		st->sock_secs, st->disk_secs, st->xerrs, st->allocs);
+	for (i = 0; i < 2; i++)
+		fprintf(file, ",\"%s\":{\"files\":%lu,\"bytes\":%lu,\"secs\":%.6f}",
+			xdirs[i], st->xfers[i], st->xbytes[i], st->xsecs[i]);
+	if (st->xfers[0] + st->xfers[1] > 0)
+		fprintf(file, ",\"last\":{\"dir\":\"%s\",\"ok\":%s,\"bytes\":%lu,"
+			"\"pkts\":%lu,\"secs\":%.6f,\"sock_secs\":%.6f,\"disk_secs\":%.6f}",
+			xdirs[xs->dir], xs->res ? "false": "true", xs->bytes, xs->pkts,
+			xs->secs, xs->sock_secs, xs->disk_secs);
+	fprintf(file, "}\n");
+}
+
+/*
+ * Writes the session counters to "path", as JSON if the name ends with
+ * ".json", or as a Prometheus textfile otherwise. The file is replaced
+ * atomically, so collectors never see a partial one.
+ */
+int stats_export(qtty_stats_t const *st, char const *device, char const *path) {
+	int len = strlen(path);
+	FILE *file;
+	char dev[256], tpath[1100];
+
+	stats_escape(device != NULL ? device: "", dev, sizeof(dev));
+	SNPRINTF(tpath, sizeof(tpath), "%s.tmp", path);
+	tpath[sizeof(tpath) - 1] = 0;
+	if ((file = fopen(tpath, "wt")) == NULL) {
+		perror(tpath);
+		return -1;
+	}
+	if (len > 5 && !strcmp(path + len - 5, ".json"))
+		stats_json(st, dev, file);
+	else
+		stats_prom(st, dev, file);
+	if (fclose(file)) {
+		perror(tpath);
+		remove(tpath);
+		return -1;
+	}
+	if (rename(tpath, path)) {
+		remove(path);
+		if (rename(tpath, path)) {
+			perror(path);
+			remove(tpath);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
@@ -0,0 +1,56 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#if !defined(_QTTY_STATS_H)
+#define _QTTY_STATS_H
+
+
+#define QTTY_STATS_GET 0
+#define QTTY_STATS_PUT 1
+
+
+typedef struct s_qtty_xstat {
+	int dir, res;
+	unsigned long bytes, pkts;
+	double t0, secs, sock_secs, disk_secs;
+} qtty_xstat_t;
+
+typedef struct s_qtty_stats {
+	double t0;
+	unsigned long tx_bytes, tx_pkts, rx_bytes, rx_pkts;
+	unsigned long cmds, rtts;
+	double cmd_t0, rtt_secs, rtt_max;
+	double sock_secs, disk_secs;
+	unsigned long xfers[2], xbytes[2], xerrs;
+	double xsecs[2];
+	unsigned long allocs;
+	qtty_xstat_t cur, last;
+} qtty_stats_t;
+
+
+
+void stats_init(qtty_stats_t *st);
+void stats_cmd(qtty_stats_t *st);
+void stats_reply(qtty_stats_t *st);
+void stats_xfer(qtty_stats_t *st, int dir, unsigned long bytes, int res);
+void stats_merge(qtty_stats_t *st, qtty_stats_t const *sst);
+void stats_print(qtty_stats_t const *st, FILE *fout);
+int stats_export(qtty_stats_t const *st, char const *device, char const *path);
+
+
+#endif
+
@@ -15,10 +15,53 @@
  */
 
 
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "qtty.h"
 
 
 #define QTTY_MAX_PATH 4096
+#define FGLOB_MAX_THREADS 8
+#define FGLOB_MAX_QUEUE 256
+#define BT_SF_MAXIOV 4
+#define BT_SF_BUFSIZE (1024 * 16)
+
+
+typedef struct s_bt_trans {
+	char const *scheme;
+	int redial;
+	int (*open)(char const *addr, int channel, int *wfd);
+	int (*write)(bt_sock_t sk, void const *data, int size);
+	int (*writev)(bt_sock_t sk, bt_iovec_t const *iov, int cnt);
+	int (*read)(bt_sock_t sk, void *data, int size);
+	int (*sendfile)(bt_sock_t sk, bt_iovec_t const *iov, int cnt, int fd,
+			unsigned long off, int size);
+	int (*close)(bt_sock_t sk);
+} bt_trans_t;
+
+struct s_bt_sock {
+	bt_trans_t const *trans;
+	int fd, wfd;
+	int nosf;
+};
+
+typedef struct s_fglob_dir {
+	struct s_fglob_dir *next;
+	int fd;
+	char path[1];
+} fglob_dir_t;
+
+typedef struct s_fglob_ctx {
+	qtty_wild_t *wp;
+	int recurse;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	fglob_dir_t *queue;
+	int qcount, busy, error;
+	flist_t fl;
+} fglob_ctx_t;
 
 
 
@@ -29,6 +72,38 @@ static int bt_sock_cache_lookup(const char *btname, bdaddr_t *btaddr);
 static char *bt_sock_addr2str(bdaddr_t const *btaddr, char *straddr);
 static int bt_sock_str2addr(const char *straddr, bdaddr_t *btaddr);
 static int bt_sock_name2bth(const char *btname, bdaddr_t *btaddr);
+static int rfcomm_open(char const *addr, int channel, int *wfd);
+static int tcp_open(char const *addr, int channel, int *wfd);
+static int unix_open(char const *addr, int channel, int *wfd);
+static int fd_open(char const *addr, int channel, int *wfd);
+static int stream_write(bt_sock_t sk, void const *data, int size);
+static int stream_writev(bt_sock_t sk, bt_iovec_t const *iov, int cnt);
+static int stream_read(bt_sock_t sk, void *data, int size);
+static int stream_sendfile(bt_sock_t sk, bt_iovec_t const *iov, int cnt, int fd,
+			   unsigned long off, int size);
+static int stream_close(bt_sock_t sk);
+static bt_trans_t const *bt_sock_lookup(char const *qcaddr, char const **paddr);
+static int fglob_push(fglob_ctx_t *ctx, int fd, char const *path, int plen);
+static int fglob_walk(fglob_ctx_t *ctx, int fd, char *path, int plen,
+		      flist_t *fl);
+static void *fglob_thread(void *priv);
+
+
+
+/*
+ * The first entry is also the transport for addresses without a scheme,
+ * and for sockets wrapped by bt_sock_fdopen().
+ */
+static bt_trans_t const bt_transports[] = {
+	{ "rfcomm", 1, rfcomm_open, stream_write, stream_writev, stream_read,
+	  stream_sendfile, stream_close },
+	{ "tcp", 1, tcp_open, stream_write, stream_writev, stream_read, stream_sendfile,
+	  stream_close },
+	{ "unix", 1, unix_open, stream_write, stream_writev, stream_read, stream_sendfile,
+	  stream_close },
+	{ "fd", 0, fd_open, stream_write, stream_writev, stream_read, stream_sendfile,
+	  stream_close },
+};
 
 
 
@@ -158,22 +233,26 @@ static int bt_sock_name2bth(const char *btname, bdaddr_t *btaddr) {
 	return err;
 }
 
-bt_sock_t bt_sock_open(char const *qcaddr, int channel) {
+static int rfcomm_open(char const *addr, int channel, int *wfd) {
 	int sock, d;
 	bdaddr_t btaddr;
 	struct sockaddr_rc laddr, raddr;
 	struct hci_dev_info di;
 	char straddr[64];
 
+	if (channel < 0) {
+		fprintf(stderr, "Missing RFCOMM channel for '%s'\n", addr);
+		return -1;
+	}
 	if(hci_devinfo(0, &di) < 0) {
 		perror("hci_devinfo");
-		return INVALID_BT_SOCK;
+		return -1;
 	}
 
-	if (bt_sock_str2addr(qcaddr, &btaddr) < 0 &&
-	    bt_sock_name2bth(qcaddr, &btaddr) < 0) {
-		fprintf(stderr, "Unable to resolve '%s'\n", qcaddr);
-		return INVALID_BT_SOCK;
+	if (bt_sock_str2addr(addr, &btaddr) < 0 &&
+	    bt_sock_name2bth(addr, &btaddr) < 0) {
+		fprintf(stderr, "Unable to resolve '%s'\n", addr);
+		return -1;
 	}
 
 	laddr.rc_family = AF_BLUETOOTH;
@@ -186,85 +265,671 @@ bt_sock_t bt_sock_open(char const *qcaddr, int channel) {
 
 	if ((sock = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM)) < 0) {
 		perror("socket");
-		return INVALID_BT_SOCK;
+		return -1;
 	}
 	if (bind(sock, (struct sockaddr *) &laddr, sizeof(laddr)) < 0) {
 		perror("bind");
 		close(sock);
-		return INVALID_BT_SOCK;
+		return -1;
 	}
 	printf("Local device %s\n", bt_sock_addr2str(&di.bdaddr, straddr));
-	printf("Remote device %s (%d)\n", qcaddr, channel);
+	printf("Remote device %s (%d)\n", addr, channel);
 
 	if(connect(sock, (struct sockaddr *) &raddr, sizeof(raddr)) < 0) {
 		perror("connect");
 		close(sock);
-		return INVALID_BT_SOCK;
+		return -1;
+	}
+
+	return sock;
+}
+
+static int tcp_open(char const *addr, int channel, int *wfd) {
+	int sock, one = 1;
+	char const *port;
+	struct addrinfo hints, *ai, *cai;
+	char host[256];
+
+	if ((port = strrchr(addr, ':')) == NULL || port == addr ||
+	    port - addr >= (int) sizeof(host)) {
+		fprintf(stderr, "Invalid TCP address '%s' (HOST:PORT)\n", addr);
+		return -1;
+	}
+	memcpy(host, addr, port - addr);
+	host[port - addr] = 0;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port + 1, &hints, &ai)) {
+		fprintf(stderr, "Unable to resolve '%s'\n", addr);
+		return -1;
+	}
+	for (sock = -1, cai = ai; cai != NULL; cai = cai->ai_next) {
+		if ((sock = socket(cai->ai_family, SOCK_STREAM, 0)) < 0)
+			continue;
+		if (connect(sock, cai->ai_addr, cai->ai_addrlen) == 0)
+			break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(ai);
+	if (sock < 0) {
+		perror(addr);
+		return -1;
 	}
+	/*
+	 * Replies are awaited after every command, and batching is already
+	 * done by the packet layer.
+	 */
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
 	return sock;
 }
 
+static int unix_open(char const *addr, int channel, int *wfd) {
+	int sock;
+	struct sockaddr_un uaddr;
+
+	if (strlen(addr) >= sizeof(uaddr.sun_path)) {
+		fprintf(stderr, "Path too long '%s'\n", addr);
+		return -1;
+	}
+	memset(&uaddr, 0, sizeof(uaddr));
+	uaddr.sun_family = AF_UNIX;
+	strcpy(uaddr.sun_path, addr);
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *) &uaddr, sizeof(uaddr)) < 0) {
+		perror(addr);
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/*
+ * Inherited descriptors, either "N" for a bidirectional one (a socket),
+ * or "R,W" for a read and write pair (pipes).
+ */
+static int fd_open(char const *addr, int channel, int *wfd) {
+	int rfd;
+	char *tmp;
+
+	rfd = *wfd = (int) strtol(addr, &tmp, 10);
+	if (*tmp == ',')
+		*wfd = (int) strtol(tmp + 1, &tmp, 10);
+	if (tmp == addr || *tmp || rfd < 0 || *wfd < 0 ||
+	    fcntl(rfd, F_GETFD) < 0 || fcntl(*wfd, F_GETFD) < 0) {
+		fprintf(stderr, "Invalid descriptor '%s'\n", addr);
+		return -1;
+	}
+
+	return rfd;
+}
+
+static int stream_write(bt_sock_t sk, void const *data, int size) {
+
+	return write(sk->wfd, data, size);
+}
+
+static int stream_writev(bt_sock_t sk, bt_iovec_t const *iov, int cnt) {
+
+	return writev(sk->wfd, iov, cnt);
+}
+
+static int stream_read(bt_sock_t sk, void *data, int size) {
+
+	return read(sk->fd, data, size);
+}
+
+/*
+ * Writes the "iov" head, then "size" bytes of "fd" from "off", with the
+ * file pages going straight from the page cache to "ofd". The head is
+ * sent with MSG_MORE, so that it shares the segment with the payload
+ * even on TCP_NODELAY sockets. Targets refusing sendfile() (EINVAL and
+ * friends, like some socket families on older kernels) get the rest of
+ * the payload, and every later one, with a pread() and write() copy.
+ * Returns 0 once everything is sent, -1 otherwise.
+ */
+static int stream_sendfile(bt_sock_t sk, bt_iovec_t const *iov, int cnt, int fd,
+			   unsigned long off, int size) {
+	int i, more = 1, ofd = sk->wfd;
+	ssize_t res, curr;
+	off_t foff = (off_t) off;
+	struct msghdr mh;
+	bt_iovec_t liov[BT_SF_MAXIOV];
+	char buf[BT_SF_BUFSIZE];
+
+	if (cnt > BT_SF_MAXIOV) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(liov, iov, cnt * sizeof(bt_iovec_t));
+	for (i = 0; i < cnt;) {
+		if (more) {
+			memset(&mh, 0, sizeof(mh));
+			mh.msg_iov = liov + i;
+			mh.msg_iovlen = cnt - i;
+			if ((res = sendmsg(ofd, &mh, MSG_MORE)) < 0 && errno == ENOTSOCK) {
+				more = 0;
+				continue;
+			}
+		} else
+			res = writev(ofd, liov + i, cnt - i);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (; i < cnt && (size_t) res >= liov[i].iov_len; i++)
+			res -= liov[i].iov_len;
+		if (i < cnt) {
+			liov[i].iov_base = (char *) liov[i].iov_base + res;
+			liov[i].iov_len -= res;
+		}
+	}
+	while (size > 0 && !sk->nosf) {
+		if ((res = sendfile(ofd, fd, &foff, size)) > 0) {
+			size -= (int) res;
+			continue;
+		}
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res == 0 || (errno != EINVAL && errno != ENOSYS &&
+				 errno != EOPNOTSUPP))
+			return -1;
+		sk->nosf = 1;
+	}
+	while (size > 0) {
+		if ((res = pread(fd, buf, size < (int) sizeof(buf) ? size: (int) sizeof(buf),
+				 foff)) <= 0)
+			return -1;
+		foff += res;
+		size -= (int) res;
+		for (i = 0; i < (int) res;) {
+			if ((curr = write(ofd, buf + i, res - i)) < 0 && errno == EINTR)
+				continue;
+			if (curr <= 0)
+				return -1;
+			i += (int) curr;
+		}
+	}
+
+	return 0;
+}
+
+static int stream_close(bt_sock_t sk) {
+	int res = close(sk->fd);
+
+	if (sk->wfd != sk->fd)
+		close(sk->wfd);
+
+	return res;
+}
+
+static bt_trans_t const *bt_sock_lookup(char const *qcaddr, char const **paddr) {
+	int i;
+	char const *addr;
+	char scheme[32];
+
+	if ((addr = addr_split(qcaddr, scheme, sizeof(scheme))) != NULL) {
+		for (i = 0; i < (int) COUNT_OF(bt_transports); i++)
+			if (strcmp(scheme, bt_transports[i].scheme) == 0) {
+				*paddr = addr;
+				return &bt_transports[i];
+			}
+	}
+	*paddr = qcaddr;
+
+	return &bt_transports[0];
+}
+
+/*
+ * The address is "SCHEME:ADDR" or "SCHEME://ADDR", with SCHEME one of
+ * rfcomm, tcp, unix or fd. Anything else is a BlueTooth address or name.
+ * The transport is resolved here, once, and travels with the handle.
+ */
+bt_sock_t bt_sock_open(char const *qcaddr, int channel) {
+	int fd, wfd = -1;
+	char const *addr;
+	bt_sock_t sk;
+	bt_trans_t const *trans = bt_sock_lookup(qcaddr, &addr);
+
+	if ((sk = (bt_sock_t) malloc(sizeof(*sk))) == NULL)
+		return INVALID_BT_SOCK;
+	if ((fd = (*trans->open)(addr, channel, &wfd)) < 0) {
+		free(sk);
+		return INVALID_BT_SOCK;
+	}
+	sk->trans = trans;
+	sk->fd = fd;
+	sk->wfd = wfd >= 0 ? wfd: fd;
+	sk->nosf = 0;
+
+	return sk;
+}
+
+/*
+ * Wraps an already connected socket (accept(), socketpair()), which gets
+ * the stream operations of the default transport.
+ */
+bt_sock_t bt_sock_fdopen(int fd) {
+	bt_sock_t sk;
+
+	if ((sk = (bt_sock_t) malloc(sizeof(*sk))) == NULL)
+		return INVALID_BT_SOCK;
+	sk->trans = &bt_transports[0];
+	sk->fd = sk->wfd = fd;
+	sk->nosf = 0;
+
+	return sk;
+}
+
+/*
+ * Whether a second connection to "qcaddr" reaches the same server, which
+ * is not the case for inherited descriptors.
+ */
+int bt_sock_redialable(char const *qcaddr) {
+	char const *addr;
+
+	return bt_sock_lookup(qcaddr, &addr)->redial;
+}
+
 int bt_sock_write(bt_sock_t sk, void const *data, int size) {
 
-	return write(sk, data, size);
+	return (*sk->trans->write)(sk, data, size);
+}
+
+int bt_sock_writev(bt_sock_t sk, bt_iovec_t const *iov, int cnt) {
+
+	return (*sk->trans->writev)(sk, iov, cnt);
 }
 
 int bt_sock_read(bt_sock_t sk, void *data, int size) {
 
-	return read(sk, data, size);
+	return (*sk->trans->read)(sk, data, size);
+}
+
+int bt_sock_sendfile(bt_sock_t sk, bt_iovec_t const *iov, int cnt, int fd,
+		     unsigned long off, int size) {
+
+	return (*sk->trans->sendfile)(sk, iov, cnt, fd, off, size);
 }
 
 int bt_sock_close(bt_sock_t sk) {
+	int res = (*sk->trans->close)(sk);
+
+	free(sk);
+
+	return res;
+}
+
+/*
+ * Wakes up reads and writes blocked on the connection, from another
+ * thread, leaving the descriptors open until bt_sock_close(). Pipes
+ * cannot be shut down, which is why the fd transport is not redialable.
+ */
+int bt_sock_shutdown(bt_sock_t sk) {
+	int res = shutdown(sk->fd, SHUT_RDWR);
+
+	if (sk->wfd != sk->fd)
+		shutdown(sk->wfd, SHUT_RDWR);
+
+	return res;
+}
+
+/*
+ * The descriptor read by bt_sock_read(), for poll() and friends.
+ */
+int bt_sock_fd(bt_sock_t sk) {
+
+	return sk->fd;
+}
+
+/*
+ * The descriptor written by bt_sock_write(), which differs from the one
+ * of bt_sock_fd() only for the read and write pairs of the fd transport.
+ */
+int bt_sock_wfd(bt_sock_t sk) {
+
+	return sk->wfd;
+}
+
+int sys_thread_create(sys_thread_t *thr, sys_thread_proc_t proc, void *priv) {
+
+	return pthread_create(thr, NULL, proc, priv) ? -1: 0;
+}
+
+void sys_thread_join(sys_thread_t thr) {
+
+	pthread_join(thr, NULL);
+}
+
+int sys_mutex_init(sys_mutex_t *mtx) {
+
+	return pthread_mutex_init(mtx, NULL) ? -1: 0;
+}
+
+void sys_mutex_free(sys_mutex_t *mtx) {
+
+	pthread_mutex_destroy(mtx);
+}
+
+void sys_mutex_lock(sys_mutex_t *mtx) {
+
+	pthread_mutex_lock(mtx);
+}
+
+void sys_mutex_unlock(sys_mutex_t *mtx) {
+
+	pthread_mutex_unlock(mtx);
+}
+
+int sys_event_init(sys_event_t *evt) {
+
+	if (pthread_mutex_init(&evt->mtx, NULL))
+		return -1;
+	if (pthread_cond_init(&evt->cond, NULL)) {
+		pthread_mutex_destroy(&evt->mtx);
+		return -1;
+	}
+	evt->signaled = 0;
+
+	return 0;
+}
+
+void sys_event_free(sys_event_t *evt) {
+
+	pthread_cond_destroy(&evt->cond);
+	pthread_mutex_destroy(&evt->mtx);
+}
+
+void sys_event_signal(sys_event_t *evt) {
+
+	pthread_mutex_lock(&evt->mtx);
+	evt->signaled = 1;
+	pthread_cond_signal(&evt->cond);
+	pthread_mutex_unlock(&evt->mtx);
+}
+
+void sys_event_wait(sys_event_t *evt) {
+
+	pthread_mutex_lock(&evt->mtx);
+	while (!evt->signaled)
+		pthread_cond_wait(&evt->cond, &evt->mtx);
+	evt->signaled = 0;
+	pthread_mutex_unlock(&evt->mtx);
+}
+
+int sys_file_info(char const *path, unsigned long *size, unsigned long *mtime) {
+	struct stat stbuf;
+
+	if (stat(path, &stbuf))
+		return -1;
+	*size = (unsigned long) stbuf.st_size;
+	*mtime = (unsigned long) stbuf.st_mtime;
+
+	return 0;
+}
+
+double sys_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	return close(sk);
+	return (double) ts.tv_sec + 1e-9 * (double) ts.tv_nsec;
 }
 
-int fglob_get_list(char const *path, char const *match, int recurse,
-		   file_list_t **flist) {
+/*
+ * Reserves "size" bytes of disk for "fd", which is extended to that size.
+ * File systems without fallocate() get a sparse extension instead, and 1
+ * is returned, since writes can still fail for lack of space.
+ */
+int sys_file_alloc(int fd, unsigned long size) {
+	struct stat stbuf;
+
+	if (size == 0 || fallocate(fd, 0, 0, (off_t) size) == 0)
+		return 0;
+	if (fstat(fd, &stbuf) ||
+	    (stbuf.st_size < (off_t) size && ftruncate(fd, (off_t) size)))
+		return -1;
+
+	return 1;
+}
+
+int sys_pwrite(int fd, void const *data, int size, unsigned long off) {
+	int count;
+	ssize_t curr;
+
+	for (count = 0; count < size;) {
+		if ((curr = pwrite(fd, (char const *) data + count, size - count,
+				   (off_t) (off + count))) < 0 && errno == EINTR)
+			continue;
+		if (curr <= 0)
+			return -1;
+		count += (int) curr;
+	}
+
+	return size;
+}
+
+/*
+ * Starts the writeback of a file range or, with "drop", waits for it and
+ * evicts the range from the page cache. Dirty pages cannot be dropped,
+ * hence the wait.
+ */
+void sys_file_writeback(int fd, unsigned long off, unsigned long size, int drop) {
+
+	if (size == 0)
+		return;
+	if (!drop)
+		sync_file_range(fd, (off_t) off, (off_t) size, SYNC_FILE_RANGE_WRITE);
+	else {
+		sync_file_range(fd, (off_t) off, (off_t) size, SYNC_FILE_RANGE_WAIT_BEFORE |
+				SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(fd, (off_t) off, (off_t) size, POSIX_FADV_DONTNEED);
+	}
+}
+
+/*
+ * Read-only maps are prefaulted, since they are read through right away,
+ * while writable ones fault their pages in as they are filled.
+ */
+void *sys_map_file(int fd, unsigned long off, unsigned long size, int wr) {
+	void *addr;
+
+	if ((addr = mmap(NULL, size, wr ? PROT_READ | PROT_WRITE: PROT_READ,
+			 wr ? MAP_SHARED: MAP_SHARED | MAP_POPULATE, fd,
+			 (off_t) off)) == MAP_FAILED)
+		return NULL;
+	madvise(addr, size, MADV_SEQUENTIAL);
+
+	return addr;
+}
+
+void sys_unmap_file(void *addr, unsigned long size) {
+
+	munmap(addr, size);
+}
+
+static int fglob_push(fglob_ctx_t *ctx, int fd, char const *path, int plen) {
+	fglob_dir_t *fdir;
+
+	pthread_mutex_lock(&ctx->mtx);
+	if (ctx->qcount >= FGLOB_MAX_QUEUE) {
+		pthread_mutex_unlock(&ctx->mtx);
+		return 0;
+	}
+	if ((fdir = (fglob_dir_t *) malloc(sizeof(fglob_dir_t) + plen)) == NULL) {
+		pthread_mutex_unlock(&ctx->mtx);
+		return -1;
+	}
+	fdir->fd = fd;
+	memcpy(fdir->path, path, plen);
+	fdir->path[plen] = 0;
+	fdir->next = ctx->queue;
+	ctx->queue = fdir;
+	ctx->qcount++;
+	pthread_cond_signal(&ctx->cond);
+	pthread_mutex_unlock(&ctx->mtx);
+
+	return 1;
+}
+
+/*
+ * Walks the directory open at "fd", whose name is in "path". Entries are
+ * only stat'ed when d_type does not tell, or for the size of the files
+ * which match. Subdirectories go to the shared queue while it has room,
+ * and are walked inline otherwise, to bound the number of open fds.
+ */
+static int fglob_walk(fglob_ctx_t *ctx, int fd, char *path, int plen,
+		      flist_t *fl) {
+	int nlen, cfd, type, res = 0;
+	char const *idir = NULL;
 	DIR *dir;
 	struct dirent *dent;
-	char *nambuf;
-	file_list_t *fent;
 	struct stat stbuf;
 
-	if ((dir = opendir(path)) == NULL)
-		return -1;
-	if ((nambuf = (char *) malloc(QTTY_MAX_PATH)) == NULL) {
-		closedir(dir);
+	if ((dir = fdopendir(fd)) == NULL) {
+		close(fd);
 		return -1;
 	}
-	while ((dent = readdir(dir)) != NULL) {
+	while (res == 0 && !SYS_LOAD_ACQ(&ctx->error) &&
+	       (dent = readdir(dir)) != NULL) {
 		if (strcmp(dent->d_name, ".") == 0 ||
 		    strcmp(dent->d_name, "..") == 0)
 			continue;
-		snprintf(nambuf, QTTY_MAX_PATH, "%s/%s", path, dent->d_name);
-		if (stat(nambuf, &stbuf))
+		if (plen + (nlen = strlen(dent->d_name)) + 2 > QTTY_MAX_PATH)
 			continue;
-		if (S_ISDIR(stbuf.st_mode)) {
-			if (recurse &&
-			    fglob_get_list(nambuf, match, recurse, flist) < 0) {
-				free(nambuf);
-				closedir(dir);
-				return -1;
-			}
-		} else if (S_ISREG(stbuf.st_mode)) {
-			if (match != NULL && !wildmatch(dent->d_name, match))
+		type = dent->d_type;
+		if (type == DT_UNKNOWN || type == DT_LNK) {
+			if (fstatat(dirfd(dir), dent->d_name, &stbuf, 0))
 				continue;
-			if ((fent = (file_list_t *)
-			     malloc(sizeof(file_list_t) + strlen(nambuf) + 1)) == NULL) {
-				free(nambuf);
-				closedir(dir);
-				return -1;
-			}
-			strcpy(fent->name, nambuf);
-			fent->next = *flist;
-			*flist = fent;
+			type = S_ISDIR(stbuf.st_mode) ? DT_DIR:
+				S_ISREG(stbuf.st_mode) ? DT_REG: DT_UNKNOWN;
+		}
+		path[plen] = '/';
+		if (type == DT_DIR && ctx->recurse) {
+			memcpy(path + plen + 1, dent->d_name, nlen + 1);
+			if ((cfd = openat(dirfd(dir), dent->d_name,
+					  O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+				res = -1;
+			else if ((res = fglob_push(ctx, cfd, path, plen + 1 + nlen)) == 0)
+				res = fglob_walk(ctx, cfd, path, plen + 1 + nlen, fl);
+			else if (res > 0)
+				res = 0;
+			else
+				close(cfd);
+		} else if (type == DT_REG) {
+			if (ctx->wp != NULL && !wild_match(ctx->wp, dent->d_name))
+				continue;
+			if (dent->d_type != DT_UNKNOWN && dent->d_type != DT_LNK &&
+			    fstatat(dirfd(dir), dent->d_name, &stbuf, 0))
+				continue;
+			if ((idir == NULL &&
+			     (idir = flist_dir(fl, path, plen + 1)) == NULL) ||
+			    flist_add(fl, idir, dent->d_name, nlen,
+				      (unsigned long) stbuf.st_size) == NULL)
+				res = -1;
 		}
 	}
-	free(nambuf);
+	path[plen] = 0;
 	closedir(dir);
 
-	return 0;
+	return res;
+}
+
+static void *fglob_thread(void *priv) {
+	int res;
+	fglob_ctx_t *ctx = (fglob_ctx_t *) priv;
+	fglob_dir_t *fdir;
+	flist_t fl;
+	char *path;
+
+	if ((path = (char *) malloc(QTTY_MAX_PATH)) == NULL) {
+		SYS_STORE_REL(&ctx->error, 1);
+		return NULL;
+	}
+	flist_init(&fl);
+	pthread_mutex_lock(&ctx->mtx);
+	for (;;) {
+		while (ctx->queue == NULL && ctx->busy > 0 && !ctx->error)
+			pthread_cond_wait(&ctx->cond, &ctx->mtx);
+		if ((fdir = ctx->queue) == NULL || ctx->error)
+			break;
+		ctx->queue = fdir->next;
+		ctx->qcount--;
+		ctx->busy++;
+		pthread_mutex_unlock(&ctx->mtx);
+
+		strcpy(path, fdir->path);
+		res = fglob_walk(ctx, fdir->fd, path, strlen(path), &fl);
+		free(fdir);
+
+		pthread_mutex_lock(&ctx->mtx);
+		if (res < 0)
+			ctx->error = 1;
+		if (--ctx->busy == 0 || ctx->error)
+			pthread_cond_broadcast(&ctx->cond);
+	}
+	flist_merge(&ctx->fl, &fl);
+	pthread_mutex_unlock(&ctx->mtx);
+	free(path);
+
+	return NULL;
+}
+
+/*
+ * Directories are fanned out to a pool of walker threads, with the caller
+ * being one of them. Since the order in which they complete varies, the
+ * resulting list is sorted by path.
+ */
+int fglob_get_list(char const *path, char const *match, int recurse, flist_t *fl) {
+	int i, fd, nthr = 0;
+	fglob_ctx_t ctx;
+	fglob_dir_t *fdir;
+	sys_thread_t thrs[FGLOB_MAX_THREADS];
+
+	if (strlen(path) >= QTTY_MAX_PATH ||
+	    (fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return -1;
+	memset(&ctx, 0, sizeof(ctx));
+	flist_init(&ctx.fl);
+	ctx.recurse = recurse;
+	if (match != NULL && (ctx.wp = wild_compile(match, 0)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	pthread_mutex_init(&ctx.mtx, NULL);
+	pthread_cond_init(&ctx.cond, NULL);
+	if (fglob_push(&ctx, fd, path, strlen(path)) < 0) {
+		close(fd);
+		ctx.error = 1;
+	}
+	if (recurse && (nthr = (int) sysconf(_SC_NPROCESSORS_ONLN) - 1) >= FGLOB_MAX_THREADS)
+		nthr = FGLOB_MAX_THREADS - 1;
+	for (i = 0; i < nthr; i++)
+		if (sys_thread_create(&thrs[i], fglob_thread, &ctx) < 0)
+			break;
+	fglob_thread(&ctx);
+	for (nthr = i, i = 0; i < nthr; i++)
+		sys_thread_join(thrs[i]);
+	while ((fdir = ctx.queue) != NULL) {
+		ctx.queue = fdir->next;
+		close(fdir->fd);
+		free(fdir);
+	}
+	pthread_cond_destroy(&ctx.cond);
+	pthread_mutex_destroy(&ctx.mtx);
+	if (ctx.wp != NULL)
+		wild_free(ctx.wp);
+	if (flist_sort(&ctx.fl) < 0)
+		ctx.error = 1;
+	flist_merge(fl, &ctx.fl);
+
+	return ctx.error ? -1: 0;
 }
 
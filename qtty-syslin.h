@@ -21,17 +21,28 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdint.h>
 #include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/rfcomm.h>
 #include <bluetooth/hci.h>
@@ -39,30 +50,69 @@
 #include <readline/history.h>
 
 
-#define INVALID_BT_SOCK ((bt_sock_t) -1)
+#define INVALID_BT_SOCK ((bt_sock_t) NULL)
 #define SYS_SLASHS "/"
 #define SYS_SLASHC '/'
 
 #define SNPRINTF snprintf
+#define FILENO(f) fileno(f)
 #define MKDIR(p, m) mkdir(p, m)
 #define PATH_EXIST(p) (access(p, 0) == 0)
 
+#define BT_IOV_SET(v, p, n) ((v).iov_base = (void *) (p), (v).iov_len = (size_t) (n))
+#define BT_IOV_BASE(v) ((v).iov_base)
+#define BT_IOV_LEN(v) ((v).iov_len)
 
-typedef int bt_sock_t;
+#define SYS_LOAD_ACQ(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define SYS_STORE_REL(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define SYS_MEMBAR() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define SYS_TLS __thread
+
+
+typedef struct s_bt_sock *bt_sock_t;
+typedef struct iovec bt_iovec_t;
 typedef uint16_t qtty_u16;
 typedef uint32_t qtty_u32;
-typedef struct s_file_list {
-	struct s_file_list *next;
-	char name[1];
-} file_list_t;
+typedef uint64_t qtty_u64;
+typedef pthread_t sys_thread_t;
+typedef void *(*sys_thread_proc_t)(void *);
+typedef pthread_mutex_t sys_mutex_t;
+typedef struct s_sys_event {
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	int signaled;
+} sys_event_t;
 
 
 bt_sock_t bt_sock_open(char const *qcaddr, int channel);
+bt_sock_t bt_sock_fdopen(int fd);
+int bt_sock_redialable(char const *qcaddr);
 int bt_sock_write(bt_sock_t sk, void const *data, int size);
+int bt_sock_writev(bt_sock_t sk, bt_iovec_t const *iov, int cnt);
 int bt_sock_read(bt_sock_t sk, void *data, int size);
+int bt_sock_sendfile(bt_sock_t sk, bt_iovec_t const *iov, int cnt, int fd,
+		     unsigned long off, int size);
 int bt_sock_close(bt_sock_t sk);
-int fglob_get_list(char const *path, char const *match, int recurse,
-		   file_list_t **flist);
+int bt_sock_shutdown(bt_sock_t sk);
+int bt_sock_fd(bt_sock_t sk);
+int bt_sock_wfd(bt_sock_t sk);
+int sys_thread_create(sys_thread_t *thr, sys_thread_proc_t proc, void *priv);
+void sys_thread_join(sys_thread_t thr);
+int sys_mutex_init(sys_mutex_t *mtx);
+void sys_mutex_free(sys_mutex_t *mtx);
+void sys_mutex_lock(sys_mutex_t *mtx);
+void sys_mutex_unlock(sys_mutex_t *mtx);
+int sys_event_init(sys_event_t *evt);
+void sys_event_free(sys_event_t *evt);
+void sys_event_signal(sys_event_t *evt);
+void sys_event_wait(sys_event_t *evt);
+int sys_file_info(char const *path, unsigned long *size, unsigned long *mtime);
+double sys_now(void);
+int sys_file_alloc(int fd, unsigned long size);
+int sys_pwrite(int fd, void const *data, int size, unsigned long off);
+void sys_file_writeback(int fd, unsigned long off, unsigned long size, int drop);
+void *sys_map_file(int fd, unsigned long off, unsigned long size, int wr);
+void sys_unmap_file(void *addr, unsigned long size);
 
 
 #endif
@@ -25,6 +25,17 @@
 
 
 
+typedef struct s_bt_trans {
+	char const *scheme;
+	int redial;
+	bt_sock_t (*open)(char const *addr, int channel);
+} bt_trans_t;
+
+typedef struct s_w32_thread_ctx {
+	sys_thread_proc_t proc;
+	void *priv;
+} w32_thread_ctx_t;
+
 typedef struct s_w32_glob_ctx {
 	WIN32_FIND_DATA wfd;
 	char nambuf[QTTY_MAX_PATH];
@@ -41,11 +52,27 @@ static int bt_sock_str2addr(const char *straddr, BTH_ADDR *btaddr);
 static int bt_sock_name2bth(const char *btname, BTH_ADDR *btaddr);
 static int bt_sock_init(void);
 static int bt_sock_cleanup(void);
+static bt_sock_t rfcomm_open(char const *addr, int channel);
+static bt_sock_t tcp_open(char const *addr, int channel);
+static bt_trans_t const *bt_sock_lookup(char const *qcaddr, char const **paddr);
+static DWORD WINAPI w32_thread_proc(LPVOID param);
+static int fglob_walk(char const *path, qtty_wild_t const *wp, int recurse,
+		      flist_t *fl);
 
 
 
 static int wsa_refcount = 0;
 
+/*
+ * All the transports available here are Winsock sockets, so they differ
+ * only in the way they are opened. The first entry is also used for
+ * addresses without a scheme.
+ */
+static bt_trans_t const bt_transports[] = {
+	{ "rfcomm", 1, rfcomm_open },
+	{ "tcp", 1, tcp_open },
+};
+
 
 
 static char *bt_sock_cachefile(char *cfname, int len) {
@@ -244,7 +271,7 @@ static int bt_find_local_device(bt_sock_t sk, SOCKADDR_BTH *addr) {
 	return 0;
 }
 
-bt_sock_t bt_sock_open(char const *qcaddr, int channel) {
+static bt_sock_t rfcomm_open(char const *addr, int channel) {
 	int alen, pisize;
 	bt_sock_t sock;
 	BTH_ADDR btaddr;
@@ -252,13 +279,17 @@ bt_sock_t bt_sock_open(char const *qcaddr, int channel) {
 	WSAPROTOCOL_INFO pinf;
 	char straddr[64];
 
+	if (channel < 0) {
+		fprintf(stderr, "missing RFCOMM channel for '%s'\n", addr);
+		return INVALID_BT_SOCK;
+	}
 	if (bt_sock_init() < 0) {
 
 		return INVALID_BT_SOCK;
 	}
-	if (bt_sock_str2addr(qcaddr, &btaddr) < 0 &&
-	    bt_sock_name2bth(qcaddr, &btaddr) < 0) {
-		fprintf(stderr, "unable to resolve BT name '%s'\n", qcaddr);
+	if (bt_sock_str2addr(addr, &btaddr) < 0 &&
+	    bt_sock_name2bth(addr, &btaddr) < 0) {
+		fprintf(stderr, "unable to resolve BT name '%s'\n", addr);
 		bt_sock_cleanup();
 		return INVALID_BT_SOCK;
 	}
@@ -293,7 +324,7 @@ bt_sock_t bt_sock_open(char const *qcaddr, int channel) {
 		return INVALID_BT_SOCK;
 	}
 	printf("Local device %s\n", bt_sock_addr2str(&laddr.btAddr, straddr));
-	printf("Remote device %s (%d)\n", qcaddr, channel);
+	printf("Remote device %s (%d)\n", addr, channel);
 	if(connect(sock, (struct sockaddr *) &raddr, sizeof(raddr)) == -1) {
 		perror("connect");
 		bt_sock_close(sock);
@@ -303,16 +334,126 @@ bt_sock_t bt_sock_open(char const *qcaddr, int channel) {
 	return sock;
 }
 
+static bt_sock_t tcp_open(char const *addr, int channel) {
+	BOOL one = TRUE;
+	bt_sock_t sock;
+	char const *port;
+	struct addrinfo hints, *ai, *cai;
+	char host[256];
+
+	if ((port = strrchr(addr, ':')) == NULL || port == addr ||
+	    port - addr >= (int) sizeof(host)) {
+		fprintf(stderr, "invalid TCP address '%s' (HOST:PORT)\n", addr);
+		return INVALID_BT_SOCK;
+	}
+	memcpy(host, addr, port - addr);
+	host[port - addr] = 0;
+	if (bt_sock_init() < 0)
+		return INVALID_BT_SOCK;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port + 1, &hints, &ai)) {
+		fprintf(stderr, "unable to resolve '%s'\n", addr);
+		bt_sock_cleanup();
+		return INVALID_BT_SOCK;
+	}
+	for (sock = INVALID_SOCKET, cai = ai; cai != NULL; cai = cai->ai_next) {
+		if ((sock = socket(cai->ai_family, SOCK_STREAM, 0)) == INVALID_SOCKET)
+			continue;
+		if (connect(sock, cai->ai_addr, (int) cai->ai_addrlen) == 0)
+			break;
+		closesocket(sock);
+		sock = INVALID_SOCKET;
+	}
+	freeaddrinfo(ai);
+	if (sock == INVALID_SOCKET) {
+		fprintf(stderr, "unable to connect to '%s'\n", addr);
+		bt_sock_cleanup();
+		return INVALID_BT_SOCK;
+	}
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char const *) &one, sizeof(one));
+
+	return sock;
+}
+
+static bt_trans_t const *bt_sock_lookup(char const *qcaddr, char const **paddr) {
+	int i;
+	char const *addr;
+	char scheme[32];
+
+	if ((addr = addr_split(qcaddr, scheme, sizeof(scheme))) != NULL) {
+		for (i = 0; i < (int) COUNT_OF(bt_transports); i++)
+			if (strcmp(scheme, bt_transports[i].scheme) == 0) {
+				*paddr = addr;
+				return &bt_transports[i];
+			}
+	}
+	*paddr = qcaddr;
+
+	return &bt_transports[0];
+}
+
+bt_sock_t bt_sock_open(char const *qcaddr, int channel) {
+	char const *addr;
+	bt_trans_t const *trans = bt_sock_lookup(qcaddr, &addr);
+
+	return (*trans->open)(addr, channel);
+}
+
+int bt_sock_redialable(char const *qcaddr) {
+	char const *addr;
+
+	return bt_sock_lookup(qcaddr, &addr)->redial;
+}
+
 int bt_sock_write(bt_sock_t sk, void const *data, int size) {
 
 	return send(sk, data, size, 0);
 }
 
+int bt_sock_writev(bt_sock_t sk, bt_iovec_t const *iov, int cnt) {
+	DWORD sent;
+
+	if (WSASend(sk, (LPWSABUF) iov, (DWORD) cnt, &sent, 0, NULL, NULL) != 0)
+		return -1;
+
+	return (int) sent;
+}
+
 int bt_sock_read(bt_sock_t sk, void *data, int size) {
 
 	return recv(sk, data, size, 0);
 }
 
+/*
+ * No zero-copy path here, the file payload is copied through a buffer
+ * after the "iov" head. Returns 0 once everything is sent, -1 otherwise.
+ */
+int bt_sock_sendfile(bt_sock_t sk, bt_iovec_t const *iov, int cnt, int fd,
+		     unsigned long off, int size) {
+	int i, res, curr;
+	char buf[1024 * 16];
+
+	for (i = 0; i < cnt; i++)
+		for (curr = 0; curr < (int) iov[i].len; curr += res)
+			if ((res = send(sk, iov[i].buf + curr, (int) iov[i].len - curr,
+					0)) <= 0)
+				return -1;
+	if (_lseeki64(fd, (__int64) off, SEEK_SET) < 0)
+		return -1;
+	for (; size > 0; size -= curr) {
+		if ((curr = _read(fd, buf, size < (int) sizeof(buf) ? size:
+				  (int) sizeof(buf))) <= 0)
+			return -1;
+		for (i = 0; i < curr; i += res)
+			if ((res = send(sk, buf + i, curr - i, 0)) <= 0)
+				return -1;
+	}
+
+	return 0;
+}
+
 int bt_sock_close(bt_sock_t sk) {
 	int res;
 
@@ -322,11 +463,147 @@ int bt_sock_close(bt_sock_t sk) {
 	return res;
 }
 
-int fglob_get_list(char const *path, char const *match, int recurse,
-		   file_list_t **flist) {
+int bt_sock_shutdown(bt_sock_t sk) {
+
+	return shutdown(sk, SD_BOTH);
+}
+
+static DWORD WINAPI w32_thread_proc(LPVOID param) {
+	w32_thread_ctx_t tctx = *(w32_thread_ctx_t *) param;
+
+	free(param);
+	(*tctx.proc)(tctx.priv);
+
+	return 0;
+}
+
+int sys_thread_create(sys_thread_t *thr, sys_thread_proc_t proc, void *priv) {
+	w32_thread_ctx_t *tctx;
+
+	if ((tctx = (w32_thread_ctx_t *) malloc(sizeof(w32_thread_ctx_t))) == NULL)
+		return -1;
+	tctx->proc = proc;
+	tctx->priv = priv;
+	if ((*thr = CreateThread(NULL, 0, w32_thread_proc, tctx, 0, NULL)) == NULL) {
+		free(tctx);
+		return -1;
+	}
+
+	return 0;
+}
+
+void sys_thread_join(sys_thread_t thr) {
+
+	WaitForSingleObject(thr, INFINITE);
+	CloseHandle(thr);
+}
+
+int sys_mutex_init(sys_mutex_t *mtx) {
+
+	InitializeCriticalSection(mtx);
+
+	return 0;
+}
+
+void sys_mutex_free(sys_mutex_t *mtx) {
+
+	DeleteCriticalSection(mtx);
+}
+
+void sys_mutex_lock(sys_mutex_t *mtx) {
+
+	EnterCriticalSection(mtx);
+}
+
+void sys_mutex_unlock(sys_mutex_t *mtx) {
+
+	LeaveCriticalSection(mtx);
+}
+
+int sys_event_init(sys_event_t *evt) {
+
+	return (*evt = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL ? -1: 0;
+}
+
+void sys_event_free(sys_event_t *evt) {
+
+	CloseHandle(*evt);
+}
+
+void sys_event_signal(sys_event_t *evt) {
+
+	SetEvent(*evt);
+}
+
+void sys_event_wait(sys_event_t *evt) {
+
+	WaitForSingleObject(*evt, INFINITE);
+}
+
+int sys_file_info(char const *path, unsigned long *size, unsigned long *mtime) {
+	struct _stat stbuf;
+
+	if (_stat(path, &stbuf))
+		return -1;
+	*size = (unsigned long) stbuf.st_size;
+	*mtime = (unsigned long) stbuf.st_mtime;
+
+	return 0;
+}
+
+double sys_now(void) {
+	static double tick;
+	LARGE_INTEGER cnt;
+
+	if (tick == 0) {
+		QueryPerformanceFrequency(&cnt);
+		tick = 1.0 / (double) cnt.QuadPart;
+	}
+	QueryPerformanceCounter(&cnt);
+
+	return tick * (double) cnt.QuadPart;
+}
+
+int sys_file_alloc(int fd, unsigned long size) {
+
+	if (size == 0)
+		return 0;
+	if (_filelengthi64(fd) < (__int64) size && _chsize_s(fd, (__int64) size) != 0)
+		return -1;
+
+	return 1;
+}
+
+int sys_pwrite(int fd, void const *data, int size, unsigned long off) {
+
+	if (_lseeki64(fd, (__int64) off, SEEK_SET) < 0 ||
+	    _write(fd, data, (unsigned int) size) != size)
+		return -1;
+
+	return size;
+}
+
+void sys_file_writeback(int fd, unsigned long off, unsigned long size, int drop) {
+
+}
+
+/*
+ * Transfers keep their buffered copies on Windows, so there is no mapping
+ * for the zero-copy put, or the mapped get sink, to use.
+ */
+void *sys_map_file(int fd, unsigned long off, unsigned long size, int wr) {
+
+	return NULL;
+}
+
+void sys_unmap_file(void *addr, unsigned long size) {
+
+}
+
+static int fglob_walk(char const *path, qtty_wild_t const *wp, int recurse,
+		      flist_t *fl) {
 	HANDLE hfind;
 	w32_glob_ctx_t *fctx;
-	file_list_t *fent;
 
 	if ((fctx = (w32_glob_ctx_t *) malloc(sizeof(w32_glob_ctx_t))) == NULL)
 		return -1;
@@ -339,23 +616,20 @@ int fglob_get_list(char const *path, char const *match, int recurse,
 			sprintf(fctx->nambuf, "%s\\%s", path, fctx->wfd.cFileName);
 			if (fctx->wfd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
 				if (recurse &&
-				    fglob_get_list(fctx->nambuf, match, recurse, flist) < 0) {
+				    fglob_walk(fctx->nambuf, wp, recurse, fl) < 0) {
 					FindClose(hfind);
 					free(fctx);
 					return -1;
 				}
 			} else {
-				if (match != NULL && !wildmatchi(fctx->wfd.cFileName, match))
+				if (wp != NULL && !wild_match(wp, fctx->wfd.cFileName))
 					continue;
-				if ((fent = (file_list_t *)
-				     malloc(sizeof(file_list_t) + strlen(fctx->nambuf) + 1)) == NULL) {
+				if (flist_add_path(fl, fctx->nambuf, strlen(fctx->nambuf), '\\',
+						   (unsigned long) fctx->wfd.nFileSizeLow) == NULL) {
 					FindClose(hfind);
 					free(fctx);
 					return -1;
 				}
-				strcpy(fent->name, fctx->nambuf);
-				fent->next = *flist;
-				*flist = fent;
 			}
 		} while (FindNextFile(hfind, &fctx->wfd));
 		FindClose(hfind);
@@ -365,3 +639,18 @@ int fglob_get_list(char const *path, char const *match, int recurse,
 	return 0;
 }
 
+int fglob_get_list(char const *path, char const *match, int recurse, flist_t *fl) {
+	int res;
+	qtty_wild_t *wp = NULL;
+
+	if (match != NULL && (wp = wild_compile(match, QTTY_WILD_ICASE)) == NULL)
+		return -1;
+	res = fglob_walk(path, wp, recurse, fl);
+	if (wp != NULL)
+		wild_free(wp);
+	if (flist_sort(fl) < 0)
+		res = -1;
+
+	return res;
+}
+
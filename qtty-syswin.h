@@ -19,14 +19,19 @@
 #define _QTTY_SYSWIN_H
 
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #include <ws2bth.h>
 #include <bluetoothapis.h>
 #include <windows.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <io.h>
 #include <direct.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
 
 
 #define INVALID_BT_SOCK INVALID_SOCKET
@@ -34,25 +39,57 @@
 #define SYS_SLASHC '\\'
 
 #define SNPRINTF _snprintf
+#define FILENO(f) _fileno(f)
 #define MKDIR(p, m) _mkdir(p)
 #define PATH_EXIST(p) (_access(p, 0) == 0)
 
+#define BT_IOV_SET(v, p, n) ((v).buf = (char *) (p), (v).len = (ULONG) (n))
+#define BT_IOV_BASE(v) ((v).buf)
+#define BT_IOV_LEN(v) ((v).len)
+
+#define SYS_LOAD_ACQ(p) (*(unsigned int volatile *) (p))
+#define SYS_STORE_REL(p, v) (*(unsigned int volatile *) (p) = (v))
+#define SYS_MEMBAR() MemoryBarrier()
+#define SYS_TLS __declspec(thread)
+
 
 typedef SOCKET bt_sock_t;
+typedef WSABUF bt_iovec_t;
 typedef unsigned short qtty_u16;
 typedef unsigned int qtty_u32;
-typedef struct s_file_list {
-	struct s_file_list *next;
-	char name[1];
-} file_list_t;
+typedef unsigned __int64 qtty_u64;
+typedef HANDLE sys_thread_t;
+typedef void *(*sys_thread_proc_t)(void *);
+typedef CRITICAL_SECTION sys_mutex_t;
+typedef HANDLE sys_event_t;
 
 
 bt_sock_t bt_sock_open(char const *qcaddr, int channel);
+int bt_sock_redialable(char const *qcaddr);
 int bt_sock_write(bt_sock_t sk, void const *data, int size);
+int bt_sock_writev(bt_sock_t sk, bt_iovec_t const *iov, int cnt);
 int bt_sock_read(bt_sock_t sk, void *data, int size);
+int bt_sock_sendfile(bt_sock_t sk, bt_iovec_t const *iov, int cnt, int fd,
+		     unsigned long off, int size);
 int bt_sock_close(bt_sock_t sk);
-int fglob_get_list(char const *path, char const *match, int recurse,
-		   file_list_t **flist);
+int bt_sock_shutdown(bt_sock_t sk);
+int sys_thread_create(sys_thread_t *thr, sys_thread_proc_t proc, void *priv);
+void sys_thread_join(sys_thread_t thr);
+int sys_mutex_init(sys_mutex_t *mtx);
+void sys_mutex_free(sys_mutex_t *mtx);
+void sys_mutex_lock(sys_mutex_t *mtx);
+void sys_mutex_unlock(sys_mutex_t *mtx);
+int sys_event_init(sys_event_t *evt);
+void sys_event_free(sys_event_t *evt);
+void sys_event_signal(sys_event_t *evt);
+void sys_event_wait(sys_event_t *evt);
+int sys_file_info(char const *path, unsigned long *size, unsigned long *mtime);
+double sys_now(void);
+int sys_file_alloc(int fd, unsigned long size);
+int sys_pwrite(int fd, void const *data, int size, unsigned long off);
+void sys_file_writeback(int fd, unsigned long off, unsigned long size, int drop);
+void *sys_map_file(int fd, unsigned long off, unsigned long size, int wr);
+void sys_unmap_file(void *addr, unsigned long size);
 
 
 #endif
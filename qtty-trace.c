@@ -0,0 +1,189 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#include "qtty.h"
+
+
+
+static trace_buf_t *trace_get_buf(void);
+static void trace_json_str(FILE *file, char const *str);
+
+
+
+int qtrace_on;
+static char trace_path[1024];
+static double trace_t0;
+static sys_mutex_t trace_mtx;
+static trace_buf_t *trace_bufs;
+static int trace_nbufs, trace_ntids;
+static unsigned long trace_drops;
+static SYS_TLS trace_buf_t *trace_cur;
+static SYS_TLS int trace_tid;
+static SYS_TLS char const *trace_tname;
+
+
+
+/*
+ * Starts recording to "path", or to the file named by the QTTY_TRACE
+ * environment variable if "path" is NULL. Nothing is recorded when
+ * neither is set.
+ */
+int trace_open(char const *path) {
+
+	if (path == NULL && (path = getenv(QTTY_TRACE_ENV)) == NULL)
+		return 0;
+	if (sys_mutex_init(&trace_mtx) < 0)
+		return -1;
+	SNPRINTF(trace_path, sizeof(trace_path), "%s", path);
+	trace_path[sizeof(trace_path) - 1] = 0;
+	trace_t0 = sys_now();
+	trace_tname = "main";
+	qtrace_on = 1;
+
+	return 0;
+}
+
+void trace_thread(char const *tname) {
+
+	trace_tname = tname;
+	if (trace_cur != NULL)
+		trace_cur->tname = tname;
+}
+
+/*
+ * Events are appended to a buffer owned by the calling thread, so the
+ * recording path takes the lock only when a buffer fills up. Buffers are
+ * kept until trace_close(), and past QTTY_TRACE_MAXBUFS of them events
+ * are counted and dropped.
+ */
+static trace_buf_t *trace_get_buf(void) {
+	trace_buf_t *tb;
+
+	if ((tb = trace_cur) != NULL && tb->count < QTTY_TRACE_NEVENTS)
+		return tb;
+	sys_mutex_lock(&trace_mtx);
+	if (trace_nbufs >= QTTY_TRACE_MAXBUFS ||
+	    (tb = (trace_buf_t *) malloc(sizeof(trace_buf_t))) == NULL) {
+		trace_drops++;
+		sys_mutex_unlock(&trace_mtx);
+		return NULL;
+	}
+	if (!trace_tid)
+		trace_tid = ++trace_ntids;
+	tb->tid = trace_tid;
+	tb->tname = trace_tname;
+	tb->count = 0;
+	tb->next = trace_bufs;
+	trace_bufs = tb;
+	trace_nbufs++;
+	sys_mutex_unlock(&trace_mtx);
+	trace_cur = tb;
+
+	return tb;
+}
+
+void trace_event(char const *name, double t0, long val, char const *txt) {
+	double now = sys_now();
+	trace_buf_t *tb;
+	trace_ev_t *ev;
+
+	if ((tb = trace_get_buf()) == NULL)
+		return;
+	ev = &tb->evs[tb->count++];
+	ev->name = name;
+	ev->ts = t0;
+	ev->dur = now - t0;
+	ev->val = val;
+	if (txt != NULL) {
+		strncpy(ev->txt, txt, sizeof(ev->txt) - 1);
+		ev->txt[sizeof(ev->txt) - 1] = 0;
+	} else
+		ev->txt[0] = 0;
+}
+
+static void trace_json_str(FILE *file, char const *str) {
+
+	fputc('"', file);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fputc('\\', file);
+		else if ((unsigned char) *str < ' ') {
+			fprintf(file, "\\u%04x", (unsigned int) *str);
+			continue;
+		}
+		fputc(*str, file);
+	}
+	fputc('"', file);
+}
+
+/*
+ * Writes the recorded events as Chrome trace-event JSON, loadable by
+ * chrome://tracing and Perfetto, and releases the buffers. Must be called
+ * after every recording thread is gone.
+ */
+int trace_close(void) {
+	int i, sep;
+	FILE *file;
+	trace_buf_t *tb;
+	trace_ev_t *ev;
+
+	if (!qtrace_on)
+		return 0;
+	qtrace_on = 0;
+	if ((file = fopen(trace_path, "wt")) == NULL)
+		perror(trace_path);
+	else
+		fprintf(file, "{\"traceEvents\":[\n");
+	for (sep = 0; (tb = trace_bufs) != NULL;) {
+		trace_bufs = tb->next;
+		if (file != NULL && tb->tname != NULL) {
+			fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+				"\"tid\":%d,\"args\":{\"name\":", sep ? ",\n": "", tb->tid);
+			trace_json_str(file, tb->tname);
+			fprintf(file, "}}");
+			sep = 1;
+		}
+		for (i = 0; file != NULL && i < tb->count; i++) {
+			ev = &tb->evs[i];
+			fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"qtty\",\"ph\":\"X\","
+				"\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+				"\"args\":{\"size\":%ld", sep ? ",\n": "", ev->name, tb->tid,
+				1e6 * (ev->ts - trace_t0), 1e6 * ev->dur, ev->val);
+			if (ev->txt[0]) {
+				fprintf(file, ",\"cmd\":");
+				trace_json_str(file, ev->txt);
+			}
+			fprintf(file, "}}");
+			sep = 1;
+		}
+		free(tb);
+	}
+	trace_nbufs = 0;
+	trace_cur = NULL;
+	sys_mutex_free(&trace_mtx);
+	if (file == NULL)
+		return -1;
+	fprintf(file, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%lu}}\n",
+		trace_drops);
+	if (fclose(file)) {
+		perror(trace_path);
+		return -1;
+	}
+
+	return 0;
+}
+
@@ -0,0 +1,61 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#if !defined(_QTTY_TRACE_H)
+#define _QTTY_TRACE_H
+
+
+#define QTTY_TRACE_ENV "QTTY_TRACE"
+#define QTTY_TRACE_NEVENTS 2048
+#define QTTY_TRACE_MAXBUFS 1024
+#define QTTY_TRACE_TXTSIZE 40
+
+#define TRACE_T0() (qtrace_on ? sys_now(): 0.0)
+#define TRACE_EVENT(n, t0, v, s) do { \
+	if (qtrace_on) \
+		trace_event(n, t0, v, s); \
+} while (0)
+
+
+typedef struct s_trace_ev {
+	char const *name;
+	double ts, dur;
+	long val;
+	char txt[QTTY_TRACE_TXTSIZE];
+} trace_ev_t;
+
+typedef struct s_trace_buf {
+	struct s_trace_buf *next;
+	int tid, count;
+	char const *tname;
+	trace_ev_t evs[QTTY_TRACE_NEVENTS];
+} trace_buf_t;
+
+
+
+extern int qtrace_on;
+
+
+
+int trace_open(char const *path);
+int trace_close(void);
+void trace_thread(char const *tname);
+void trace_event(char const *name, double t0, long val, char const *txt);
+
+
+#endif
+
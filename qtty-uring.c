@@ -0,0 +1,528 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#include "qtty.h"
+#if defined(HAVE_URING)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+
+
+/*
+ * Optional io_uring engines for the get and put data loops, driven with
+ * the raw system calls. The file side uses buffers registered with the
+ * ring, and the socket and file requests of each packet are submitted
+ * together, so that the two sides overlap from a single thread.
+ */
+#if defined(HAVE_URING)
+
+#define UR_OP_RECV 0
+#define UR_OP_SEND 1
+#define UR_OP_READ 2
+#define UR_OP_WRITE 3
+#define UR_NOPS 4
+#define UR_TAG(op, i) ((op) * QTTY_URING_BUFS + (i))
+#define UR_NTAGS (UR_NOPS * QTTY_URING_BUFS)
+#define UR_BUF(ur, i) ((ur)->bufs + (i) * QTTY_URING_BUFSIZE)
+
+
+struct s_qtty_uring {
+	int fd, rfd, wfd;
+	int fixed;
+	unsigned int nsub;
+	unsigned long enters;
+	unsigned int *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sqmap, *cqmap;
+	size_t sqmsize, cqmsize, sqesize;
+	int res[UR_NTAGS];
+	unsigned char busy[UR_NTAGS];
+	unsigned char *bufs;
+};
+
+
+
+static int ur_setup(qtty_uring_t *ur);
+static int ur_probe(qtty_uring_t *ur);
+static void ur_prep(qtty_uring_t *ur, int op, int i, int fd, void *data, int size,
+		    unsigned long off, int link);
+static int ur_submit(qtty_uring_t *ur, int wait);
+static void ur_reap(qtty_uring_t *ur);
+static int ur_wait(qtty_uring_t *ur, int op, int i);
+static void ur_drain(qtty_uring_t *ur);
+static int ur_retire(qtty_uring_t *ur, qtty_conn_t *qc, file_sink_t *fs, int i,
+		     int *wsize);
+
+
+
+static int ur_setup(qtty_uring_t *ur) {
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	if ((ur->fd = (int) syscall(__NR_io_uring_setup, QTTY_URING_ENTRIES, &p)) < 0)
+		return -1;
+	ur->sqmsize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ur->cqmsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && ur->cqmsize > ur->sqmsize)
+		ur->sqmsize = ur->cqmsize;
+	if ((ur->sqmap = mmap(NULL, ur->sqmsize, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, ur->fd,
+			      IORING_OFF_SQ_RING)) == MAP_FAILED)
+		return -1;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->cqmap = ur->sqmap;
+		ur->cqmsize = 0;
+	} else if ((ur->cqmap = mmap(NULL, ur->cqmsize, PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ur->fd,
+				     IORING_OFF_CQ_RING)) == MAP_FAILED) {
+		ur->cqmap = NULL;
+		return -1;
+	}
+	ur->sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ((ur->sqes = (struct io_uring_sqe *)
+	     mmap(NULL, ur->sqesize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		  ur->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+		ur->sqes = NULL;
+		return -1;
+	}
+	ur->sq_tail = (unsigned int *) ((char *) ur->sqmap + p.sq_off.tail);
+	ur->sq_mask = (unsigned int *) ((char *) ur->sqmap + p.sq_off.ring_mask);
+	ur->sq_array = (unsigned int *) ((char *) ur->sqmap + p.sq_off.array);
+	ur->cq_head = (unsigned int *) ((char *) ur->cqmap + p.cq_off.head);
+	ur->cq_tail = (unsigned int *) ((char *) ur->cqmap + p.cq_off.tail);
+	ur->cq_mask = (unsigned int *) ((char *) ur->cqmap + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *) ((char *) ur->cqmap + p.cq_off.cqes);
+
+	return 0;
+}
+
+/*
+ * Kernels before the probe interface (5.6) lack some of the opcodes used
+ * here anyway, so a failed probe counts as no support.
+ */
+static int ur_probe(qtty_uring_t *ur) {
+	int i, res = 0;
+	struct io_uring_probe *probe;
+	static int const ops[] = {
+		IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ_FIXED,
+		IORING_OP_WRITE_FIXED, IORING_OP_READ, IORING_OP_WRITE
+	};
+
+	if ((probe = (struct io_uring_probe *)
+	     calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op))) == NULL)
+		return -1;
+	if (syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_PROBE, probe,
+		    256) < 0)
+		res = -1;
+	for (i = 0; res == 0 && i < (int) COUNT_OF(ops); i++)
+		if (ops[i] > probe->last_op ||
+		    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			res = -1;
+	free(probe);
+
+	return res;
+}
+
+/*
+ * Queues one request for slot "i". File reads and writes go through the
+ * registered buffers when the ring has them, and socket sends and receives
+ * wait for the whole size. With "link" set, the next request queued only
+ * starts after this one fully completed.
+ */
+static void ur_prep(qtty_uring_t *ur, int op, int i, int fd, void *data, int size,
+		    unsigned long off, int link) {
+	unsigned int tail = *ur->sq_tail, idx = tail & *ur->sq_mask;
+	struct io_uring_sqe *sqe = ur->sqes + idx;
+
+	memset(sqe, 0, sizeof(*sqe));
+	switch (op) {
+	case UR_OP_RECV:
+		sqe->opcode = IORING_OP_RECV;
+		sqe->msg_flags = MSG_WAITALL;
+		break;
+	case UR_OP_SEND:
+		sqe->opcode = IORING_OP_SEND;
+		sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+		break;
+	case UR_OP_READ:
+		sqe->opcode = ur->fixed ? IORING_OP_READ_FIXED: IORING_OP_READ;
+		break;
+	case UR_OP_WRITE:
+		sqe->opcode = ur->fixed ? IORING_OP_WRITE_FIXED: IORING_OP_WRITE;
+		break;
+	}
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) data;
+	sqe->len = (unsigned int) size;
+	sqe->off = off;
+	sqe->buf_index = (unsigned short) i;
+	sqe->user_data = UR_TAG(op, i);
+	if (link)
+		sqe->flags |= IOSQE_IO_LINK;
+	ur->sq_array[idx] = idx;
+	ur->busy[UR_TAG(op, i)] = 1;
+	SYS_STORE_REL(ur->sq_tail, tail + 1);
+	ur->nsub++;
+}
+
+/*
+ * Hands the queued requests to the kernel, and with "wait" set also blocks
+ * until at least one completion is posted.
+ */
+static int ur_submit(qtty_uring_t *ur, int wait) {
+	int res;
+
+	do {
+		ur->enters++;
+		res = (int) syscall(__NR_io_uring_enter, ur->fd, ur->nsub, wait ? 1: 0,
+				    wait ? IORING_ENTER_GETEVENTS: 0, NULL, 0);
+	} while (res < 0 && errno == EINTR);
+	if (res > 0)
+		ur->nsub -= (unsigned int) res < ur->nsub ? (unsigned int) res: ur->nsub;
+
+	return res < 0 ? -1: 0;
+}
+
+static void ur_reap(qtty_uring_t *ur) {
+	unsigned int head = *ur->cq_head;
+	struct io_uring_cqe *cqe;
+
+	for (; head != SYS_LOAD_ACQ(ur->cq_tail); head++) {
+		cqe = ur->cqes + (head & *ur->cq_mask);
+		if (cqe->user_data < UR_NTAGS) {
+			ur->res[cqe->user_data] = cqe->res;
+			ur->busy[cqe->user_data] = 0;
+		}
+	}
+	SYS_STORE_REL(ur->cq_head, head);
+}
+
+/*
+ * Returns the result of the request of "op" on slot "i", waiting for it.
+ */
+static int ur_wait(qtty_uring_t *ur, int op, int i) {
+	int tag = UR_TAG(op, i);
+
+	for (ur_reap(ur); ur->busy[tag]; ur_reap(ur))
+		if (ur_submit(ur, 1) < 0)
+			return -EIO;
+
+	return ur->res[tag];
+}
+
+static void ur_drain(qtty_uring_t *ur) {
+	int tag;
+
+	for (tag = 0; tag < UR_NTAGS; tag++)
+		if (ur->busy[tag])
+			ur_wait(ur, tag / QTTY_URING_BUFS, tag % QTTY_URING_BUFS);
+}
+
+/*
+ * Waits for the sink write of slot "i", if any, and accounts it.
+ */
+static int ur_retire(qtty_uring_t *ur, qtty_conn_t *qc, file_sink_t *fs, int i,
+		     int *wsize) {
+	int res;
+	double t0;
+
+	if (wsize[i] == 0)
+		return 0;
+	t0 = sys_now();
+	res = ur_wait(ur, UR_OP_WRITE, i);
+	qc->st.disk_secs += sys_now() - t0;
+	TRACE_EVENT("dproc", t0, wsize[i], NULL);
+	if (res != wsize[i])
+		return -1;
+	sink_advance(fs, wsize[i]);
+	wsize[i] = 0;
+
+	return 0;
+}
+
+/*
+ * Only stream sockets on both directions qualify, since the receive side
+ * relies on MSG_WAITALL. Returns NULL when the kernel, or the transport,
+ * does not allow it. Buffers which cannot be registered (locked memory
+ * limits) are still used, with the plain read/write opcodes.
+ */
+qtty_uring_t *uring_create(bt_sock_t sk) {
+	int i;
+	qtty_uring_t *ur;
+	struct stat stb;
+	struct iovec iov[QTTY_URING_BUFS];
+
+	if ((ur = (qtty_uring_t *) calloc(1, sizeof(qtty_uring_t))) == NULL)
+		return NULL;
+	ur->fd = -1;
+	ur->rfd = bt_sock_fd(sk);
+	ur->wfd = bt_sock_wfd(sk);
+	if (fstat(ur->rfd, &stb) != 0 || !S_ISSOCK(stb.st_mode) ||
+	    fstat(ur->wfd, &stb) != 0 || !S_ISSOCK(stb.st_mode) ||
+	    ur_setup(ur) < 0 || ur_probe(ur) < 0 ||
+	    (ur->bufs = (unsigned char *) malloc(QTTY_URING_BUFS *
+						 QTTY_URING_BUFSIZE)) == NULL) {
+		uring_free(ur);
+		return NULL;
+	}
+	for (i = 0; i < QTTY_URING_BUFS; i++)
+		BT_IOV_SET(iov[i], UR_BUF(ur, i), QTTY_URING_BUFSIZE);
+	ur->fixed = syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_BUFFERS, iov,
+			    QTTY_URING_BUFS) == 0;
+
+	return ur;
+}
+
+void uring_free(qtty_uring_t *ur) {
+
+	if (ur->sqes != NULL)
+		munmap(ur->sqes, ur->sqesize);
+	if (ur->cqmap != NULL && ur->cqmsize != 0)
+		munmap(ur->cqmap, ur->cqmsize);
+	if (ur->sqmap != NULL)
+		munmap(ur->sqmap, ur->sqmsize);
+	if (ur->fd >= 0)
+		close(ur->fd);
+	free(ur->bufs);
+	free(ur);
+}
+
+/*
+ * Number of io_uring_enter() calls, which the kernel I/O accounting used by
+ * the benchmarks does not see.
+ */
+unsigned long uring_enters(qtty_uring_t const *ur) {
+
+	return ur->enters;
+}
+
+/*
+ * Each receive takes the rest of the current packet plus the header of
+ * the next one, so the size of the next receive is known as soon as it
+ * completes. It is linked to the sink write of the same payload, and the
+ * pair is submitted together. Up to QTTY_URING_BUFS writes stay in flight,
+ * and hashing runs while the next receive is pending. Complete packets
+ * found in the receive buffer go through dump_to_sink() first, and the
+ * digest trailer is left in the socket for next_pkt().
+ */
+int uring_get_data(qtty_conn_t *qc, file_sink_t *fs, unsigned int *tsize) {
+	qtty_uring_t *ur = qc->ring;
+	int i, j, size, nsize, have, want, curr, count, res;
+	unsigned long woff;
+	double t0;
+	char const *data;
+	unsigned char *buf;
+	int wsize[QTTY_URING_BUFS];
+
+	for (*tsize = 0;;) {
+		if (qconn_pkt_ready(qc)) {
+			if (next_pkt(qc, &data, &size) < 0)
+				return -1;
+			if (!size)
+				return 0;
+			t0 = sys_now();
+			res = dump_to_sink(fs, data, size);
+			qc->st.disk_secs += sys_now() - t0;
+			if (res != size)
+				return -1;
+			sha1_update(&qc->xsctx, (unsigned char const *) data, size);
+			*tsize += size;
+		} else if (qc->rxcnt >= QTTY_PKT_HDRSIZE)
+			break;
+		else {
+			t0 = sys_now();
+			res = qconn_read_avail(qc);
+			qc->st.sock_secs += sys_now() - t0;
+			if (res <= 0)
+				return -1;
+		}
+	}
+	GET_LE16(size, qc->rxbuf + qc->rxoff + 1);
+	have = qc->rxcnt - QTTY_PKT_HDRSIZE;
+	memcpy(UR_BUF(ur, 0), qc->rxbuf + qc->rxoff + QTTY_PKT_HDRSIZE, have);
+	qc->rxoff = qc->rxcnt = 0;
+	qc->st.rx_bytes += QTTY_PKT_HDRSIZE;
+	memset(wsize, 0, sizeof(wsize));
+	woff = fs->off;
+	ur_prep(ur, UR_OP_RECV, 0, ur->rfd, UR_BUF(ur, 0) + have,
+		size + QTTY_PKT_HDRSIZE - have, 0, 1);
+	ur_prep(ur, UR_OP_WRITE, 0, fs->fd, UR_BUF(ur, 0), size, woff, 0);
+	for (i = 0, res = 0;; i = j) {
+		buf = UR_BUF(ur, i);
+		wsize[i] = size;
+		woff += size;
+		want = size + QTTY_PKT_HDRSIZE - have;
+		t0 = sys_now();
+		if ((curr = ur_wait(ur, UR_OP_RECV, i)) <= 0) {
+			res = -1;
+			break;
+		}
+		if (curr < want) {
+			/*
+			 * Short receive (signal, or peer going away): the
+			 * linked write was cancelled or saw partial data, so
+			 * it is redone once the data is complete.
+			 */
+			ur_wait(ur, UR_OP_WRITE, i);
+			for (curr += have; curr < size + QTTY_PKT_HDRSIZE; curr += count)
+				if ((count = bt_sock_read(qc->fd, buf + curr,
+							  size + QTTY_PKT_HDRSIZE - curr)) <= 0)
+					break;
+			if (curr < size + QTTY_PKT_HDRSIZE) {
+				res = -1;
+				break;
+			}
+			ur_prep(ur, UR_OP_WRITE, i, fs->fd, buf, size, woff - size, 0);
+		}
+		qc->st.sock_secs += sys_now() - t0;
+		TRACE_EVENT("sock_read", t0, want, NULL);
+		qc->st.rx_pkts++;
+		qc->st.rx_bytes += size + QTTY_PKT_HDRSIZE;
+		GET_LE16(nsize, buf + size + 1);
+		j = (i + 1) % QTTY_URING_BUFS;
+		if (SYS_LOAD_ACQ(&qc->abort) ||
+		    ur_retire(ur, qc, fs, j, wsize) < 0) {
+			res = -1;
+			break;
+		}
+		if (nsize) {
+			ur_prep(ur, UR_OP_RECV, j, ur->rfd, UR_BUF(ur, j),
+				nsize + QTTY_PKT_HDRSIZE, 0, 1);
+			ur_prep(ur, UR_OP_WRITE, j, fs->fd, UR_BUF(ur, j), nsize, woff, 0);
+			if (ur_submit(ur, 0) < 0) {
+				res = -1;
+				break;
+			}
+		}
+		sha1_update(&qc->xsctx, buf, size);
+		*tsize += size;
+		if (!nsize) {
+			qc->st.rx_pkts++;
+			break;
+		}
+		size = nsize;
+		have = 0;
+	}
+	for (j = 1; j <= QTTY_URING_BUFS; j++)
+		if (ur_retire(ur, qc, fs, (i + j) % QTTY_URING_BUFS, wsize) < 0)
+			res = -1;
+	ur_drain(ur);
+
+	return res;
+}
+
+/*
+ * The read of the next chunk is submitted together with the send of the
+ * current one, and the chunk is hashed while both run. Only one send is
+ * in flight at any time, which keeps the packets in order on the wire.
+ */
+int uring_put_data(qtty_conn_t *qc, int fd, int chunk, unsigned int fsize) {
+	qtty_uring_t *ur = qc->ring;
+	int i, j, curr, next, sent, count, res;
+	unsigned int tsize;
+	double t0;
+	unsigned char *buf;
+	xfer_adapt_t xa;
+
+	if (flush_pkts(qc) < 0)
+		return -1;
+	if (qc->putchunk == 0) {
+		adapt_init(&xa, qc, chunk);
+		chunk = xa.chunk;
+	}
+	curr = (unsigned int) chunk < fsize ? chunk: (int) fsize;
+	ur_prep(ur, UR_OP_READ, 0, fd, UR_BUF(ur, 0) + QTTY_PKT_HDRSIZE, curr, 0, 0);
+	for (i = 0, res = 0, tsize = 0; tsize < fsize; tsize += curr, curr = next, i = j) {
+		buf = UR_BUF(ur, i);
+		t0 = sys_now();
+		if (ur_wait(ur, UR_OP_READ, i) != curr) {
+			res = -1;
+			break;
+		}
+		qc->st.disk_secs += sys_now() - t0;
+		TRACE_EVENT("rproc", t0, curr, NULL);
+		if (SYS_LOAD_ACQ(&qc->abort)) {
+			res = -1;
+			break;
+		}
+		buf[0] = 0;
+		PUT_LE16((unsigned int) curr, buf + 1);
+		ur_prep(ur, UR_OP_SEND, i, ur->wfd, buf, QTTY_PKT_HDRSIZE + curr, 0, 0);
+		j = (i + 1) % QTTY_URING_BUFS;
+		next = fsize - tsize - curr < (unsigned int) chunk ?
+			(int) (fsize - tsize - curr): chunk;
+		if (next > 0)
+			ur_prep(ur, UR_OP_READ, j, fd, UR_BUF(ur, j) + QTTY_PKT_HDRSIZE, next,
+				tsize + curr, 0);
+		if (ur_submit(ur, 0) < 0) {
+			res = -1;
+			break;
+		}
+		sha1_update(&qc->xsctx, buf + QTTY_PKT_HDRSIZE, curr);
+		t0 = sys_now();
+		sent = ur_wait(ur, UR_OP_SEND, i);
+		for (; sent >= 0 && sent < QTTY_PKT_HDRSIZE + curr; sent += count)
+			if ((count = bt_sock_write(qc->fd, buf + sent,
+						   QTTY_PKT_HDRSIZE + curr - sent)) <= 0)
+				break;
+		qc->st.sock_secs += sys_now() - t0;
+		TRACE_EVENT("send_pkt", t0, curr, NULL);
+		if (sent < QTTY_PKT_HDRSIZE + curr) {
+			res = -1;
+			break;
+		}
+		qc->st.tx_pkts++;
+		qc->st.tx_bytes += QTTY_PKT_HDRSIZE + curr;
+		if (qc->putchunk == 0)
+			chunk = adapt_sent(&xa, qc, curr);
+	}
+	ur_drain(ur);
+
+	return res;
+}
+
+#else
+
+qtty_uring_t *uring_create(bt_sock_t sk) {
+
+	return NULL;
+}
+
+void uring_free(qtty_uring_t *ur) {
+
+}
+
+unsigned long uring_enters(qtty_uring_t const *ur) {
+
+	return 0;
+}
+
+int uring_get_data(qtty_conn_t *qc, file_sink_t *fs, unsigned int *tsize) {
+
+	return -1;
+}
+
+int uring_put_data(qtty_conn_t *qc, int fd, int chunk, unsigned int fsize) {
+
+	return -1;
+}
+
+#endif
+
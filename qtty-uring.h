@@ -0,0 +1,37 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#if !defined(_QTTY_URING_H)
+#define _QTTY_URING_H
+
+
+#define QTTY_URING_ENTRIES 16
+#define QTTY_URING_BUFS 4
+#define QTTY_URING_BUFSIZE (QTTY_PKT_HDRSIZE + QTTY_PKT_MAXSIZE + QTTY_PKT_HDRSIZE)
+
+
+typedef struct s_qtty_uring qtty_uring_t;
+
+
+
+qtty_uring_t *uring_create(bt_sock_t sk);
+void uring_free(qtty_uring_t *ur);
+unsigned long uring_enters(qtty_uring_t const *ur);
+
+
+#endif
+
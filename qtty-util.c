@@ -21,7 +21,49 @@
 
 static int iswild(char const *str);
 static int really_write(bt_sock_t fd, char const *data, int size);
-static int really_read(bt_sock_t fd, char *data, int size);
+static int really_writev(bt_sock_t fd, bt_iovec_t *iov, int cnt);
+static int fill_rxbuf(qtty_conn_t *qc, int size);
+static int get_cmd_recv(qtty_conn_t *qc, int (*dproc)(void *, void const *, int),
+			void *priv, file_sink_t *fs, unsigned int *tsize);
+static int get_cmd_run(qtty_conn_t *qc, char const *cmd, unsigned int fsize,
+		       int (*dproc)(void *, void const *, int), void *priv,
+		       file_sink_t *fs, FILE *flerr);
+static int put_copy_data(qtty_conn_t *qc, unsigned int chunk, unsigned int fsize,
+			 int (*rproc)(void *, void *, int), void *priv);
+static int put_file_data(qtty_conn_t *qc, unsigned int chunk, unsigned int fsize,
+			 int fd);
+static int put_cmd_send(qtty_conn_t *qc, unsigned int fsize,
+			int (*rproc)(void *, void *, int), void *priv, int fd,
+			FILE *flerr);
+static int put_cmd_run(qtty_conn_t *qc, char const *cmd, unsigned int fsize,
+		       int (*rproc)(void *, void *, int), void *priv, int fd,
+		       FILE *flerr);
+static int get_cmd_drain(qtty_conn_t *qc);
+static int sum_check(qtty_conn_t *qc, FILE *flerr);
+static void xfer_log(qtty_conn_t *qc, char const *cmd, unsigned int size, int res);
+static int sink_map(file_sink_t *fs);
+static int discard_data(void *priv, void const *data, int size);
+static int journal_read(char const *jpath, char const *remote,
+			unsigned long *total, unsigned long *done);
+static int journal_write(char const *jpath, char const *remote,
+			 unsigned long total, unsigned long done);
+static int dump_to_journal(void *priv, void const *data, int size);
+static int local_get_resume(qtty_conn_t *qc, char const *remote, char const *local,
+			    FILE *flerr);
+static int delta_put(qtty_conn_t *qc, mfst_t *mf, char const *pcmd, char const *remote,
+		     char const *local, mfst_hash_t const *hs, FILE *flerr);
+static void delta_report(mfst_t const *mf, FILE *flerr);
+static void mput_paths(file_list_t const *fcur, char const *lpath, char const *rpath,
+		       char *lfile, int lsize, char *rfile, int rsize);
+static mfst_hash_t *delta_prehash(mfst_t *mf, flist_t const *fl, char const *lpath,
+				  char const *rpath);
+static int is_end_cmd(char const *line);
+static char *batch_line(char * const *cmds, int ncmds, int *icmd, FILE *fin,
+			char *buf, int size);
+
+
+
+static int uring_warned;
 
 
 
@@ -44,183 +86,1091 @@ static int really_write(bt_sock_t fd, char const *data, int size) {
 		count += curr;
 	}
 
-	return size;
+	return count;
 }
 
-int send_pkt(bt_sock_t fd, char const *data, int size) {
-	char buf[8];
+static int really_writev(bt_sock_t fd, bt_iovec_t *iov, int cnt) {
+	int count, curr;
+
+	for (count = 0; cnt > 0;) {
+		curr = bt_sock_writev(fd, iov, cnt);
+		if (curr <= 0)
+			return -1;
+		count += curr;
+		for (; cnt > 0 && curr >= (int) BT_IOV_LEN(*iov); iov++, cnt--)
+			curr -= (int) BT_IOV_LEN(*iov);
+		if (cnt > 0 && curr > 0)
+			BT_IOV_SET(*iov, (char *) BT_IOV_BASE(*iov) + curr,
+				   BT_IOV_LEN(*iov) - curr);
+	}
 
-	buf[0] = 0;
-	PUT_LE16((unsigned int) size, buf + 1);
-	if (really_write(fd, buf, 3) != 3)
+	return count;
+}
+
+qtty_conn_t *qconn_open(bt_sock_t fd) {
+	qtty_conn_t *qc;
+
+	if ((qc = (qtty_conn_t *) malloc(sizeof(qtty_conn_t))) == NULL)
+		return NULL;
+	qc->cfg = NULL;
+	qc->fd = fd;
+	qc->rxoff = qc->rxcnt = 0;
+	qc->txcnt = qc->txbatch = 0;
+	qc->getq = qc->putq = 0;
+	qc->putchunk = QTTY_PKT_MAXSIZE;
+	qc->getsink = 0;
+	qc->zip = NULL;
+	qc->ring = NULL;
+	qc->xsum = 0;
+	qc->abort = 0;
+	stats_init(&qc->st);
+	qc->st.allocs++;
+
+	return qc;
+}
+
+/*
+ * Opens a fully authenticated session: connection, banner and login. The
+ * banner is echoed on "flban" when not NULL. Returns -1 if the server
+ * cannot be reached, and -2 if the login fails.
+ */
+int qconn_connect(qtty_cfg_t const *cfg, FILE *flban, FILE *flerr,
+		  qtty_conn_t **pqc) {
+	int res;
+	qtty_conn_t *qc;
+
+	if ((qc = qconn_dial(cfg)) == NULL)
+		return -1;
+	if ((res = qconn_login(qc, flban, flerr)) < 0) {
+		qconn_close(qc);
+		return res;
+	}
+	*pqc = qc;
+
+	return 0;
+}
+
+/*
+ * The first half of qconn_connect(): a connection to the server of "cfg",
+ * with the session options of "cfg", which has not read the banner yet.
+ * Lets the caller publish the connection before it blocks on the server.
+ */
+qtty_conn_t *qconn_dial(qtty_cfg_t const *cfg) {
+	bt_sock_t fd;
+	qtty_conn_t *qc;
+
+	if ((fd = bt_sock_open(cfg->qcaddr, cfg->channel)) == INVALID_BT_SOCK)
+		return NULL;
+	if ((qc = qconn_open(fd)) == NULL) {
+		bt_sock_close(fd);
+		return NULL;
+	}
+	qc->cfg = cfg;
+	qc->getq = cfg->getq;
+	qc->putq = cfg->putq;
+	qc->putchunk = cfg->putchunk > 0 ? cfg->putchunk: 0;
+	qc->getsink = cfg->getsink;
+
+	return qc;
+}
+
+/*
+ * The second half of qconn_connect(), with the same results. The
+ * connection is left open on failure.
+ */
+int qconn_login(qtty_conn_t *qc, FILE *flban, FILE *flerr) {
+	int size;
+	qtty_cfg_t const *cfg = qc->cfg;
+	char *line;
+
+	if (recv_pkt(qc, &line, &size) < 0)
+		return -1;
+	if (flban != NULL)
+		fprintf(flban, "%s", line);
+	if (do_login(qc, line, cfg->user, cfg->passwd, flerr) < 0) {
+		free(line);
+		return -2;
+	}
+	if ((cfg->zlevel > 0 && qconn_zip(qc, line, cfg->zlevel, flerr) < 0) ||
+	    qconn_sum(qc, line, flerr) < 0) {
+		free(line);
 		return -1;
-	if (size > 0 && really_write(fd, data, size) != size)
+	}
+	free(line);
+	if (cfg->uring && qconn_uring(qc) < 0 && !uring_warned) {
+		uring_warned = 1;
+		fprintf(flerr, "io_uring not usable on this connection, using blocking I/O\n");
+	}
+
+	return 0;
+}
+
+/*
+ * Switches get/put payloads to compressed frames, if the server banner
+ * offers it. Servers which do not are left alone, and the session simply
+ * stays raw.
+ */
+int qconn_zip(qtty_conn_t *qc, char const *banner, int level, FILE *flerr) {
+	int size;
+	char const *data;
+
+	if (strstr(banner, QTTY_ZIP_CAPS) == NULL ||
+	    (qc->zip = zip_create(level)) == NULL)
+		return 0;
+	if (send_cmd(qc, QTTY_ZIP_CMD) < 0 ||
+	    next_pkt(qc, &data, &size) < 0)
 		return -1;
+	if (size) {
+		fwrite(data, 1, size, flerr);
+		zip_free(qc->zip);
+		qc->zip = NULL;
+		do {
+			if (next_pkt(qc, &data, &size) < 0)
+				return -1;
+		} while (size);
+	}
 
 	return 0;
 }
 
-static int really_read(bt_sock_t fd, char *data, int size) {
-	int count, curr;
+/*
+ * The server side of qconn_zip(), answering the QTTY_ZIP_CMD request whose
+ * arguments are in "args". Compression is turned on at "level" with an
+ * empty reply, or refused with a message, always when "level" is 0.
+ */
+int qconn_zip_accept(qtty_conn_t *qc, char const *args, int level) {
+	int size;
+	char msg[256];
 
-	for (count = 0; count < size;) {
-		curr = bt_sock_read(fd, data + count, size - count);
+	if (level <= 0 || strcmp(args, "deflate") != 0)
+		SNPRINTF(msg, sizeof(msg), "Unsupported compression: %s\n", args);
+	else if (qc->zip == NULL && (qc->zip = zip_create(level)) == NULL)
+		SNPRINTF(msg, sizeof(msg), "Unable to setup compression\n");
+	else
+		return send_pkt(qc, "", 0);
+	msg[sizeof(msg) - 1] = 0;
+	size = (int) strlen(msg);
+
+	return send_pkt(qc, msg, size) < 0 ? -1: send_pkt(qc, "", 0);
+}
+
+/*
+ * Asks servers offering it for the SHA-1 of every get/put payload, sent
+ * as an extra packet after the transfer, to be checked against the one
+ * computed locally while the data streams.
+ */
+int qconn_sum(qtty_conn_t *qc, char const *banner, FILE *flerr) {
+	int size;
+	char const *data;
+
+	if (strstr(banner, QTTY_SUM_CAPS) == NULL)
+		return 0;
+	if (send_cmd(qc, QTTY_SUM_CMD) < 0 ||
+	    next_pkt(qc, &data, &size) < 0)
+		return -1;
+	if (size) {
+		fwrite(data, 1, size, flerr);
+		do {
+			if (next_pkt(qc, &data, &size) < 0)
+				return -1;
+		} while (size);
+	} else
+		qc->xsum = 1;
+
+	return 0;
+}
+
+/*
+ * Moves get/put payloads of the connection to the io_uring engines. The
+ * blocking path stays in place when the kernel or the transport cannot
+ * do it, and for the transfers the engines do not handle.
+ */
+int qconn_uring(qtty_conn_t *qc) {
+
+	if (qc->ring == NULL && (qc->ring = uring_create(qc->fd)) == NULL)
+		return -1;
+
+	return 0;
+}
+
+void qconn_close(qtty_conn_t *qc) {
+
+	if (qc->ring != NULL)
+		uring_free(qc->ring);
+	if (qc->zip != NULL)
+		zip_free(qc->zip);
+	bt_sock_close(qc->fd);
+	free(qc);
+}
+
+/*
+ * Each packet goes out with a single gather write, together with anything
+ * still queued by a batch. Inside a batch, packets are only appended to the
+ * transmit buffer, and they hit the wire when the buffer fills up, when the
+ * batch ends, or when the connection needs to wait for a reply.
+ */
+int send_pkt(qtty_conn_t *qc, char const *data, int size) {
+	int niov, res;
+	double t0, tt = TRACE_T0();
+	bt_iovec_t iov[3];
+	char hdr[QTTY_PKT_HDRSIZE];
+
+	qc->st.tx_pkts++;
+	qc->st.tx_bytes += QTTY_PKT_HDRSIZE + size;
+	if (qc->txbatch &&
+	    qc->txcnt + QTTY_PKT_HDRSIZE + size <= (int) sizeof(qc->txbuf)) {
+		qc->txbuf[qc->txcnt] = 0;
+		PUT_LE16((unsigned int) size, qc->txbuf + qc->txcnt + 1);
+		if (size > 0)
+			memcpy(qc->txbuf + qc->txcnt + QTTY_PKT_HDRSIZE, data, size);
+		qc->txcnt += QTTY_PKT_HDRSIZE + size;
+		TRACE_EVENT("send_pkt", tt, size, NULL);
+		return 0;
+	}
+	niov = 0;
+	if (qc->txcnt > 0) {
+		BT_IOV_SET(iov[niov], qc->txbuf, qc->txcnt);
+		niov++;
+	}
+	hdr[0] = 0;
+	PUT_LE16((unsigned int) size, hdr + 1);
+	BT_IOV_SET(iov[niov], hdr, QTTY_PKT_HDRSIZE);
+	niov++;
+	if (size > 0) {
+		BT_IOV_SET(iov[niov], data, size);
+		niov++;
+	}
+	qc->txcnt = 0;
+	if (SYS_LOAD_ACQ(&qc->abort))
+		return -1;
+	t0 = sys_now();
+	res = really_writev(qc->fd, iov, niov);
+	qc->st.sock_secs += sys_now() - t0;
+	TRACE_EVENT("send_pkt", tt, size, NULL);
+
+	return res < 0 ? -1: 0;
+}
+
+/*
+ * Like send_pkt(), with the payload being "size" bytes of "fd" at "off",
+ * which bt_sock_sendfile() moves without copying them through user space
+ * buffers where the transport allows it.
+ */
+int send_pkt_file(qtty_conn_t *qc, int fd, unsigned long off, int size) {
+	int niov, res;
+	double t0, tt = TRACE_T0();
+	bt_iovec_t iov[2];
+	char hdr[QTTY_PKT_HDRSIZE];
+
+	qc->st.tx_pkts++;
+	qc->st.tx_bytes += QTTY_PKT_HDRSIZE + size;
+	niov = 0;
+	if (qc->txcnt > 0) {
+		BT_IOV_SET(iov[niov], qc->txbuf, qc->txcnt);
+		niov++;
+	}
+	hdr[0] = 0;
+	PUT_LE16((unsigned int) size, hdr + 1);
+	BT_IOV_SET(iov[niov], hdr, QTTY_PKT_HDRSIZE);
+	niov++;
+	qc->txcnt = 0;
+	if (SYS_LOAD_ACQ(&qc->abort))
+		return -1;
+	t0 = sys_now();
+	res = bt_sock_sendfile(qc->fd, iov, niov, fd, off, size);
+	qc->st.sock_secs += sys_now() - t0;
+	TRACE_EVENT("send_pkt", tt, size, NULL);
+
+	return res < 0 ? -1: 0;
+}
+
+/*
+ * Sends a command packet, starting its round trip and transfer accounting.
+ */
+int send_cmd(qtty_conn_t *qc, char const *cmd) {
+	int res, size = strlen(cmd);
+
+	stats_cmd(&qc->st);
+	res = send_pkt(qc, cmd, size);
+	TRACE_EVENT("cmd", qc->st.cur.t0, size, cmd);
+
+	return res;
+}
+
+int flush_pkts(qtty_conn_t *qc) {
+	int size = qc->txcnt, res;
+	double t0;
+
+	if (size == 0)
+		return 0;
+	qc->txcnt = 0;
+	if (SYS_LOAD_ACQ(&qc->abort))
+		return -1;
+	t0 = sys_now();
+	res = really_write(qc->fd, qc->txbuf, size);
+	qc->st.sock_secs += sys_now() - t0;
+	TRACE_EVENT("flush_pkts", t0, size, NULL);
+
+	return res != size ? -1: 0;
+}
+
+void pkt_batch_begin(qtty_conn_t *qc) {
+
+	qc->txbatch++;
+}
+
+int pkt_batch_end(qtty_conn_t *qc) {
+
+	if (--qc->txbatch > 0)
+		return 0;
+
+	return flush_pkts(qc);
+}
+
+/*
+ * Makes sure at least "size" bytes are available at rxbuf + rxoff. Pending
+ * bytes are slid to the buffer head only when the tail room cannot hold
+ * "size" bytes. Reads otherwise fill the whole tail, except for packets of
+ * a quarter of the buffer or more: those stop at the next header, since
+ * the head of the following packet would only have to be slid down by the
+ * next fill.
+ */
+static int fill_rxbuf(qtty_conn_t *qc, int size) {
+	int curr, rxcnt, rxmax;
+	double t0;
+
+	if (flush_pkts(qc) < 0)
+		return -1;
+	if (qc->rxoff + size > (int) sizeof(qc->rxbuf)) {
+		memmove(qc->rxbuf, qc->rxbuf + qc->rxoff, qc->rxcnt);
+		qc->rxoff = 0;
+	}
+	rxmax = (int) sizeof(qc->rxbuf) - qc->rxoff;
+	if (size >= (int) sizeof(qc->rxbuf) / 4 && size + QTTY_PKT_HDRSIZE < rxmax)
+		rxmax = size + QTTY_PKT_HDRSIZE;
+	t0 = sys_now();
+	rxcnt = qc->rxcnt;
+	while (qc->rxcnt < size && !SYS_LOAD_ACQ(&qc->abort)) {
+		curr = bt_sock_read(qc->fd, qc->rxbuf + qc->rxoff + qc->rxcnt,
+				    rxmax - qc->rxcnt);
 		if (curr <= 0)
 			break;
-		count += curr;
+		qc->rxcnt += curr;
 	}
+	qc->st.sock_secs += sys_now() - t0;
+	TRACE_EVENT("sock_read", t0, qc->rxcnt - rxcnt, NULL);
 
-	return size;
+	return qc->rxcnt < size ? -1: 0;
 }
 
-int recv_pkt(bt_sock_t fd, char **data, int *size) {
+/*
+ * Returns a view of the next packet payload, pointing inside the connection
+ * receive buffer. The view is valid only until the next packet is fetched
+ * from the same connection, and it is not zero terminated.
+ */
+int next_pkt(qtty_conn_t *qc, char const **data, int *size) {
 	unsigned int wsize;
-	char buf[8];
+	double tt = TRACE_T0();
 
-	if (really_read(fd, buf, 3) != 3)
+	if (qc->rxcnt < QTTY_PKT_HDRSIZE &&
+	    fill_rxbuf(qc, QTTY_PKT_HDRSIZE) < 0)
 		return -1;
-	GET_LE16(wsize, buf + 1);
-	if ((*data = (char *) malloc(wsize + 1)) == NULL)
+	GET_LE16(wsize, qc->rxbuf + qc->rxoff + 1);
+	if (qc->rxcnt < QTTY_PKT_HDRSIZE + (int) wsize &&
+	    fill_rxbuf(qc, QTTY_PKT_HDRSIZE + (int) wsize) < 0)
 		return -1;
-	if (wsize && really_read(fd, *data, wsize) != (int) wsize) {
-		free(*data);
+	*data = qc->rxbuf + qc->rxoff + QTTY_PKT_HDRSIZE;
+	*size = (int) wsize;
+	qc->rxoff += QTTY_PKT_HDRSIZE + (int) wsize;
+	if ((qc->rxcnt -= QTTY_PKT_HDRSIZE + (int) wsize) == 0)
+		qc->rxoff = 0;
+	qc->st.rx_pkts++;
+	qc->st.rx_bytes += QTTY_PKT_HDRSIZE + wsize;
+	if (qc->st.cmd_t0 != 0)
+		stats_reply(&qc->st);
+	TRACE_EVENT("recv_pkt", tt, wsize, NULL);
+
+	return 0;
+}
+
+/*
+ * Event driven receive: qconn_read_avail() does a single read of whatever
+ * the socket has ready (the caller knows it is readable), and returns the
+ * number of bytes read, or zero/negative on hangup or error. Complete
+ * packets can then be taken with next_pkt() without blocking, as long as
+ * qconn_pkt_ready() says so.
+ */
+int qconn_read_avail(qtty_conn_t *qc) {
+	int curr;
+
+	if (flush_pkts(qc) < 0)
 		return -1;
+	if (qc->rxcnt == 0)
+		qc->rxoff = 0;
+	else if (qc->rxoff + QTTY_PKT_HDRSIZE + QTTY_PKT_MAXSIZE > (int) sizeof(qc->rxbuf)) {
+		memmove(qc->rxbuf, qc->rxbuf + qc->rxoff, qc->rxcnt);
+		qc->rxoff = 0;
 	}
+	curr = bt_sock_read(qc->fd, qc->rxbuf + qc->rxoff + qc->rxcnt,
+			    (int) sizeof(qc->rxbuf) - qc->rxoff - qc->rxcnt);
+	if (curr > 0)
+		qc->rxcnt += curr;
+
+	return curr;
+}
+
+int qconn_pkt_ready(qtty_conn_t *qc) {
+	unsigned int wsize;
+
+	if (qc->rxcnt < QTTY_PKT_HDRSIZE)
+		return 0;
+	GET_LE16(wsize, qc->rxbuf + qc->rxoff + 1);
+
+	return qc->rxcnt >= QTTY_PKT_HDRSIZE + (int) wsize;
+}
+
+int recv_pkt(qtty_conn_t *qc, char **data, int *size) {
+	int wsize;
+	char const *pdata;
+
+	if (next_pkt(qc, &pdata, &wsize) < 0)
+		return -1;
+	if ((*data = (char *) malloc(wsize + 1)) == NULL)
+		return -1;
+	qc->st.allocs++;
+	memcpy(*data, pdata, wsize);
 	(*data)[wsize] = 0;
-	*size = (int) wsize;
+	*size = wsize;
 
 	return 0;
 }
 
-int handle_bounce_cmd(bt_sock_t qfd, char *line, FILE *fout) {
+int handle_bounce_cmd(qtty_conn_t *qc, char *line, FILE *fout) {
 	int size;
-	char *data;
+	long tsize;
+	char const *data;
 
-	if (send_pkt(qfd, line, strlen(line)) < 0)
+	if (send_cmd(qc, line) < 0)
 		return -1;
-	for (;;) {
-		if (recv_pkt(qfd, &data, &size) < 0)
+	for (tsize = 0;; tsize += size) {
+		if (next_pkt(qc, &data, &size) < 0)
 			return -1;
-		if (!size) {
-			free(data);
+		if (!size)
 			break;
-		}
 		fwrite(data, 1, size, fout);
-		free(data);
 	}
+	TRACE_EVENT("bounce", qc->st.cur.t0, tsize, line);
 
 	return 0;
 }
 
-int get_cmd(bt_sock_t qfd, char const *cmd,
-	    int (*dproc)(void *, void const *, int), void *priv, FILE *flerr) {
+/*
+ * Sends a get command and reads the reply header, up to the payload size.
+ * Returns 1 when the server refuses the command, in which case its message
+ * is copied to "flerr" (if not NULL).
+ */
+int get_cmd_open(qtty_conn_t *qc, char const *cmd, unsigned int *fsize,
+		 FILE *flerr) {
 	int size;
-	unsigned int fsize, tsize;
-	char *data;
+	char const *data;
 
-	if (send_pkt(qfd, cmd, strlen(cmd)) < 0 ||
-	    recv_pkt(qfd, &data, &size) < 0)
+	if (send_cmd(qc, cmd) < 0 ||
+	    next_pkt(qc, &data, &size) < 0)
 		return -1;
 	if (size) {
-		fwrite(data, 1, size, flerr);
-		free(data);
-		if (recv_pkt(qfd, &data, &size) < 0)
+		if (flerr != NULL)
+			fwrite(data, 1, size, flerr);
+		if (next_pkt(qc, &data, &size) < 0)
 			return -1;
-		free(data);
 		return 1;
 	}
-	free(data);
-	if (recv_pkt(qfd, &data, &size) < 0)
+	if (next_pkt(qc, &data, &size) < 0)
 		return -1;
-	if (size != 4) {
-		free(data);
+	if (size != 4)
 		return -1;
-	}
-	GET_LE32(fsize, data);
-	free(data);
-	for (tsize = 0;;) {
-		if (recv_pkt(qfd, &data, &size) < 0)
+	GET_LE32(*fsize, data);
+
+	return 0;
+}
+
+/*
+ * Sink backed, uncompressed payloads take the io_uring engine when the
+ * connection has one, ahead of the get queue.
+ */
+static int get_cmd_recv(qtty_conn_t *qc, int (*dproc)(void *, void const *, int),
+			void *priv, file_sink_t *fs, unsigned int *tsize) {
+	int size, res;
+	double t0;
+	char const *data;
+
+	if (fs != NULL && qc->ring != NULL && qc->zip == NULL)
+		return uring_get_data(qc, fs, tsize);
+	if (qc->getq > 0)
+		return pipe_get_data(qc, qc->getq, dproc, priv, tsize);
+	for (*tsize = 0;;) {
+		if (next_pkt(qc, &data, &size) < 0)
 			return -1;
-		if (!size) {
-			free(data);
+		if (!size)
 			break;
+		if (qc->zip != NULL) {
+			if ((size = zip_decode(qc->zip, data, size, qc->zbuf,
+					       sizeof(qc->zbuf))) < 0)
+				return -1;
+			data = qc->zbuf;
 		}
-		if ((*dproc)(priv, data, size) != size) {
-			free(data);
+		t0 = sys_now();
+		res = (*dproc)(priv, data, size);
+		qc->st.disk_secs += sys_now() - t0;
+		TRACE_EVENT("dproc", t0, size, NULL);
+		if (res != size)
 			return -1;
-		}
-		free(data);
-		tsize += size;
+		sha1_update(&qc->xsctx, (unsigned char const *) data, size);
+		*tsize += size;
 	}
-	if (tsize != fsize) {
+
+	return 0;
+}
+
+/*
+ * Receives the payload announced by get_cmd_open(), hashing it on the way
+ * through. The digest trailer of checksummed sessions follows the data
+ * terminator, and is consumed before the size is checked.
+ */
+static int get_cmd_run(qtty_conn_t *qc, char const *cmd, unsigned int fsize,
+		       int (*dproc)(void *, void const *, int), void *priv,
+		       file_sink_t *fs, FILE *flerr) {
+	int res;
+	unsigned int tsize = 0;
+
+	sha1_init(&qc->xsctx);
+	res = get_cmd_recv(qc, dproc, priv, fs, &tsize);
+	sha1_final(qc->xdigest, &qc->xsctx);
+	if (res == 0 && qc->xsum)
+		res = sum_check(qc, flerr);
+	if (res == 0 && tsize != fsize) {
 		fprintf(flerr, "Remote read error (data size mismatch: %u/%u)\n",
 			tsize, fsize);
-		return 1;
+		res = 1;
 	}
+	xfer_log(qc, cmd, tsize, res);
+	if (res > 1)
+		res = 1;
+	stats_xfer(&qc->st, QTTY_STATS_GET, tsize, res);
+	TRACE_EVENT("get", qc->st.cur.t0, tsize, NULL);
 
-	return 0;
+	return res;
 }
 
-int put_cmd(bt_sock_t qfd, char const *cmd, unsigned int fsize,
-	    int (*rproc)(void *, void *, int), void *priv, FILE *flerr) {
-	int size;
+int get_cmd_data(qtty_conn_t *qc, char const *cmd, unsigned int fsize,
+		 int (*dproc)(void *, void const *, int), void *priv, FILE *flerr) {
+
+	return get_cmd_run(qc, cmd, fsize, dproc, priv, NULL, flerr);
+}
+
+/*
+ * Like get_cmd_data(), with the payload going to an open sink, which lets
+ * the connection use its io_uring engine.
+ */
+int get_cmd_sink(qtty_conn_t *qc, char const *cmd, unsigned int fsize,
+		 file_sink_t *fs, FILE *flerr) {
+
+	return get_cmd_run(qc, cmd, fsize, dump_to_sink, fs, fs, flerr);
+}
+
+int get_cmd(qtty_conn_t *qc, char const *cmd,
+	    int (*dproc)(void *, void const *, int), void *priv, FILE *flerr) {
+	int res;
+	unsigned int fsize;
+
+	if ((res = get_cmd_open(qc, cmd, &fsize, flerr)) != 0)
+		return res;
+
+	return get_cmd_data(qc, cmd, fsize, dproc, priv, flerr);
+}
+
+/*
+ * Buffered payload, read through "rproc" and optionally compressed.
+ */
+static int put_copy_data(qtty_conn_t *qc, unsigned int chunk, unsigned int fsize,
+			 int (*rproc)(void *, void *, int), void *priv) {
+	int size, res;
 	unsigned int tsize, curr;
-	char *data;
-	char buf[1024 * 8];
+	double t0;
+	xfer_adapt_t xa;
+	char buf[QTTY_PKT_MAXSIZE];
 
-	if (send_pkt(qfd, cmd, strlen(cmd)) < 0)
-		return -1;
-	if (recv_pkt(qfd, &data, &size) < 0)
-		return -1;
-	if (size) {
-		fwrite(data, 1, size, flerr);
-		free(data);
-		if (recv_pkt(qfd, &data, &size) < 0)
-			return -1;
-		free(data);
-		return 1;
+	if (qc->putchunk == 0) {
+		adapt_init(&xa, qc, (int) chunk);
+		chunk = (unsigned int) xa.chunk;
 	}
-	free(data);
-	PUT_LE32(fsize, buf);
-	if (send_pkt(qfd, buf, 4) < 0)
-		return -1;
 	for (tsize = 0; tsize < fsize;) {
-		curr = sizeof(buf);
+		curr = chunk;
 		if (curr + tsize > fsize)
 			curr = fsize - tsize;
-		if ((*rproc)(priv, buf, (int) curr) != (int) curr)
+		t0 = sys_now();
+		res = (*rproc)(priv, buf, (int) curr);
+		qc->st.disk_secs += sys_now() - t0;
+		TRACE_EVENT("rproc", t0, curr, NULL);
+		if (res != (int) curr)
 			return -1;
-		if (send_pkt(qfd, buf, (int) curr) < 0)
+		sha1_update(&qc->xsctx, (unsigned char const *) buf, curr);
+		if (qc->zip != NULL)
+			size = zip_encode(qc->zip, buf, (int) curr, qc->zbuf);
+		if (send_pkt(qc, qc->zip != NULL ? qc->zbuf: buf,
+			     qc->zip != NULL ? size: (int) curr) < 0)
 			return -1;
+		if (qc->putchunk == 0)
+			chunk = (unsigned int) adapt_sent(&xa, qc, (int) curr);
 		tsize += curr;
 	}
-	if (send_pkt(qfd, "", 0) < 0 ||
-	    recv_pkt(qfd, &data, &size) < 0)
+
+	return 0;
+}
+
+/*
+ * Zero-copy payload: the file is hashed through read-only mappings of
+ * QTTY_PUT_MAPSIZE bytes, and each packet goes out with send_pkt_file().
+ * Returns 1, before anything is sent, when the file cannot be mapped.
+ */
+static int put_file_data(qtty_conn_t *qc, unsigned int chunk, unsigned int fsize,
+			 int fd) {
+	unsigned int tsize, curr, hoff, hsize, mbase, msize;
+	double t0;
+	unsigned char const *map;
+	xfer_adapt_t xa;
+
+	msize = fsize < QTTY_PUT_MAPSIZE ? fsize: QTTY_PUT_MAPSIZE;
+	if ((map = (unsigned char const *) sys_map_file(fd, 0, msize, 0)) == NULL)
+		return 1;
+	if (qc->putchunk == 0) {
+		adapt_init(&xa, qc, (int) chunk);
+		chunk = (unsigned int) xa.chunk;
+	}
+	for (tsize = mbase = 0; tsize < fsize; tsize += curr) {
+		curr = chunk;
+		if (curr + tsize > fsize)
+			curr = fsize - tsize;
+		t0 = sys_now();
+		for (hoff = tsize; hoff < tsize + curr; hoff += hsize) {
+			if (hoff == mbase + msize) {
+				sys_unmap_file((void *) map, msize);
+				mbase = hoff;
+				msize = fsize - mbase < QTTY_PUT_MAPSIZE ? fsize - mbase:
+					QTTY_PUT_MAPSIZE;
+				if ((map = (unsigned char const *)
+				     sys_map_file(fd, mbase, msize, 0)) == NULL)
+					return -1;
+			}
+			hsize = tsize + curr < mbase + msize ? tsize + curr - hoff:
+				mbase + msize - hoff;
+			sha1_update(&qc->xsctx, map + (hoff - mbase), hsize);
+		}
+		qc->st.disk_secs += sys_now() - t0;
+		TRACE_EVENT("rproc", t0, curr, NULL);
+		if (send_pkt_file(qc, fd, tsize, (int) curr) < 0) {
+			sys_unmap_file((void *) map, msize);
+			return -1;
+		}
+		if (qc->putchunk == 0)
+			chunk = (unsigned int) adapt_sent(&xa, qc, (int) curr);
+	}
+	sys_unmap_file((void *) map, msize);
+
+	return 0;
+}
+
+/*
+ * Streams the put payload, after the server accepted the command, and
+ * reads back the final reply. Connections without a fixed put chunk size
+ * leave it to the adapt_sent() controller. Uncompressed payloads with a
+ * file descriptor behind them go to the io_uring engine of the connection
+ * if it has one, or else, without a put queue, take the zero-copy path.
+ */
+static int put_cmd_send(qtty_conn_t *qc, unsigned int fsize,
+			int (*rproc)(void *, void *, int), void *priv, int fd,
+			FILE *flerr) {
+	int size, res;
+	unsigned int chunk;
+	char const *data;
+	char buf[4];
+
+	pkt_batch_begin(qc);
+	PUT_LE32(fsize, buf);
+	if (send_pkt(qc, buf, 4) < 0) {
+		pkt_batch_end(qc);
+		return -1;
+	}
+	chunk = (unsigned int) qc->putchunk;
+	if (chunk == 0 || chunk > QTTY_PKT_MAXSIZE)
+		chunk = QTTY_PKT_MAXSIZE;
+	if (qc->zip != NULL && chunk > QTTY_ZIP_MAXRAW)
+		chunk = QTTY_ZIP_MAXRAW;
+	if (fd >= 0 && fsize > 0 && qc->zip == NULL && qc->ring != NULL)
+		res = uring_put_data(qc, fd, (int) chunk, fsize);
+	else if (qc->putq > 0)
+		res = pipe_put_data(qc, qc->putq, (int) chunk, fsize, rproc, priv);
+	else if (fd < 0 || fsize == 0 || qc->zip != NULL ||
+		 (res = put_file_data(qc, chunk, fsize, fd)) > 0)
+		res = put_copy_data(qc, chunk, fsize, rproc, priv);
+	if (res < 0 || send_pkt(qc, "", 0) < 0) {
+		pkt_batch_end(qc);
+		return -1;
+	}
+	if (pkt_batch_end(qc) < 0 ||
+	    next_pkt(qc, &data, &size) < 0)
 		return -1;
 	if (size) {
 		fwrite(data, 1, size, flerr);
-		free(data);
-		if (recv_pkt(qfd, &data, &size) < 0)
+		if (next_pkt(qc, &data, &size) < 0)
 			return -1;
-		free(data);
 		return 1;
 	}
-	free(data);
 
 	return 0;
 }
 
+static int put_cmd_run(qtty_conn_t *qc, char const *cmd, unsigned int fsize,
+		       int (*rproc)(void *, void *, int), void *priv, int fd,
+		       FILE *flerr) {
+	int size, res;
+	char const *data;
+
+	if (send_cmd(qc, cmd) < 0)
+		return -1;
+	if (next_pkt(qc, &data, &size) < 0)
+		return -1;
+	if (size) {
+		fwrite(data, 1, size, flerr);
+		if (next_pkt(qc, &data, &size) < 0)
+			return -1;
+		return 1;
+	}
+	sha1_init(&qc->xsctx);
+	res = put_cmd_send(qc, fsize, rproc, priv, fd, flerr);
+	sha1_final(qc->xdigest, &qc->xsctx);
+	if (res == 0 && qc->xsum)
+		res = sum_check(qc, flerr);
+	xfer_log(qc, cmd, fsize, res);
+	if (res > 1)
+		res = 1;
+	stats_xfer(&qc->st, QTTY_STATS_PUT, res ? 0: fsize, res);
+	TRACE_EVENT("put", qc->st.cur.t0, fsize, NULL);
+
+	return res;
+}
+
+int put_cmd(qtty_conn_t *qc, char const *cmd, unsigned int fsize,
+	    int (*rproc)(void *, void *, int), void *priv, FILE *flerr) {
+
+	return put_cmd_run(qc, cmd, fsize, rproc, priv, -1, flerr);
+}
+
+/*
+ * Puts "fsize" bytes of "file", from its start, through the zero-copy path
+ * when the connection allows it.
+ */
+int put_cmd_file(qtty_conn_t *qc, char const *cmd, unsigned int fsize, FILE *file,
+		 FILE *flerr) {
+
+	return put_cmd_run(qc, cmd, fsize, read_from_file, (void *) file,
+			   FILENO(file), flerr);
+}
+
+/*
+ * Reads and drops the payload of a get opened with get_cmd_open(), and its
+ * digest, for transfers given up before they start. Unlike get_cmd_data()
+ * with discard_data(), nothing is logged or counted.
+ */
+static int get_cmd_drain(qtty_conn_t *qc) {
+	int size;
+	unsigned int tsize;
+	char const *data;
+
+	sha1_init(&qc->xsctx);
+	if (get_cmd_recv(qc, discard_data, NULL, NULL, &tsize) < 0 ||
+	    (qc->xsum && (next_pkt(qc, &data, &size) < 0 || size != SHA1_DIGEST_SIZE)))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Reads the digest trailer of a checksummed transfer. Returns 2 when it
+ * does not match the local one.
+ */
+static int sum_check(qtty_conn_t *qc, FILE *flerr) {
+	int size;
+	char const *data;
+
+	if (next_pkt(qc, &data, &size) < 0 || size != SHA1_DIGEST_SIZE)
+		return -1;
+	if (memcmp(data, qc->xdigest, SHA1_DIGEST_SIZE) != 0) {
+		fprintf(flerr, "Checksum mismatch\n");
+		return 2;
+	}
+
+	return 0;
+}
+
+/*
+ * Appends one line per transfer to the local log: time, outcome, size,
+ * SHA-1 of the bytes moved, and the command. Outcomes are "ok" (server
+ * digest matched), "unverified" (server without checksums), "mismatch",
+ * "failed" and "error" (connection lost).
+ */
+static void xfer_log(qtty_conn_t *qc, char const *cmd, unsigned int size, int res) {
+	int i;
+	FILE *file;
+	char line[1024];
+	char hex[2 * SHA1_DIGEST_SIZE + 1];
+
+	if (qc->cfg == NULL || qc->cfg->xlog == NULL ||
+	    (file = fopen(qc->cfg->xlog, "a")) == NULL)
+		return;
+	for (i = 0; i < SHA1_DIGEST_SIZE; i++)
+		sprintf(hex + 2 * i, "%02x", (unsigned int) qc->xdigest[i]);
+	SNPRINTF(line, sizeof(line), "%lu %s %u %s %s\n", (unsigned long) time(NULL),
+		 res == 0 ? (qc->xsum ? "ok": "unverified"): res == 2 ? "mismatch":
+		 res > 0 ? "failed": "error", size, hex, cmd);
+	line[sizeof(line) - 1] = 0;
+	fputs(line, file);
+	fclose(file);
+}
+
 int dump_to_file(void *priv, void const *data, int size) {
 
 	return fwrite(data, 1, size, (FILE *) priv);
 }
 
+/*
+ * The file is preallocated to "total" bytes, and written from "off". The
+ * mapped flavour needs real disk reservation, since a write fault on a
+ * full file system kills the process, and falls back to pwrite() without.
+ */
+void sink_open(file_sink_t *fs, FILE *file, unsigned long off, unsigned long total,
+	       int flags) {
+
+	fs->fd = FILENO(file);
+	fs->flags = flags;
+	fs->off = fs->wbase = fs->dbase = off;
+	fs->total = total;
+	fs->map = NULL;
+	fs->mbase = fs->msize = 0;
+	if (sys_file_alloc(fs->fd, total) != 0)
+		fs->flags &= ~QTTY_SINK_MMAP;
+}
+
+static int sink_map(file_sink_t *fs) {
+
+	if (fs->map != NULL)
+		sys_unmap_file(fs->map, fs->msize);
+	fs->mbase = fs->off - fs->off % QTTY_SINK_MAPSIZE;
+	fs->msize = fs->total - fs->mbase < QTTY_SINK_MAPSIZE ? fs->total - fs->mbase:
+		QTTY_SINK_MAPSIZE;
+	if ((fs->map = (unsigned char *) sys_map_file(fs->fd, fs->mbase, fs->msize,
+						      1)) == NULL) {
+		fs->flags &= ~QTTY_SINK_MMAP;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Accounts "size" bytes written at the sink offset, by the sink itself or
+ * by the io_uring engine, and runs the QTTY_SINK_NOCACHE steps.
+ */
+void sink_advance(file_sink_t *fs, unsigned long size) {
+
+	fs->off += size;
+	if ((fs->flags & QTTY_SINK_NOCACHE) && fs->off - fs->wbase >= QTTY_SINK_STEP) {
+		sys_file_writeback(fs->fd, fs->wbase, fs->off - fs->wbase, 0);
+		sys_file_writeback(fs->fd, fs->dbase, fs->wbase - fs->dbase, 1);
+		fs->dbase = fs->wbase;
+		fs->wbase = fs->off;
+	}
+}
+
+/*
+ * Data beyond the announced size, or past a failed mapping, goes through
+ * pwrite(), so that a lying server is caught by the size check of
+ * get_cmd_data() rather than here.
+ */
+int dump_to_sink(void *priv, void const *data, int size) {
+	file_sink_t *fs = (file_sink_t *) priv;
+	int count, curr;
+
+	for (count = 0; count < size; count += curr) {
+		curr = size - count;
+		if ((fs->flags & QTTY_SINK_MMAP) && fs->off < fs->total &&
+		    ((fs->map != NULL && fs->off < fs->mbase + fs->msize) ||
+		     sink_map(fs) == 0)) {
+			if ((unsigned long) curr > fs->mbase + fs->msize - fs->off)
+				curr = (int) (fs->mbase + fs->msize - fs->off);
+			memcpy(fs->map + (fs->off - fs->mbase), (char const *) data + count,
+			       curr);
+		} else if (sys_pwrite(fs->fd, (char const *) data + count, curr,
+				      fs->off) != curr)
+			return -1;
+		sink_advance(fs, curr);
+	}
+
+	return size;
+}
+
+void sink_close(file_sink_t *fs) {
+
+	if (fs->map != NULL) {
+		sys_unmap_file(fs->map, fs->msize);
+		fs->map = NULL;
+	}
+	if (fs->flags & QTTY_SINK_NOCACHE)
+		sys_file_writeback(fs->fd, fs->dbase, fs->off - fs->dbase, 1);
+}
+
 int read_from_file(void *priv, void *data, int size) {
 
 	return fread(data, 1, size, (FILE *) priv);
 }
 
-int handle_getchunk(bt_sock_t qfd, char *line, FILE *flerr) {
+static int discard_data(void *priv, void const *data, int size) {
+
+	return size;
+}
+
+static int journal_read(char const *jpath, char const *remote,
+			unsigned long *total, unsigned long *done) {
+	int len;
+	FILE *file;
+	char buf[1024];
+
+	if ((file = fopen(jpath, "rt")) == NULL)
+		return -1;
+	if (fgets(buf, sizeof(buf), file) == NULL ||
+	    strcmp(buf, QTTY_JOURNAL_MAGIC "\n") != 0 ||
+	    fgets(buf, sizeof(buf), file) == NULL ||
+	    sscanf(buf, "%lu %lu", total, done) != 2 ||
+	    fgets(buf, sizeof(buf), file) == NULL) {
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+	if ((len = strlen(buf)) > 0 && buf[len - 1] == '\n')
+		buf[len - 1] = 0;
+
+	return strcmp(buf, remote) == 0 && *done <= *total ? 0: -1;
+}
+
+static int journal_write(char const *jpath, char const *remote,
+			 unsigned long total, unsigned long done) {
+	FILE *file;
+
+	if ((file = fopen(jpath, "wt")) == NULL)
+		return -1;
+	fprintf(file, "%s\n%lu %lu\n%s\n", QTTY_JOURNAL_MAGIC, total, done, remote);
+
+	return fclose(file) ? -1: 0;
+}
+
+/*
+ * Data sink of resumable gets. The journal is only ever advanced after the
+ * data it covers has been handed to the OS, so its "done" offset is always
+ * a safe restart point.
+ */
+static int dump_to_journal(void *priv, void const *data, int size) {
+	get_journal_t *gj = (get_journal_t *) priv;
+
+	if (dump_to_sink(&gj->fs, data, size) != size)
+		return -1;
+	gj->done += size;
+	if (gj->done - gj->synced >= QTTY_JOURNAL_STEP &&
+	    journal_write(gj->jpath, gj->remote, gj->total, gj->done) == 0)
+		gj->synced = gj->done;
+
+	return size;
+}
+
+/*
+ * Resumable flavour of local_get(). The partial file is kept, together with
+ * a sidecar journal, when the connection breaks, and the next run only asks
+ * for the missing tail through the "$off.OFFSET." get path prefix. Servers
+ * that do not know the prefix refuse the command, and the file is fetched
+ * again from scratch.
+ */
+static int local_get_resume(qtty_conn_t *qc, char const *remote, char const *local,
+			    FILE *flerr) {
+	int res;
+	unsigned int fsize;
+	unsigned long total;
+	get_journal_t gj;
+	char jpath[1024], cmd[512];
+
+	SNPRINTF(jpath, sizeof(jpath), "%s%s", local, QTTY_JOURNAL_EXT);
+	jpath[sizeof(jpath) - 1] = 0;
+	gj.file = NULL;
+	gj.jpath = jpath;
+	gj.remote = remote;
+	gj.done = 0;
+	if (journal_read(jpath, remote, &total, &gj.done) == 0 && gj.done > 0 &&
+	    (gj.file = fopen(local, "r+b")) != NULL) {
+		SNPRINTF(cmd, sizeof(cmd), "get $off.%lu.%s", gj.done, remote);
+		cmd[sizeof(cmd) - 1] = 0;
+
+		if ((res = get_cmd_open(qc, cmd, &fsize, NULL)) < 0) {
+			fclose(gj.file);
+			return res;
+		}
+		if (res == 0 && gj.done + fsize != total) {
+			fprintf(flerr, "Remote file changed, restarting\n");
+			if (get_cmd_drain(qc) < 0) {
+				fclose(gj.file);
+				return -1;
+			}
+			res = 1;
+		}
+		if (res) {
+			fclose(gj.file);
+			gj.file = NULL;
+		} else
+			fprintf(flerr, "Resuming at %lu/%lu\n", gj.done, total);
+	}
+	if (gj.file == NULL) {
+		if ((gj.file = fopen(local, "wb")) == NULL) {
+			perror(local);
+			return 1;
+		}
+		gj.done = 0;
+
+		SNPRINTF(cmd, sizeof(cmd), "get %s", remote);
+		cmd[sizeof(cmd) - 1] = 0;
+
+		if ((res = get_cmd_open(qc, cmd, &fsize, flerr)) != 0) {
+			fclose(gj.file);
+			remove(local);
+			remove(jpath);
+			return res;
+		}
+		total = fsize;
+	}
+	gj.total = total;
+	gj.synced = gj.done;
+	journal_write(jpath, remote, gj.total, gj.done);
+	sink_open(&gj.fs, gj.file, gj.done, gj.total, qc->getsink);
+
+	res = get_cmd_data(qc, cmd, fsize, dump_to_journal, &gj, flerr);
+	sink_close(&gj.fs);
+
+	if (fclose(gj.file) == 0 && res < 0)
+		journal_write(jpath, remote, gj.total, gj.done);
+	else if (res > 0)
+		remove(local);
+	if (res >= 0)
+		remove(jpath);
+
+	return res;
+}
+
+int handle_getchunk(qtty_conn_t *qc, char *line, FILE *flerr) {
 	int res;
 	FILE *file;
 	char *dline, *remote, *local;
@@ -246,7 +1196,7 @@ int handle_getchunk(bt_sock_t qfd, char *line, FILE *flerr) {
 	SNPRINTF(cmd, sizeof(cmd), "get $chk.%s", remote);
 	cmd[sizeof(cmd) - 1] = 0;
 
-	res = get_cmd(qfd, cmd, dump_to_file, (void *) file, flerr);
+	res = get_cmd(qc, cmd, dump_to_file, (void *) file, flerr);
 
 	fclose(file);
 	if (res)
@@ -291,11 +1241,16 @@ int prepare_path(char const *path) {
 	return res ? -1: 0;
 }
 
-int local_get(bt_sock_t qfd, char const *remote, char const *local, FILE *flerr) {
+int local_get(qtty_conn_t *qc, char const *remote, char const *local, int gflags,
+	      FILE *flerr) {
 	int res;
+	unsigned int fsize;
 	FILE *file;
+	file_sink_t fs;
 	char cmd[512];
 
+	if (gflags & QTTY_GETF_RESUME)
+		return local_get_resume(qc, remote, local, flerr);
 	if ((file = fopen(local, "wb")) == NULL) {
 		perror(local);
 		return 1;
@@ -304,7 +1259,11 @@ int local_get(bt_sock_t qfd, char const *remote, char const *local, FILE *flerr)
 	SNPRINTF(cmd, sizeof(cmd), "get %s", remote);
 	cmd[sizeof(cmd) - 1] = 0;
 
-	res = get_cmd(qfd, cmd, dump_to_file, (void *) file, flerr);
+	if ((res = get_cmd_open(qc, cmd, &fsize, flerr)) == 0) {
+		sink_open(&fs, file, 0, fsize, qc->getsink);
+		res = get_cmd_sink(qc, cmd, fsize, &fs, flerr);
+		sink_close(&fs);
+	}
 
 	fclose(file);
 	if (res)
@@ -313,8 +1272,8 @@ int local_get(bt_sock_t qfd, char const *remote, char const *local, FILE *flerr)
 	return res;
 }
 
-int handle_mget(bt_sock_t qfd, char *line, FILE *flerr) {
-	int res, recurse = 0, len;
+int handle_mget(qtty_conn_t *qc, char *line, FILE *flerr) {
+	int res, recurse = 0, len, nsess = 1, gflags = 0;
 	char *dline, *remote, *local, *flags, *fslh;
 	char const *match = NULL;
 
@@ -343,7 +1302,25 @@ int handle_mget(bt_sock_t qfd, char *line, FILE *flerr) {
 				recurse++;
 				match = "*";
 				break;
+			case 'c':
+				gflags |= QTTY_GETF_RESUME;
+				break;
+			case 'P':
+				if (flags[1] >= '0' && flags[1] <= '9') {
+					nsess = (int) strtol(flags + 1, &flags, 10);
+					flags--;
+				} else if (local != NULL) {
+					nsess = atoi(remote);
+					remote = local;
+					local = strtok(NULL, " \t");
+				}
+				break;
 			}
+		if (!local || nsess < 1) {
+			free(dline);
+			fprintf(flerr, "Invalid command: %s\n", line);
+			return 1;
+		}
 	}
 	if ((fslh = strrchr(remote, '\\')) != NULL &&
 	    iswild(fslh + 1)) {
@@ -356,17 +1333,17 @@ int handle_mget(bt_sock_t qfd, char *line, FILE *flerr) {
 		remote[len] = 0;
 
 	if (match)
-		res = do_mget(qfd, remote, match, recurse, local, flerr);
+		res = do_mget(qc, remote, match, recurse, local, nsess, gflags, flerr);
 	else
-		res = local_get(qfd, remote, local, flerr);
+		res = local_get(qc, remote, local, gflags, flerr);
 
 	free(dline);
 
 	return res;
 }
 
-int handle_mput(bt_sock_t qfd, char *line, FILE *flerr) {
-	int res, recurse = 0, len;
+int handle_mput(qtty_conn_t *qc, char *line, FILE *flerr) {
+	int res, recurse = 0, len, pflags = 0;
 	char *dline, *remote, *local, *flags, *fslh;
 	char const *match = NULL, *pcmd;
 
@@ -398,6 +1375,9 @@ int handle_mput(bt_sock_t qfd, char *line, FILE *flerr) {
 			case 'f':
 				pcmd = "putf";
 				break;
+			case 'd':
+				pflags |= QTTY_PUTF_DELTA;
+				break;
 			}
 	}
 	if ((fslh = strrchr(local, SYS_SLASHC)) != NULL &&
@@ -411,17 +1391,37 @@ int handle_mput(bt_sock_t qfd, char *line, FILE *flerr) {
 		remote[len] = 0;
 
 	if (match)
-		res = do_mput(qfd, remote, match, recurse, local, flerr);
-	else
-		res = local_put(qfd, pcmd, remote, local, flerr);
+		res = do_mput(qc, remote, match, recurse, local, pflags, flerr);
+	else if (pflags & QTTY_PUTF_DELTA) {
+		mfst_t mf;
+		char mpath[1024];
+
+		/*
+		 * The manifest is keyed by remote path, spelled as do_mput()
+		 * spells it.
+		 */
+		normalize_path(remote, '\\');
+		if (mfst_load(&mf, mfst_path(qc->cfg, mpath, sizeof(mpath))) < 0) {
+			free(dline);
+			fprintf(flerr, "Unable to load manifest: %s\n", mpath);
+			return 1;
+		}
+		if ((res = delta_put(qc, &mf, pcmd, remote, local, NULL, flerr)) == 2) {
+			fprintf(flerr, "Unchanged\n");
+			res = 0;
+		}
+		mfst_save(&mf);
+		mfst_free(&mf);
+	} else
+		res = local_put(qc, pcmd, remote, local, NULL, flerr);
 
 	free(dline);
 
 	return res;
 }
 
-int local_put(bt_sock_t qfd, char const *pcmd, char const *remote, char const *local,
-	      FILE *flerr) {
+int local_put(qtty_conn_t *qc, char const *pcmd, char const *remote, char const *local,
+	      unsigned char *digest, FILE *flerr) {
 	int res;
 	long fsize;
 	FILE *file;
@@ -438,14 +1438,16 @@ int local_put(bt_sock_t qfd, char const *pcmd, char const *remote, char const *l
 	SNPRINTF(cmd, sizeof(cmd), "%s %s", pcmd, remote);
 	cmd[sizeof(cmd) - 1] = 0;
 
-	res = put_cmd(qfd, cmd, fsize, read_from_file, (void *) file, flerr);
+	if ((res = put_cmd_file(qc, cmd, fsize, file, flerr)) == 0 &&
+	    digest != NULL)
+		memcpy(digest, qc->xdigest, SHA1_DIGEST_SIZE);
 
 	fclose(file);
 
 	return res;
 }
 
-int handle_cat(bt_sock_t qfd, char *line, FILE *flerr) {
+int handle_cat(qtty_conn_t *qc, char *line, FILE *flerr) {
 	int res;
 	char *dline, *remote;
 	char cmd[512];
@@ -464,35 +1466,154 @@ int handle_cat(bt_sock_t qfd, char *line, FILE *flerr) {
 	SNPRINTF(cmd, sizeof(cmd), "get %s", remote);
 	cmd[sizeof(cmd) - 1] = 0;
 
-	res = get_cmd(qfd, cmd, dump_to_file, (void *) stdout, flerr);
+	res = get_cmd(qc, cmd, dump_to_file, (void *) stdout, flerr);
 
 	free(dline);
 
 	return res;
 }
 
-int handle_command(bt_sock_t qfd, char *line, FILE *flcons) {
+/*
+ * The commands ending the session on request.
+ */
+static int is_end_cmd(char const *line) {
+	int len = strlen(line);
+
+	return ISCMD(line, len, "shutdown") || ISCMD(line, len, "exit") ||
+		ISCMD(line, len, "reboot");
+}
+
+/*
+ * Tells whether handle_command() would simply bounce "line" to the server
+ * without ending the session, which lets event driven callers run it
+ * asynchronously.
+ */
+int is_bounce_cmd(char const *line) {
+	int len = strlen(line);
+
+	return !(is_job_line(line) || is_end_cmd(line) ||
+		 ISCMD(line, len, "get") || ISCMD(line, len, "put") ||
+		 ISCMD(line, len, "cat") || ISCMD(line, len, "getchk") ||
+		 ISCMD(line, len, "stats") || ISCMD(line, len, "jobs") ||
+		 ISCMD(line, len, "wait") || ISJOBKILL(line, len));
+}
+
+int handle_command(qtty_conn_t *qc, char *line, FILE *flcons) {
 	int res, len = strlen(line);
 
 	res = 0;
-	if (ISCMD(line, len, "shutdown") || ISCMD(line, len, "exit") ||
-	    ISCMD(line, len, "reboot")) {
-		handle_bounce_cmd(qfd, line, flcons);
+	if (is_job_line(line)) {
+		res = jobs_submit(line, flcons);
+	} else if (is_end_cmd(line)) {
+		handle_bounce_cmd(qc, line, flcons);
 		res = -1;
 	} else if (ISCMD(line, len, "get")) {
-		res = handle_mget(qfd, line, flcons);
+		res = handle_mget(qc, line, flcons);
 	} else if (ISCMD(line, len, "put")) {
-		res = handle_mput(qfd, line, flcons);
+		res = handle_mput(qc, line, flcons);
 	} else if (ISCMD(line, len, "cat")) {
-		res = handle_cat(qfd, line, flcons);
+		res = handle_cat(qc, line, flcons);
 	} else if (ISCMD(line, len, "getchk")) {
-		res = handle_getchunk(qfd, line, flcons);
+		res = handle_getchunk(qc, line, flcons);
+	} else if (ISCMD(line, len, "stats")) {
+		stats_print(&qc->st, flcons);
+	} else if (ISCMD(line, len, "jobs")) {
+		jobs_list(flcons);
+	} else if (ISCMD(line, len, "wait")) {
+		res = jobs_wait(line, flcons);
+	} else if (ISJOBKILL(line, len)) {
+		res = jobs_kill(line, flcons);
 	} else
-		res = handle_bounce_cmd(qfd, line, flcons);
+		res = handle_bounce_cmd(qc, line, flcons);
 
 	return res;
 }
 
+/*
+ * Returns the next batch line, from "cmds" first and then from "fin",
+ * skipping empty lines and "#" comments.
+ */
+static char *batch_line(char * const *cmds, int ncmds, int *icmd, FILE *fin,
+			char *buf, int size) {
+
+	for (;;) {
+		if (*icmd < ncmds) {
+			SNPRINTF(buf, size, "%s", cmds[(*icmd)++]);
+			buf[size - 1] = 0;
+		} else if (fin == NULL || fgets(buf, size, fin) == NULL)
+			return NULL;
+		trim_line(buf, " \r\n\t");
+		if (*buf && *buf != '#')
+			return buf;
+	}
+}
+
+/*
+ * Runs a command list without waiting a round trip per command. Bounce
+ * commands are sent ahead, up to "window" of them in flight, and since the
+ * server answers in order, each empty terminator packet retires the oldest
+ * one. Other commands (transfers, exit, ...) first let the window drain,
+ * and then run synchronously. Returns 0 if every command went fine, 1 if
+ * some local command failed, and -1 if the session broke.
+ */
+int do_batch(qtty_conn_t *qc, char * const *cmds, int ncmds, FILE *fin, int window,
+	     FILE *fout) {
+	int icmd = 0, inflight = 0, size, res, nerrs = 0;
+	char const *data;
+	char *line;
+	char buf[1024];
+
+	if (window < 1)
+		window = 1;
+	if (window > QTTY_MAX_BATCH_WINDOW)
+		window = QTTY_MAX_BATCH_WINDOW;
+	line = batch_line(cmds, ncmds, &icmd, fin, buf, sizeof(buf));
+	for (;;) {
+		if (!qconn_pkt_ready(qc)) {
+			pkt_batch_begin(qc);
+			for (; line != NULL && inflight < window && is_bounce_cmd(line);
+			     inflight++) {
+				if (send_cmd(qc, line) < 0) {
+					pkt_batch_end(qc);
+					return -1;
+				}
+				line = batch_line(cmds, ncmds, &icmd, fin, buf, sizeof(buf));
+			}
+			if (pkt_batch_end(qc) < 0)
+				return -1;
+		}
+		if (inflight == 0) {
+			if (line == NULL)
+				break;
+			fflush(fout);
+			/*
+			 * A negative result is either the script ending the
+			 * session, or the session breaking under a command.
+			 */
+			if ((res = handle_command(qc, line, stderr)) < 0) {
+				if (!is_end_cmd(line)) {
+					fflush(fout);
+					return -1;
+				}
+				break;
+			}
+			if (res > 0)
+				nerrs++;
+			line = batch_line(cmds, ncmds, &icmd, fin, buf, sizeof(buf));
+			continue;
+		}
+		if (next_pkt(qc, &data, &size) < 0)
+			return -1;
+		if (size)
+			fwrite(data, 1, size, fout);
+		else
+			inflight--;
+	}
+	fflush(fout);
+
+	return nerrs ? 1: 0;
+}
+
 char *trim_line(char *line, char const *tstr) {
 	char *base, *top;
 
@@ -505,7 +1626,7 @@ char *trim_line(char *line, char const *tstr) {
 	return line;
 }
 
-int do_login(bt_sock_t qfd, char const *wline, char const *user, char const *passwd,
+int do_login(qtty_conn_t *qc, char const *wline, char const *user, char const *passwd,
 	     FILE *flerr) {
 	int i, size;
 	char *data;
@@ -526,9 +1647,14 @@ int do_login(bt_sock_t qfd, char const *wline, char const *user, char const *pas
 	sha1_final(digest, &sctx);
 	for (i = 0; i < (int) sizeof(digest); i++)
 		sprintf(sdbuf + 2 * i, "%02x", (unsigned int) digest[i]);
-	if (send_pkt(qfd, user, strlen(user)) < 0 ||
-	    send_pkt(qfd, sdbuf, strlen(sdbuf)) < 0 ||
-	    recv_pkt(qfd, &data, &size) < 0)
+	pkt_batch_begin(qc);
+	if (send_pkt(qc, user, strlen(user)) < 0 ||
+	    send_pkt(qc, sdbuf, strlen(sdbuf)) < 0) {
+		pkt_batch_end(qc);
+		return -1;
+	}
+	if (pkt_batch_end(qc) < 0 ||
+	    recv_pkt(qc, &data, &size) < 0)
 		return -1;
 	if (size) {
 		fwrite(data, 1, size, flerr);
@@ -545,8 +1671,38 @@ void usage(char const *prg) {
 	fprintf(stderr,
 		"QTTY - Terminal console for Symbian QConsole server over BlueTooth network\n"
 		"\tVersion %s - by Davide Libenzi <davidel@xmailserver.org>\n\n"
-		"use: %s --qc-addr BADDR --qc-channel BCHAN\n"
-		"\t--user USER --pass PASS [--help]\n\n", QTTY_VERSION, prg);
+		"use: %s --qc-addr ADDR [--qc-channel BCHAN]\n"
+		"\t--user USER --pass PASS [--get-queue N] [--put-queue N]\n"
+		"\t[--put-chunk N] [--get-mmap] [--get-nocache] [--uring]\n"
+		"\t[--compress LEVEL] [--stats-file PATH] [--trace PATH] [--xfer-log PATH]\n"
+		"\t[-c CMD]... [-f SCRIPT] [--window N] [--help]\n\n"
+		"ADDR is a BlueTooth address or name (RFCOMM, needs --qc-channel),\n"
+		"or one of rfcomm://BADDR, tcp://HOST:PORT, unix://PATH, fd://N[,W]\n"
+		"An fd:// address carries a single session: get -P runs on it alone,\n"
+		"and background jobs are not available\n"
+		"With -c/-f the commands run in batch (SCRIPT \"-\" is stdin), with up to\n"
+		"N remote commands in flight (default %d)\n"
+		"Put packets are sized from the measured goodput and socket blocking\n"
+		"time, unless --put-chunk fixes their size. Without --compress and\n"
+		"--put-queue, file data goes to the socket without user space copies\n"
+		"Transfers are logged, with their SHA-1, to --xfer-log (default\n"
+		"$HOME%s%s, an empty PATH disables it)\n"
+		"Downloads are preallocated and written in place, through a mapping\n"
+		"with --get-mmap, and kept out of the page cache with --get-nocache\n"
+		"With --uring, uncompressed file transfers run their socket and file\n"
+		"I/O through io_uring, if the kernel and the transport allow it\n\n",
+		QTTY_VERSION, prg, QTTY_BATCH_WINDOW, SYS_SLASHS, QTTY_XLOG_FILE);
+}
+
+char *xlog_path(char *path, int size) {
+	char const *home;
+
+	if ((home = getenv("HOME")) == NULL)
+		home = ".";
+	SNPRINTF(path, size, "%s%s%s", home, SYS_SLASHS, QTTY_XLOG_FILE);
+	path[size - 1] = 0;
+
+	return path;
 }
 
 char *stristr(char const *str, char const *sstr) {
@@ -567,120 +1723,66 @@ char *stristr(char const *str, char const *sstr) {
 	return NULL;
 }
 
-int wildmatch(char const *str, char const *match)
-{
-	int prev, mhit, revr, esc;
-
-	for (; *match; str++, match++) {
-		switch (*match) {
-		case '\\':
-			if (!*++match)
-				return 0;
-		default:
-			if (*str != *match)
-				return 0;
-			continue;
-		case '?':
-			if (*str == '\0')
-				return 0;
-			continue;
-		case '*':
-			while (*(++match) == '*');
-			if (!*match)
-				return 1;
-			while (*str)
-				if (wildmatch(str++, match))
-					return 1;
-			return 0;
-		case '[':
-			esc = 0;
-			revr = match[1] == '^' ? 1 : 0;
-			if (revr)
-				match++;
-			for (prev = 256, mhit = 0; *++match &&
-			     (esc || *match != ']');
-			     prev = esc ? prev : *match) {
-				if (!esc && (esc = *match == '\\'))
-					continue;
-				if (!esc && *match == '-') {
-					if (!*++match)
-						return 0;
-					if (*match == '\\')
-						if (!*++match)
-							return 0;
-					mhit = mhit || (*str <= *match &&
-							*str >= prev);
-				}
-				else
-					mhit = mhit || *str == *match;
-				esc = 0;
-			}
-			if (prev == 256 || esc || *match != ']' || mhit == revr)
-				return 0;
-			continue;
-		}
-	}
-
-	return *str == '\0' ? 1 : 0;
-}
-
-int wildmatchi(char const *str, char const *match) {
-	int res, i, slen, mlen;
-	char *lstr, *lmatch;
-
-	slen = strlen(str);
-	mlen = strlen(match);
-	if ((lstr = (char *) malloc(slen + mlen + 2)) == NULL)
-		return 0;
-	lmatch = lstr + slen + 1;
-	for (i = 0; i < slen; i++)
-		lstr[i] = LOCHAR(str[i]);
-	lstr[i] = 0;
-	for (i = 0; i < mlen; i++)
-		lmatch[i] = LOCHAR(match[i]);
-	lmatch[i] = 0;
-
-	res = wildmatch(lstr, lmatch);
-
-	free(lstr);
-
-	return res;
-}
-
-int get_file_list(bt_sock_t qfd, char const *rpath, char const *match, int recurse,
-		  file_list_t **flist) {
-	int size;
-	char *data, *tmps;
-	file_list_t *fent;
+/*
+ * Appends the remote files matching "match" under "rpath" to "fl", in the
+ * order the server reports them.
+ */
+int get_file_list(qtty_conn_t *qc, char const *rpath, char const *match, int recurse,
+		  flist_t *fl) {
+	int size, len;
+	unsigned long fsize;
+	char const *data, *tmps;
 	char cmd[512];
 
 	SNPRINTF(cmd, sizeof(cmd) - 1, "find -s%s %s %s", recurse ? "": "1",
 		 rpath, match);
-	if (send_pkt(qfd, cmd, strlen(cmd)) < 0)
+	if (send_cmd(qc, cmd) < 0)
 		return -1;
 	for (;;) {
-		if (recv_pkt(qfd, &data, &size) < 0)
+		if (next_pkt(qc, &data, &size) < 0)
 			return -1;
-		if (!size) {
-			free(data);
+		if (!size)
 			break;
-		}
-		if ((fent = (file_list_t *)
-		     malloc(sizeof(file_list_t) + size + 1)) == NULL) {
-			free(data);
+		if ((tmps = (char const *) memchr(data, '\n', size)) != NULL)
+			size = (int) (tmps - data);
+		fsize = 0;
+		if ((tmps = (char const *) memchr(data, '\t', size)) != NULL) {
+			len = (int) (tmps - data);
+			for (tmps++; tmps < data + size && *tmps >= '0' && *tmps <= '9'; tmps++)
+				fsize = fsize * 10 + (*tmps - '0');
+		} else
+			len = size;
+		if (flist_add_path(fl, data, len, '\\', fsize) == NULL)
 			return -1;
-		}
-		memcpy(fent->name, data, size);
-		if ((tmps = (char *) memchr(fent->name, '\n', size)) != NULL)
-			*tmps = 0;
-		fent->next = *flist;
-		*flist = fent;
-		free(data);
 	}
 
 	return 0;
 }
 
+/*
+ * Splits a "SCHEME:ADDR" or "SCHEME://ADDR" connection address, storing
+ * the lower case SCHEME in "scheme". Returns a pointer to ADDR, or NULL if
+ * "qcaddr" does not start with a scheme.
+ */
+char const *addr_split(char const *qcaddr, char *scheme, int size) {
+	int i;
+
+	for (i = 0; qcaddr[i] && qcaddr[i] != ':'; i++)
+		if (i + 1 >= size ||
+		    !((qcaddr[i] >= 'a' && qcaddr[i] <= 'z') ||
+		      (qcaddr[i] >= 'A' && qcaddr[i] <= 'Z')))
+			return NULL;
+	if (i == 0 || qcaddr[i] != ':')
+		return NULL;
+	for (i = 0; qcaddr[i] != ':'; i++)
+		scheme[i] = (char) LOCHAR(qcaddr[i]);
+	scheme[i++] = 0;
+	if (qcaddr[i] == '/' && qcaddr[i + 1] == '/')
+		i += 2;
+
+	return qcaddr + i;
+}
+
 char *normalize_path(char *path, int sc) {
 	int i;
 
@@ -695,81 +1797,217 @@ char *normalize_path(char *path, int sc) {
 	return path;
 }
 
-int do_mget(bt_sock_t qfd, char const *rpath, char const *match, int recurse,
-	    char const *lpath, FILE *flerr) {
-	int res;
-	char *pfname;
-	file_list_t *flist = NULL, *fcur;
-	char lfile[1024];
+char *mget_local_path(char const *name, char const *rpath, char const *lpath,
+		      char *lfile, int size) {
+	char const *pfname;
+
+	if ((pfname = stristr(name, rpath)) == NULL)
+		return NULL;
+	pfname += strlen(rpath);
+	if (*pfname == '\\')
+		pfname++;
+	SNPRINTF(lfile, size - 1, "%s%s%s", lpath, SYS_SLASHS, pfname);
+	lfile[size - 1] = 0;
+
+	return normalize_path(lfile, SYS_SLASHC);
+}
 
-	if (get_file_list(qfd, rpath, match, recurse, &flist) < 0)
+int do_mget(qtty_conn_t *qc, char const *rpath, char const *match, int recurse,
+	    char const *lpath, int nsess, int gflags, FILE *flerr) {
+	int res;
+	flist_t fl;
+	file_list_t *fcur;
+	char rfile[1024], lfile[1024];
+
+	flist_init(&fl);
+	if (get_file_list(qc, rpath, match, recurse, &fl) < 0 ||
+	    flist_sort(&fl) < 0) {
+		flist_free(&fl);
 		return -1;
-	for (fcur = flist; fcur != NULL; fcur = fcur->next) {
-		if ((pfname = stristr(fcur->name, rpath)) == NULL)
+	}
+	flist_dedupe(&fl);
+	if (nsess > 1 && qc->cfg != NULL) {
+		res = par_mget(qc, fl.head, rpath, lpath, nsess, gflags, flerr);
+		flist_free(&fl);
+		return res;
+	}
+	for (fcur = fl.head; fcur != NULL; fcur = fcur->next) {
+		flist_path(fcur, rfile, sizeof(rfile));
+		if (mget_local_path(rfile, rpath, lpath, lfile,
+				    sizeof(lfile)) == NULL)
 			continue;
-		pfname += strlen(rpath);
-		SNPRINTF(lfile, sizeof(lfile) - 1, "%s%s", lpath, SYS_SLASHS);
-		if (*pfname == '\\')
-			pfname++;
-		strcat(lfile, pfname);
-		prepare_path(normalize_path(lfile, SYS_SLASHC));
+		prepare_path(lfile);
 
-		fprintf(flerr, "%s\n->\t%s\n", fcur->name, lfile);
-		res = local_get(qfd, fcur->name, lfile, flerr);
+		fprintf(flerr, "%s\n->\t%s\n", rfile, lfile);
+		res = local_get(qc, rfile, lfile, gflags, flerr);
 
 		if (res < 0) {
-			fglob_free_list(flist);
+			flist_free(&fl);
 			return res;
 		}
 		if (res == 0)
 			fprintf(flerr, "OK\n");
 
 	}
-	fglob_free_list(flist);
+	flist_free(&fl);
 
 	return 0;
 }
 
-void fglob_free_list(file_list_t *flist) {
-	file_list_t *fcur, *ffree;
-
-	for (fcur = flist; (ffree = fcur) != NULL;) {
-		fcur = fcur->next;
-		free(ffree);
+/*
+ * Returns 2 when the manifest says the remote copy of "local" is current,
+ * and the upload has been skipped. A digest of "local" hashed up front can
+ * come in "hs", and is used if the file has not changed since.
+ */
+static int delta_put(qtty_conn_t *qc, mfst_t *mf, char const *pcmd, char const *remote,
+		     char const *local, mfst_hash_t const *hs, FILE *flerr) {
+	int res, hres;
+	unsigned long size, mtime;
+	mfst_ent_t *ent;
+	unsigned char digest[SHA1_DIGEST_SIZE];
+
+	if (sys_file_info(local, &size, &mtime) < 0) {
+		perror(local);
+		return 1;
 	}
+	if ((ent = mfst_find(mf, remote)) != NULL && ent->size == size) {
+		if (ent->mtime == mtime) {
+			mf->nskip++;
+			mf->bskip += size;
+			return 2;
+		}
+		/*
+		 * Same size but a different time stamp (touched, or copied
+		 * over): only the content can tell.
+		 */
+		if (hs != NULL && hs->res == 0 && hs->size == size && hs->mtime == mtime) {
+			memcpy(digest, hs->digest, SHA1_DIGEST_SIZE);
+			hres = 0;
+		} else
+			hres = sha1_file(local, digest);
+		if (hres == 0 && memcmp(digest, ent->digest, SHA1_DIGEST_SIZE) == 0) {
+			mfst_set(mf, remote, size, mtime, digest);
+			mf->nskip++;
+			mf->bskip += size;
+			return 2;
+		}
+	}
+	if ((res = local_put(qc, pcmd, remote, local, digest, flerr)) == 0) {
+		mfst_set(mf, remote, size, mtime, digest);
+		mf->nsent++;
+		mf->bsent += size;
+	}
+
+	return res;
+}
+
+static void delta_report(mfst_t const *mf, FILE *flerr) {
+
+	fprintf(flerr, "Sent %lu files (%lu bytes), %lu unchanged (%lu bytes avoided)\n",
+		mf->nsent, mf->bsent, mf->nskip, mf->bskip);
 }
 
-int do_mput(bt_sock_t qfd, char const *rpath, char const *match, int recurse,
-	    char const *lpath, FILE *flerr) {
-	int res, lplen;
+static void mput_paths(file_list_t const *fcur, char const *lpath, char const *rpath,
+		       char *lfile, int lsize, char *rfile, int rsize) {
 	char *pfname;
-	file_list_t *flist = NULL, *fcur;
-	char rfile[512];
 
-	if (fglob_get_list(lpath, match, recurse, &flist) < 0) {
-		fprintf(flerr, "Invalid path: %s\n", lpath);
-		return 1;
+	pfname = flist_path(fcur, lfile, lsize) + strlen(lpath);
+	if (*pfname == SYS_SLASHC)
+		pfname++;
+	SNPRINTF(rfile, rsize - 1, "%s\\%s", rpath, pfname);
+	normalize_path(rfile, '\\');
+}
+
+/*
+ * Hashes up front, MFST_HASH_FILES at a time, the files of "fl" that
+ * delta_put() can only tell by content (same size as in the manifest, but
+ * a different time stamp). Returns one entry per file, with "res" -1 for
+ * the ones not hashed, or NULL if out of memory.
+ */
+static mfst_hash_t *delta_prehash(mfst_t *mf, flist_t const *fl, char const *lpath,
+				  char const *rpath) {
+	int i, n, idx[MFST_HASH_FILES];
+	unsigned long size, mtime;
+	file_list_t *fcur;
+	mfst_ent_t *ent;
+	mfst_hash_t *hs, bhs[MFST_HASH_FILES];
+	char const *paths[MFST_HASH_FILES];
+	char lfiles[MFST_HASH_FILES][1024], rfile[512];
+
+	if ((hs = (mfst_hash_t *) malloc((fl->count + 1) * sizeof(mfst_hash_t))) == NULL)
+		return NULL;
+	for (fcur = fl->head, i = n = 0; fcur != NULL; fcur = fcur->next, i++) {
+		hs[i].res = -1;
+		mput_paths(fcur, lpath, rpath, lfiles[n], sizeof(lfiles[n]),
+			   rfile, sizeof(rfile));
+		if (sys_file_info(lfiles[n], &size, &mtime) == 0 &&
+		    (ent = mfst_find(mf, rfile)) != NULL &&
+		    ent->size == size && ent->mtime != mtime) {
+			bhs[n].size = size;
+			bhs[n].mtime = mtime;
+			paths[n] = lfiles[n];
+			idx[n++] = i;
+		}
+		if (n == MFST_HASH_FILES || (fcur->next == NULL && n > 0)) {
+			if (sha1_files(paths, n, bhs) == 0)
+				for (; n > 0; n--)
+					hs[idx[n - 1]] = bhs[n - 1];
+			n = 0;
+		}
 	}
-	for (fcur = flist, lplen = strlen(lpath); fcur != NULL;
-	     fcur = fcur->next) {
-		pfname = fcur->name + lplen;
-		if (*pfname == SYS_SLASHC)
-			pfname++;
-		SNPRINTF(rfile, sizeof(rfile) - 1, "%s\\%s", rpath, pfname);
-		normalize_path(rfile, '\\');
 
-		fprintf(flerr, "%s\n->\t%s\n", fcur->name, rfile);
-		res = local_put(qfd, "putf", rfile, fcur->name, flerr);
+	return hs;
+}
 
-		if (res < 0) {
-			fglob_free_list(flist);
-			return res;
-		}
+int do_mput(qtty_conn_t *qc, char const *rpath, char const *match, int recurse,
+	    char const *lpath, int pflags, FILE *flerr) {
+	int i, res;
+	flist_t fl;
+	file_list_t *fcur;
+	mfst_t mf;
+	mfst_hash_t *hs = NULL;
+	char rfile[512], lfile[1024], mpath[1024];
+
+	flist_init(&fl);
+	if (fglob_get_list(lpath, match, recurse, &fl) < 0) {
+		flist_free(&fl);
+		fprintf(flerr, "Invalid path: %s\n", lpath);
+		return 1;
+	}
+	flist_dedupe(&fl);
+	if ((pflags & QTTY_PUTF_DELTA) &&
+	    mfst_load(&mf, mfst_path(qc->cfg, mpath, sizeof(mpath))) < 0) {
+		flist_free(&fl);
+		fprintf(flerr, "Unable to load manifest: %s\n", mpath);
+		return 1;
+	}
+	if (pflags & QTTY_PUTF_DELTA)
+		hs = delta_prehash(&mf, &fl, lpath, rpath);
+	for (fcur = fl.head, i = res = 0; fcur != NULL; fcur = fcur->next, i++) {
+		mput_paths(fcur, lpath, rpath, lfile, sizeof(lfile), rfile, sizeof(rfile));
+
+		fprintf(flerr, "%s\n->\t%s\n", lfile, rfile);
+		if (pflags & QTTY_PUTF_DELTA)
+			res = delta_put(qc, &mf, "putf", rfile, lfile,
+					hs != NULL ? &hs[i]: NULL, flerr);
+		else
+			res = local_put(qc, "putf", rfile, lfile, NULL, flerr);
+
+		if (res < 0)
+			break;
 		if (res == 0)
 			fprintf(flerr, "OK\n");
+		else if (res == 2)
+			fprintf(flerr, "Unchanged\n");
+	}
+	flist_free(&fl);
+	free(hs);
+	if (pflags & QTTY_PUTF_DELTA) {
+		delta_report(&mf, flerr);
+		mfst_save(&mf);
+		mfst_free(&mf);
 	}
-	fglob_free_list(flist);
 
-	return 0;
+	return res < 0 ? res: 0;
 }
 
@@ -19,40 +19,153 @@
 #define _QTTY_UTIL_H
 
 
+#define QTTY_PKT_HDRSIZE 3
+#define QTTY_PKT_MAXSIZE 65535
+#define QTTY_RXBUF_SIZE (1024 * 128)
+#define QTTY_TXBUF_SIZE (1024 * 16)
+#define QTTY_PUT_MAPSIZE (1024 * 1024 * 4)
+#define QTTY_SINK_MAPSIZE (1024 * 1024 * 4)
+#define QTTY_SINK_STEP (1024 * 1024 * 8)
+#define QTTY_JOURNAL_EXT ".qpart"
+#define QTTY_JOURNAL_MAGIC "QTTYJ1"
+#define QTTY_JOURNAL_STEP (1024 * 1024)
+#define QTTY_BATCH_WINDOW 16
+#define QTTY_MAX_BATCH_WINDOW 256
+#define QTTY_SUM_CAPS "$sum.sha1"
+#define QTTY_SUM_CMD "$sum sha1"
+#define QTTY_XLOG_FILE ".qtty_xfers"
 
-int send_pkt(bt_sock_t fd, char const *data, int size);
-int recv_pkt(bt_sock_t fd, char **data, int *size);
-int handle_bounce_cmd(bt_sock_t qfd, char *line, FILE *fout);
-int get_cmd(bt_sock_t qfd, char const *cmd,
+#define QTTY_GETF_RESUME (1 << 0)
+
+#define QTTY_PUTF_DELTA (1 << 0)
+
+#define QTTY_SINK_MMAP (1 << 0)
+#define QTTY_SINK_NOCACHE (1 << 1)
+
+
+typedef struct s_qtty_cfg {
+	char const *qcaddr;
+	int channel;
+	char const *user;
+	char const *passwd;
+	int getq, putq, putchunk;
+	int getsink;
+	int uring;
+	int zlevel;
+	char const *xlog;
+} qtty_cfg_t;
+
+typedef struct s_qtty_conn {
+	qtty_cfg_t const *cfg;
+	bt_sock_t fd;
+	int rxoff, rxcnt;
+	int txcnt, txbatch;
+	int getq, putq, putchunk;
+	int getsink;
+	qtty_zip_t *zip;
+	qtty_uring_t *ring;
+	int xsum;
+	sha1_ctx_t xsctx;
+	unsigned char xdigest[SHA1_DIGEST_SIZE];
+	qtty_stats_t st;
+	unsigned int abort;
+	char rxbuf[QTTY_RXBUF_SIZE];
+	char txbuf[QTTY_TXBUF_SIZE];
+	char zbuf[QTTY_PKT_MAXSIZE];
+} qtty_conn_t;
+
+/*
+ * Download sink, writing at known offsets of a file preallocated to its
+ * final size, either with pwrite() or through a writable mapping. With
+ * QTTY_SINK_NOCACHE the data written is pushed out and evicted from the
+ * page cache every QTTY_SINK_STEP bytes.
+ */
+typedef struct s_file_sink {
+	int fd, flags;
+	unsigned long off, total;
+	unsigned long wbase, dbase;
+	unsigned char *map;
+	unsigned long mbase, msize;
+} file_sink_t;
+
+typedef struct s_get_journal {
+	FILE *file;
+	file_sink_t fs;
+	char const *jpath;
+	char const *remote;
+	unsigned long total, done, synced;
+} get_journal_t;
+
+
+qtty_conn_t *qconn_open(bt_sock_t fd);
+int qconn_connect(qtty_cfg_t const *cfg, FILE *flban, FILE *flerr,
+		  qtty_conn_t **pqc);
+qtty_conn_t *qconn_dial(qtty_cfg_t const *cfg);
+int qconn_login(qtty_conn_t *qc, FILE *flban, FILE *flerr);
+int qconn_zip(qtty_conn_t *qc, char const *banner, int level, FILE *flerr);
+int qconn_zip_accept(qtty_conn_t *qc, char const *args, int level);
+int qconn_sum(qtty_conn_t *qc, char const *banner, FILE *flerr);
+int qconn_uring(qtty_conn_t *qc);
+void qconn_close(qtty_conn_t *qc);
+int send_pkt(qtty_conn_t *qc, char const *data, int size);
+int send_pkt_file(qtty_conn_t *qc, int fd, unsigned long off, int size);
+int send_cmd(qtty_conn_t *qc, char const *cmd);
+int flush_pkts(qtty_conn_t *qc);
+void pkt_batch_begin(qtty_conn_t *qc);
+int pkt_batch_end(qtty_conn_t *qc);
+int next_pkt(qtty_conn_t *qc, char const **data, int *size);
+int qconn_read_avail(qtty_conn_t *qc);
+int qconn_pkt_ready(qtty_conn_t *qc);
+int recv_pkt(qtty_conn_t *qc, char **data, int *size);
+int handle_bounce_cmd(qtty_conn_t *qc, char *line, FILE *fout);
+int get_cmd_open(qtty_conn_t *qc, char const *cmd, unsigned int *fsize,
+		 FILE *flerr);
+int get_cmd_data(qtty_conn_t *qc, char const *cmd, unsigned int fsize,
+		 int (*dproc)(void *, void const *, int), void *priv, FILE *flerr);
+int get_cmd_sink(qtty_conn_t *qc, char const *cmd, unsigned int fsize,
+		 file_sink_t *fs, FILE *flerr);
+int get_cmd(qtty_conn_t *qc, char const *cmd,
 	    int (*dproc)(void *, void const *, int), void *priv, FILE *flerr);
-int put_cmd(bt_sock_t qfd, char const *cmd, unsigned int fsize,
+int put_cmd(qtty_conn_t *qc, char const *cmd, unsigned int fsize,
 	    int (*rproc)(void *, void *, int), void *priv, FILE *flerr);
+int put_cmd_file(qtty_conn_t *qc, char const *cmd, unsigned int fsize, FILE *file,
+		 FILE *flerr);
 int dump_to_file(void *priv, void const *data, int size);
+void sink_open(file_sink_t *fs, FILE *file, unsigned long off, unsigned long total,
+	       int flags);
+void sink_advance(file_sink_t *fs, unsigned long size);
+int dump_to_sink(void *priv, void const *data, int size);
+void sink_close(file_sink_t *fs);
 int read_from_file(void *priv, void *data, int size);
-int handle_getchunk(bt_sock_t qfd, char *line, FILE *flerr);
+int handle_getchunk(qtty_conn_t *qc, char *line, FILE *flerr);
 int prepare_path(char const *path);
-int local_get(bt_sock_t qfd, char const *remote, char const *local, FILE *flerr);
-int handle_mget(bt_sock_t qfd, char *line, FILE *flerr);
-int handle_mput(bt_sock_t qfd, char *line, FILE *flerr);
-int local_put(bt_sock_t qfd, char const *pcmd, char const *remote, char const *local,
+int local_get(qtty_conn_t *qc, char const *remote, char const *local, int gflags,
 	      FILE *flerr);
-int handle_cat(bt_sock_t qfd, char *line, FILE *flerr);
-int handle_command(bt_sock_t qfd, char *line, FILE *flcons);
+int handle_mget(qtty_conn_t *qc, char *line, FILE *flerr);
+int handle_mput(qtty_conn_t *qc, char *line, FILE *flerr);
+int local_put(qtty_conn_t *qc, char const *pcmd, char const *remote, char const *local,
+	      unsigned char *digest, FILE *flerr);
+int handle_cat(qtty_conn_t *qc, char *line, FILE *flerr);
+int is_bounce_cmd(char const *line);
+int handle_command(qtty_conn_t *qc, char *line, FILE *flcons);
+int do_batch(qtty_conn_t *qc, char * const *cmds, int ncmds, FILE *fin, int window,
+	     FILE *fout);
 char *trim_line(char *line, char const *tstr);
-int do_login(bt_sock_t qfd, char const *wline, char const *user, char const *passwd,
+int do_login(qtty_conn_t *qc, char const *wline, char const *user, char const *passwd,
 	     FILE *flerr);
 void usage(char const *prg);
+char *xlog_path(char *path, int size);
 char *stristr(char const *str, char const *sstr);
-int wildmatch(char const *str, char const *match);
-int wildmatchi(char const *str, char const *match);
-int get_file_list(bt_sock_t qfd, char const *rpath, char const *match, int recurse,
-		  file_list_t **flist);
+int get_file_list(qtty_conn_t *qc, char const *rpath, char const *match, int recurse,
+		  flist_t *fl);
+char const *addr_split(char const *qcaddr, char *scheme, int size);
 char *normalize_path(char *path, int sc);
-int do_mget(bt_sock_t qfd, char const *rpath, char const *match, int recurse,
-	    char const *lpath, FILE *flerr);
-void fglob_free_list(file_list_t *flist);
-int do_mput(bt_sock_t qfd, char const *rpath, char const *match, int recurse,
-	    char const *lpath, FILE *flerr);
+char *mget_local_path(char const *name, char const *rpath, char const *lpath,
+		      char *lfile, int size);
+int do_mget(qtty_conn_t *qc, char const *rpath, char const *match, int recurse,
+	    char const *lpath, int nsess, int gflags, FILE *flerr);
+int do_mput(qtty_conn_t *qc, char const *rpath, char const *match, int recurse,
+	    char const *lpath, int pflags, FILE *flerr);
 
 
 #endif
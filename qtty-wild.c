@@ -0,0 +1,225 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+
+#include "qtty.h"
+
+
+#define WILD_MAX_NFA 64
+#define WILD_SET(s, c) ((s)[(c) >> 3] |= 1 << ((c) & 7))
+#define WILD_ISSET(s, c) ((s)[(c) >> 3] & (1 << ((c) & 7)))
+
+
+
+static int wild_class(char const *match, int c, char const **end);
+static char const *wild_token(char const *match, qtty_wtok_t *tok);
+static void wild_fold(qtty_wtok_t *tok);
+static int wild_match_nfa(qtty_wild_t const *wp, char const *str);
+static int wild_match_greedy(qtty_wild_t const *wp, char const *str);
+
+
+
+/*
+ * Evaluates the "[...]" class at "match" for the character "c", with the
+ * same signed char range semantics the recursive matcher used to have.
+ * Returns -1 for a malformed class, or the match result with "end"
+ * pointing to the closing bracket.
+ */
+static int wild_class(char const *match, int c, char const **end) {
+	int prev, mhit, revr, esc;
+
+	esc = 0;
+	revr = match[1] == '^' ? 1 : 0;
+	if (revr)
+		match++;
+	for (prev = 256, mhit = 0; *++match &&
+	     (esc || *match != ']');
+	     prev = esc ? prev : *match) {
+		if (!esc && (esc = *match == '\\'))
+			continue;
+		if (!esc && *match == '-') {
+			if (!*++match)
+				return -1;
+			if (*match == '\\')
+				if (!*++match)
+					return -1;
+			mhit = mhit || (c <= *match && c >= prev);
+		}
+		else
+			mhit = mhit || c == *match;
+		esc = 0;
+	}
+	if (prev == 256 || esc || *match != ']')
+		return -1;
+	*end = match;
+
+	return mhit != revr;
+}
+
+static char const *wild_token(char const *match, qtty_wtok_t *tok) {
+	int c, hit;
+	char const *end = match;
+
+	memset(tok, 0, sizeof(qtty_wtok_t));
+	switch (*match) {
+	case '*':
+		while (match[1] == '*')
+			match++;
+		tok->star = 1;
+		break;
+	case '?':
+		for (c = 1; c < 256; c++)
+			WILD_SET(tok->set, c);
+		break;
+	case '[':
+		for (c = 1; c < 256; c++) {
+			if ((hit = wild_class(match, (char) c, &end)) < 0)
+				return NULL;
+			if (hit)
+				WILD_SET(tok->set, c);
+		}
+		match = end;
+		break;
+	case '\\':
+		if (!*++match)
+			return NULL;
+	default:
+		WILD_SET(tok->set, (unsigned char) *match);
+	}
+
+	return match;
+}
+
+/*
+ * The pattern has been lowercased before parsing, so a character matches
+ * if its lowercase version is in the set.
+ */
+static void wild_fold(qtty_wtok_t *tok) {
+	int c;
+	unsigned char set[32];
+
+	memset(set, 0, sizeof(set));
+	for (c = 1; c < 256; c++)
+		if (WILD_ISSET(tok->set, (unsigned char) LOCHAR((char) c)))
+			WILD_SET(set, c);
+	memcpy(tok->set, set, sizeof(set));
+}
+
+/*
+ * Consecutive stars are collapsed at compile time, so a single shift
+ * computes the epsilon closure of the star states.
+ */
+static int wild_match_nfa(qtty_wild_t const *wp, char const *str) {
+	qtty_u64 st, stars = wp->stars;
+
+	st = 1 | ((1 & stars) << 1);
+	for (; *str && st; str++) {
+		st = (((st & ~stars) << 1) & wp->masks[(unsigned char) *str]) |
+			(st & stars);
+		st |= (st & stars) << 1;
+	}
+
+	return (st >> wp->ntoks) & 1;
+}
+
+/*
+ * Patterns too long for the bit parallel NFA fall back to the classic
+ * greedy scan, which only backtracks to the last star and is bound by
+ * O(N * M).
+ */
+static int wild_match_greedy(qtty_wild_t const *wp, char const *str) {
+	int t = 0, st = -1;
+	char const *ss = NULL;
+
+	while (*str) {
+		if (t < wp->ntoks && wp->toks[t].star) {
+			st = t++;
+			ss = str;
+		} else if (t < wp->ntoks &&
+			   WILD_ISSET(wp->toks[t].set, (unsigned char) *str)) {
+			t++;
+			str++;
+		} else if (st >= 0) {
+			t = st + 1;
+			str = ++ss;
+		} else
+			return 0;
+	}
+	while (t < wp->ntoks && wp->toks[t].star)
+		t++;
+
+	return t == wp->ntoks;
+}
+
+/*
+ * Compiles the "*", "?", "[...]" and "\" glob pattern into a matcher
+ * object. A malformed pattern compiles fine, but never matches.
+ */
+qtty_wild_t *wild_compile(char const *match, int flags) {
+	int i, c;
+	char *pat, *p;
+	qtty_wild_t *wp;
+
+	if ((wp = (qtty_wild_t *)
+	     malloc(sizeof(qtty_wild_t) + strlen(match) * sizeof(qtty_wtok_t))) == NULL)
+		return NULL;
+	if ((pat = strdup(match)) == NULL) {
+		free(wp);
+		return NULL;
+	}
+	memset(wp, 0, sizeof(qtty_wild_t));
+	if (flags & QTTY_WILD_ICASE)
+		for (p = pat; *p; p++)
+			*p = LOCHAR(*p);
+	for (p = pat; *p; p++) {
+		if ((p = (char *) wild_token(p, &wp->toks[wp->ntoks])) == NULL) {
+			wp->bad = 1;
+			break;
+		}
+		if ((flags & QTTY_WILD_ICASE) && !wp->toks[wp->ntoks].star)
+			wild_fold(&wp->toks[wp->ntoks]);
+		wp->ntoks++;
+	}
+	free(pat);
+	if (wp->ntoks < WILD_MAX_NFA)
+		for (i = 0; i < wp->ntoks; i++) {
+			if (wp->toks[i].star)
+				wp->stars |= (qtty_u64) 1 << i;
+			else
+				for (c = 1; c < 256; c++)
+					if (WILD_ISSET(wp->toks[i].set, c))
+						wp->masks[c] |= (qtty_u64) 1 << (i + 1);
+		}
+
+	return wp;
+}
+
+void wild_free(qtty_wild_t *wp) {
+
+	free(wp);
+}
+
+int wild_match(qtty_wild_t const *wp, char const *str) {
+
+	if (wp->bad)
+		return 0;
+
+	return wp->ntoks < WILD_MAX_NFA ? wild_match_nfa(wp, str):
+		wild_match_greedy(wp, str);
+}
+
+
@@ -0,0 +1,46 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+
+#if !defined(_QTTY_WILD_H)
+#define _QTTY_WILD_H
+
+
+#define QTTY_WILD_ICASE (1 << 0)
+
+
+typedef struct s_qtty_wtok {
+	int star;
+	unsigned char set[32];
+} qtty_wtok_t;
+
+typedef struct s_qtty_wild {
+	int ntoks, bad;
+	qtty_u64 stars;
+	qtty_u64 masks[256];
+	qtty_wtok_t toks[1];
+} qtty_wild_t;
+
+
+
+qtty_wild_t *wild_compile(char const *match, int flags);
+void wild_free(qtty_wild_t *wp);
+int wild_match(qtty_wild_t const *wp, char const *str);
+
+
+#endif
+
@@ -19,7 +19,14 @@
 
 
 
-static bt_sock_t qcfd;
+static BOOL WINAPI break_handler(DWORD dtype);
+static int run_batch(char * const *cmds, int ncmds, char const *bfile, int window,
+		     char const *sfile);
+
+
+
+static qtty_cfg_t qcfg;
+static qtty_conn_t *qconn;
 static volatile int qquit;
 
 
@@ -30,52 +37,131 @@ static BOOL WINAPI break_handler(DWORD dtype) {
 	return TRUE;
 }
 
+static int run_batch(char * const *cmds, int ncmds, char const *bfile, int window,
+		     char const *sfile) {
+	int res;
+	FILE *fin = NULL;
+
+	if (bfile != NULL &&
+	    (fin = strcmp(bfile, "-") ? fopen(bfile, "rt"): stdin) == NULL) {
+		perror(bfile);
+		return 1;
+	}
+	if ((res = qconn_connect(&qcfg, NULL, stderr, &qconn)) < 0) {
+		if (fin != NULL && fin != stdin)
+			fclose(fin);
+		return -res;
+	}
+	res = do_batch(qconn, cmds, ncmds, fin, window, stdout);
+	if (sfile != NULL)
+		stats_export(&qconn->st, qcfg.qcaddr, sfile);
+	qconn_close(qconn);
+	trace_close();
+	if (fin != NULL && fin != stdin)
+		fclose(fin);
+
+	return res < 0 ? 1: res;
+}
+
 int main(int ac, char **av) {
-	int i, size, channel = -1;
-	char *prompt = "$ ", *line, *user = NULL, *passwd = NULL, *qcaddr = NULL;
-	char lnbuf[1024];
+	int i, res, ncmds = 0, window = QTTY_BATCH_WINDOW;
+	char *prompt = "$ ", *line;
+	char const *sfile = NULL, *tfile = NULL, *bfile = NULL;
+	char **cmds;
+	char lnbuf[1024], xlfile[256];
 
+	sha1_setup();
+	if ((cmds = (char **) malloc(ac * sizeof(char *))) == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	qcfg.channel = -1;
 	for (i = 1; i < ac; i++) {
 		if (!strcmp(av[i], "--user")) {
 			if (++i < ac)
-				user = av[i];
+				qcfg.user = av[i];
 		} else if (!strcmp(av[i], "--pass")) {
 			if (++i < ac)
-				passwd = av[i];
+				qcfg.passwd = av[i];
 		} else if (!strcmp(av[i], "--qc-addr")) {
 			if (++i < ac)
-				qcaddr = av[i];
+				qcfg.qcaddr = av[i];
 		} else if (!strcmp(av[i], "--qc-channel")) {
 			if (++i < ac)
-				channel = atoi(av[i]);
+				qcfg.channel = atoi(av[i]);
+		} else if (!strcmp(av[i], "--get-queue")) {
+			if (++i < ac)
+				qcfg.getq = atoi(av[i]);
+		} else if (!strcmp(av[i], "--put-queue")) {
+			if (++i < ac)
+				qcfg.putq = atoi(av[i]);
+		} else if (!strcmp(av[i], "--put-chunk")) {
+			if (++i < ac)
+				qcfg.putchunk = atoi(av[i]);
+		} else if (!strcmp(av[i], "--get-mmap")) {
+			qcfg.getsink |= QTTY_SINK_MMAP;
+		} else if (!strcmp(av[i], "--get-nocache")) {
+			qcfg.getsink |= QTTY_SINK_NOCACHE;
+		} else if (!strcmp(av[i], "--uring")) {
+			qcfg.uring = 1;
+		} else if (!strcmp(av[i], "--compress")) {
+			if (++i < ac)
+				qcfg.zlevel = atoi(av[i]);
+		} else if (!strcmp(av[i], "--stats-file")) {
+			if (++i < ac)
+				sfile = av[i];
+		} else if (!strcmp(av[i], "--trace")) {
+			if (++i < ac)
+				tfile = av[i];
+		} else if (!strcmp(av[i], "--xfer-log")) {
+			if (++i < ac)
+				qcfg.xlog = av[i];
+		} else if (!strcmp(av[i], "-c")) {
+			if (++i < ac)
+				cmds[ncmds++] = av[i];
+		} else if (!strcmp(av[i], "-f")) {
+			if (++i < ac)
+				bfile = av[i];
+		} else if (!strcmp(av[i], "--window")) {
+			if (++i < ac)
+				window = atoi(av[i]);
 		} else {
 			usage(av[0]);
+			free(cmds);
 			return 1;
 		}
 	}
-	if (!qcaddr || channel < 0 || !user || !passwd) {
+	if (!qcfg.qcaddr || !qcfg.user || !qcfg.passwd) {
 		usage(av[0]);
+		free(cmds);
 		return 1;
 	}
+	if (qcfg.xlog == NULL)
+		qcfg.xlog = xlog_path(xlfile, sizeof(xlfile));
+	else if (!*qcfg.xlog)
+		qcfg.xlog = NULL;
 
         SetConsoleCtrlHandler(break_handler, TRUE);
 
-	fprintf(stderr, "Opening connection to %s (%d)\n", qcaddr, channel);
-	fflush(stderr);
-	if ((qcfd = bt_sock_open(qcaddr, channel)) == INVALID_BT_SOCK)
-		return 1;
-	if (recv_pkt(qcfd, &line, &size) < 0) {
-		bt_sock_close(qcfd);
+	if (trace_open(tfile) < 0) {
+		fprintf(stderr, "Unable to start tracing\n");
+		free(cmds);
 		return 1;
 	}
-	fprintf(stderr, "%s", line);
-	if (do_login(qcfd, line, user, passwd, stderr) < 0) {
-		free(line);
-		bt_sock_close(qcfd);
-		return 2;
+	if (ncmds > 0 || bfile != NULL) {
+		res = run_batch(cmds, ncmds, bfile, window, sfile);
+		free(cmds);
+		return res;
 	}
-	free(line);
+	free(cmds);
+
+	fprintf(stderr, "Opening connection to %s (%d)\n", qcfg.qcaddr, qcfg.channel);
+	fflush(stderr);
+	if ((res = qconn_connect(&qcfg, stderr, stderr, &qconn)) < 0)
+		return -res;
+	jobs_init(&qcfg, &qconn->st, NULL, NULL);
 	for (; !qquit;) {
+		jobs_reap(stderr);
 		fputs(prompt, stderr);
 		line = fgets(lnbuf, sizeof(lnbuf) - 1, stdin);
 		if (!line)
@@ -83,12 +169,16 @@ int main(int ac, char **av) {
 		trim_line(line, " \r\n\t");
 		if (!*line)
 			continue;
-		if (handle_command(qcfd, line, stderr) < 0)
+		if (handle_command(qconn, line, stderr) < 0)
 			break;
 	}
+	jobs_cleanup(stderr);
 	if (qquit)
-		handle_bounce_cmd(qcfd, "exit", stderr);
-	bt_sock_close(qcfd);
+		handle_bounce_cmd(qconn, "exit", stderr);
+	if (sfile != NULL)
+		stats_export(&qconn->st, qcfg.qcaddr, sfile);
+	qconn_close(qconn);
+	trace_close();
 
 	return 0;
 }
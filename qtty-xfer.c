@@ -0,0 +1,708 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#include "qtty.h"
+
+
+
+typedef struct s_xfer_slot {
+	int size, rsize;
+	char data[QTTY_XBUF_SIZE];
+} xfer_slot_t;
+
+/*
+ * Bounded single-producer/single-consumer ring. The producer only moves
+ * "tail" and the consumer only moves "head", so the data path needs no
+ * locks. A side that finds the ring full (or empty) raises its wait flag
+ * and sleeps on its event, and the peer signals it only if it sees the
+ * flag set after publishing.
+ */
+typedef struct s_xfer_ring {
+	unsigned int nslots;
+	unsigned int head, tail;
+	unsigned int pwait, cwait;
+	sys_event_t pevt, cevt;
+	xfer_slot_t *slots;
+} xfer_ring_t;
+
+typedef struct s_xfer_getpipe {
+	xfer_ring_t ring;
+	int (*dproc)(void *, void const *, int);
+	void *priv;
+	sha1_ctx_t *sctx;
+	unsigned int error;
+	double disk_secs;
+} xfer_getpipe_t;
+
+typedef struct s_xfer_putpipe {
+	xfer_ring_t ring;
+	int (*rproc)(void *, void *, int);
+	void *priv;
+	sha1_ctx_t *sctx;
+	unsigned int chunk;
+	unsigned int fsize;
+	unsigned int stop;
+	qtty_zip_t *zip;
+	char *zbuf;
+	double disk_secs;
+} xfer_putpipe_t;
+
+typedef struct s_mget_deque {
+	sys_mutex_t mtx;
+	int head, tail;
+	file_list_t **ents;
+} mget_deque_t;
+
+typedef struct s_mget_worker {
+	struct s_mget_ctx *ctx;
+	int id;
+	qtty_conn_t *qc;
+	mget_deque_t dq;
+	sys_thread_t thr;
+	int nfiles, nerrs, lost;
+} mget_worker_t;
+
+typedef struct s_mget_ctx {
+	char const *rpath, *lpath;
+	int nwork, gflags;
+	mget_worker_t *works;
+	FILE *flerr;
+} mget_ctx_t;
+
+
+
+static int ring_init(xfer_ring_t *xr, int nslots);
+static void ring_free(xfer_ring_t *xr);
+static xfer_slot_t *ring_prod_slot(xfer_ring_t *xr);
+static void ring_prod_commit(xfer_ring_t *xr);
+static xfer_slot_t *ring_cons_slot(xfer_ring_t *xr);
+static void ring_cons_commit(xfer_ring_t *xr);
+static void *get_writer_proc(void *priv);
+static void *put_reader_proc(void *priv);
+static int mget_size_cmp(void const *p1, void const *p2);
+static file_list_t *mget_pop(mget_deque_t *dq);
+static file_list_t *mget_steal(mget_deque_t *dq);
+static void mget_push_front(mget_deque_t *dq, file_list_t *fent);
+static file_list_t *mget_next(mget_worker_t *wk);
+static void *mget_worker_proc(void *priv);
+
+
+
+static int ring_init(xfer_ring_t *xr, int nslots) {
+
+	if (nslots > QTTY_MAX_XQUEUE)
+		nslots = QTTY_MAX_XQUEUE;
+	xr->nslots = (unsigned int) nslots;
+	xr->head = xr->tail = 0;
+	xr->pwait = xr->cwait = 0;
+	if ((xr->slots = (xfer_slot_t *)
+	     malloc(nslots * sizeof(xfer_slot_t))) == NULL)
+		return -1;
+	if (sys_event_init(&xr->pevt) < 0) {
+		free(xr->slots);
+		return -1;
+	}
+	if (sys_event_init(&xr->cevt) < 0) {
+		sys_event_free(&xr->pevt);
+		free(xr->slots);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void ring_free(xfer_ring_t *xr) {
+
+	sys_event_free(&xr->cevt);
+	sys_event_free(&xr->pevt);
+	free(xr->slots);
+}
+
+static xfer_slot_t *ring_prod_slot(xfer_ring_t *xr) {
+	unsigned int tail = xr->tail;
+
+	while (tail - SYS_LOAD_ACQ(&xr->head) == xr->nslots) {
+		SYS_STORE_REL(&xr->pwait, 1);
+		SYS_MEMBAR();
+		if (tail - SYS_LOAD_ACQ(&xr->head) == xr->nslots)
+			sys_event_wait(&xr->pevt);
+		SYS_STORE_REL(&xr->pwait, 0);
+	}
+
+	return &xr->slots[tail % xr->nslots];
+}
+
+static void ring_prod_commit(xfer_ring_t *xr) {
+
+	SYS_STORE_REL(&xr->tail, xr->tail + 1);
+	SYS_MEMBAR();
+	if (SYS_LOAD_ACQ(&xr->cwait))
+		sys_event_signal(&xr->cevt);
+}
+
+static xfer_slot_t *ring_cons_slot(xfer_ring_t *xr) {
+	unsigned int head = xr->head;
+
+	while (SYS_LOAD_ACQ(&xr->tail) == head) {
+		SYS_STORE_REL(&xr->cwait, 1);
+		SYS_MEMBAR();
+		if (SYS_LOAD_ACQ(&xr->tail) == head)
+			sys_event_wait(&xr->cevt);
+		SYS_STORE_REL(&xr->cwait, 0);
+	}
+
+	return &xr->slots[head % xr->nslots];
+}
+
+static void ring_cons_commit(xfer_ring_t *xr) {
+
+	SYS_STORE_REL(&xr->head, xr->head + 1);
+	SYS_MEMBAR();
+	if (SYS_LOAD_ACQ(&xr->pwait))
+		sys_event_signal(&xr->pevt);
+}
+
+static void *get_writer_proc(void *priv) {
+	xfer_getpipe_t *gp = (xfer_getpipe_t *) priv;
+	double t0;
+	xfer_slot_t *slot;
+
+	trace_thread("get-writer");
+	for (;;) {
+		slot = ring_cons_slot(&gp->ring);
+		if (!slot->size) {
+			ring_cons_commit(&gp->ring);
+			break;
+		}
+		if (!gp->error) {
+			t0 = sys_now();
+			if ((*gp->dproc)(gp->priv, slot->data, slot->size) != slot->size)
+				SYS_STORE_REL(&gp->error, 1);
+			gp->disk_secs += sys_now() - t0;
+			TRACE_EVENT("dproc", t0, slot->size, NULL);
+			sha1_update(gp->sctx, (unsigned char const *) slot->data,
+				    slot->size);
+		}
+		ring_cons_commit(&gp->ring);
+	}
+
+	return NULL;
+}
+
+/*
+ * Receives the data stream of a get command, up to the empty terminator
+ * packet, handing the payload to "dproc" (and to the running SHA-1 of the
+ * connection) from a separate writer thread. Packets are packed into slots
+ * of the ring; a slot is published when it is full, or early when the
+ * socket buffer runs dry while the writer sits idle, so the writer can work
+ * while the network side waits for data.
+ */
+int pipe_get_data(qtty_conn_t *qc, int qsize,
+		  int (*dproc)(void *, void const *, int), void *priv,
+		  unsigned int *tsize) {
+	int res, size, rsize;
+	char const *data;
+	xfer_slot_t *slot;
+	sys_thread_t thr;
+	xfer_getpipe_t gp;
+
+	gp.dproc = dproc;
+	gp.priv = priv;
+	gp.sctx = &qc->xsctx;
+	gp.error = 0;
+	gp.disk_secs = 0;
+	if (ring_init(&gp.ring, qsize) < 0)
+		return -1;
+	qc->st.allocs++;
+	if (sys_thread_create(&thr, get_writer_proc, &gp) < 0) {
+		ring_free(&gp.ring);
+		return -1;
+	}
+	slot = ring_prod_slot(&gp.ring);
+	slot->size = 0;
+	for (res = 0, *tsize = 0;;) {
+		if (next_pkt(qc, &data, &size) < 0) {
+			res = -1;
+			break;
+		}
+		if (!size)
+			break;
+		if (SYS_LOAD_ACQ(&gp.error)) {
+			res = -1;
+			break;
+		}
+		rsize = qc->zip != NULL ? zip_frame_size(data, size): size;
+		if (rsize < 0) {
+			res = -1;
+			break;
+		}
+		if (slot->size + rsize > QTTY_XBUF_SIZE) {
+			ring_prod_commit(&gp.ring);
+			slot = ring_prod_slot(&gp.ring);
+			slot->size = 0;
+		}
+		if (qc->zip == NULL)
+			memcpy(slot->data + slot->size, data, size);
+		else if (zip_decode(qc->zip, data, size, slot->data + slot->size,
+				    rsize) != rsize) {
+			res = -1;
+			break;
+		}
+		slot->size += rsize;
+		*tsize += rsize;
+		if (qc->rxcnt == 0 && SYS_LOAD_ACQ(&gp.ring.cwait)) {
+			ring_prod_commit(&gp.ring);
+			slot = ring_prod_slot(&gp.ring);
+			slot->size = 0;
+		}
+	}
+	if (slot->size) {
+		ring_prod_commit(&gp.ring);
+		slot = ring_prod_slot(&gp.ring);
+		slot->size = 0;
+	}
+	ring_prod_commit(&gp.ring);
+	sys_thread_join(thr);
+	ring_free(&gp.ring);
+	qc->st.disk_secs += gp.disk_secs;
+
+	return gp.error ? -1: res;
+}
+
+/*
+ * On compressed sessions the reader also encodes the frames, so that the
+ * compression cost overlaps with the sender waiting on the link.
+ */
+static void *put_reader_proc(void *priv) {
+	xfer_putpipe_t *pp = (xfer_putpipe_t *) priv;
+	int curr, res;
+	unsigned int tsize;
+	double t0;
+	xfer_slot_t *slot;
+
+	trace_thread("put-reader");
+	for (tsize = 0; tsize < pp->fsize && !SYS_LOAD_ACQ(&pp->stop);) {
+		slot = ring_prod_slot(&pp->ring);
+		curr = (int) SYS_LOAD_ACQ(&pp->chunk);
+		if ((unsigned int) curr > pp->fsize - tsize)
+			curr = (int) (pp->fsize - tsize);
+		t0 = sys_now();
+		res = (*pp->rproc)(pp->priv, pp->zip != NULL ? pp->zbuf: slot->data,
+				   curr);
+		pp->disk_secs += sys_now() - t0;
+		TRACE_EVENT("rproc", t0, curr, NULL);
+		if (res != curr) {
+			slot->size = -1;
+			ring_prod_commit(&pp->ring);
+			return NULL;
+		}
+		sha1_update(pp->sctx, (unsigned char const *) (pp->zip != NULL ? pp->zbuf:
+								slot->data), curr);
+		slot->size = pp->zip != NULL ?
+			zip_encode(pp->zip, pp->zbuf, curr, slot->data): curr;
+		slot->rsize = curr;
+		ring_prod_commit(&pp->ring);
+		tsize += curr;
+	}
+	slot = ring_prod_slot(&pp->ring);
+	slot->size = 0;
+	ring_prod_commit(&pp->ring);
+
+	return NULL;
+}
+
+/*
+ * Sends "fsize" bytes of put command payload, in packets of "chunk" bytes
+ * (or of the size picked by the controller, up to "chunk", on adaptive
+ * sessions), while a reader thread keeps up to "qsize" chunks read ahead
+ * through "rproc". The reader always terminates the stream with an empty
+ * (or, on read error, negative sized) slot, which is what the sender waits
+ * for before joining it, also on the error paths.
+ */
+int pipe_put_data(qtty_conn_t *qc, int qsize, int chunk, unsigned int fsize,
+		  int (*rproc)(void *, void *, int), void *priv) {
+	int res;
+	xfer_slot_t *slot;
+	sys_thread_t thr;
+	xfer_putpipe_t pp;
+	xfer_adapt_t xa;
+
+	pp.rproc = rproc;
+	pp.priv = priv;
+	pp.sctx = &qc->xsctx;
+	pp.chunk = chunk > QTTY_XBUF_SIZE ? QTTY_XBUF_SIZE: chunk;
+	pp.fsize = fsize;
+	pp.stop = 0;
+	pp.zip = qc->zip;
+	pp.zbuf = NULL;
+	pp.disk_secs = 0;
+	if (pp.zip != NULL) {
+		if (pp.chunk > QTTY_ZIP_MAXRAW)
+			pp.chunk = QTTY_ZIP_MAXRAW;
+		if ((pp.zbuf = (char *) malloc(pp.chunk)) == NULL)
+			return -1;
+		qc->st.allocs++;
+	}
+	if (qc->putchunk == 0) {
+		adapt_init(&xa, qc, (int) pp.chunk);
+		pp.chunk = (unsigned int) xa.chunk;
+	}
+	if (ring_init(&pp.ring, qsize) < 0) {
+		free(pp.zbuf);
+		return -1;
+	}
+	qc->st.allocs++;
+	if (sys_thread_create(&thr, put_reader_proc, &pp) < 0) {
+		ring_free(&pp.ring);
+		free(pp.zbuf);
+		return -1;
+	}
+	for (res = 0;;) {
+		slot = ring_cons_slot(&pp.ring);
+		if (slot->size <= 0) {
+			if (slot->size < 0)
+				res = -1;
+			ring_cons_commit(&pp.ring);
+			break;
+		}
+		if (!res && send_pkt(qc, slot->data, slot->size) < 0) {
+			SYS_STORE_REL(&pp.stop, 1);
+			res = -1;
+		}
+		if (qc->putchunk == 0)
+			SYS_STORE_REL(&pp.chunk,
+				      (unsigned int) adapt_sent(&xa, qc, slot->rsize));
+		ring_cons_commit(&pp.ring);
+	}
+	sys_thread_join(thr);
+	ring_free(&pp.ring);
+	free(pp.zbuf);
+	qc->st.disk_secs += pp.disk_secs;
+
+	return res;
+}
+
+void adapt_init(xfer_adapt_t *xa, qtty_conn_t const *qc, int hi) {
+
+	xa->hi = hi < QTTY_ADAPT_MIN ? QTTY_ADAPT_MIN: hi;
+	xa->chunk = xa->hi;
+	xa->step = 1;
+	xa->votes = 0;
+	xa->pend = 0;
+	xa->bytes = xa->pkts = 0;
+	xa->t0 = sys_now();
+	xa->sock0 = qc->st.sock_secs;
+	xa->rate = 0;
+}
+
+/*
+ * Accounts one sent packet of "size" payload bytes (before compression),
+ * and returns the chunk size to use next. At the end of each window the
+ * size is doubled, until the goodput drops by more than 20%, or halved,
+ * for as long as that gains more than 25%. Both goodput driven moves need
+ * two windows in a row to agree, since a single one is mostly noise. The
+ * bias is towards big packets, which cost the least framing and syscalls.
+ * Packets which keep the sender blocked on the socket for more than
+ * QTTY_ADAPT_MAXBLOCK on average force a shrink (and more than half that
+ * stops the growth), so that big writes do not stall slow links.
+ * Decisions are recorded as "adapt" trace events.
+ */
+int adapt_sent(xfer_adapt_t *xa, qtty_conn_t const *qc, int size) {
+	int chunk, dir = xa->step;
+	double now, rate, blk;
+	char const *why;
+	char txt[QTTY_TRACE_TXTSIZE];
+
+	if (xa->pend) {
+		/*
+		 * Packets read ahead at the old size are still draining. The
+		 * window restarts after the first one with the new size.
+		 */
+		if (size == xa->chunk) {
+			xa->pend = 0;
+			xa->t0 = sys_now();
+			xa->sock0 = qc->st.sock_secs;
+		}
+		return xa->chunk;
+	}
+	xa->bytes += size;
+	xa->pkts++;
+	if ((now = sys_now()) - xa->t0 < QTTY_ADAPT_WINDOW || xa->pkts < QTTY_ADAPT_MINPKTS)
+		return xa->chunk;
+	rate = xa->bytes / (now - xa->t0);
+	blk = (qc->st.sock_secs - xa->sock0) / xa->pkts;
+	if (blk > QTTY_ADAPT_MAXBLOCK) {
+		xa->step = -1;
+		why = "block";
+	} else if ((dir > 0 && rate < 0.8 * xa->rate) ||
+		   (dir < 0 && rate > 1.25 * xa->rate)) {
+		xa->step = ++xa->votes < 2 ? 0: -1;
+		why = dir > 0 ? "slower": "faster";
+	} else if (dir < 0) {
+		xa->step = 1;
+		why = "nogain";
+	} else
+		why = "grow";
+	chunk = xa->chunk;
+	if (xa->step > 0) {
+		if (2 * blk <= QTTY_ADAPT_MAXBLOCK)
+			chunk = 2 * xa->chunk > xa->hi ? xa->hi: 2 * xa->chunk;
+	} else if (xa->step < 0) {
+		for (chunk = QTTY_ADAPT_MIN; 2 * chunk < xa->chunk; chunk *= 2);
+		if (chunk == QTTY_ADAPT_MIN)
+			xa->step = 1;
+	}
+	if (chunk != xa->chunk && qtrace_on) {
+		SNPRINTF(txt, sizeof(txt), "%s %.0fKB/s %.1fms", why, rate / 1024,
+			 blk * 1e3);
+		txt[sizeof(txt) - 1] = 0;
+		trace_event("adapt", xa->t0, chunk, txt);
+	}
+	if (xa->step != 0) {
+		xa->rate = rate;
+		xa->votes = 0;
+	} else
+		xa->step = dir;
+	xa->pend = chunk != xa->chunk;
+	xa->chunk = chunk;
+	xa->bytes = xa->pkts = 0;
+	xa->t0 = now;
+	xa->sock0 = qc->st.sock_secs;
+
+	return chunk;
+}
+
+static int mget_size_cmp(void const *p1, void const *p2) {
+	file_list_t const *f1 = *(file_list_t const * const *) p1;
+	file_list_t const *f2 = *(file_list_t const * const *) p2;
+
+	if (f1->size != f2->size)
+		return f1->size > f2->size ? -1: 1;
+
+	return flist_cmp(f1, f2);
+}
+
+static file_list_t *mget_pop(mget_deque_t *dq) {
+	file_list_t *fent = NULL;
+
+	sys_mutex_lock(&dq->mtx);
+	if (dq->head < dq->tail)
+		fent = dq->ents[dq->head++];
+	sys_mutex_unlock(&dq->mtx);
+
+	return fent;
+}
+
+static file_list_t *mget_steal(mget_deque_t *dq) {
+	file_list_t *fent = NULL;
+
+	sys_mutex_lock(&dq->mtx);
+	if (dq->head < dq->tail)
+		fent = dq->ents[--dq->tail];
+	sys_mutex_unlock(&dq->mtx);
+
+	return fent;
+}
+
+/*
+ * Only used to hand back the entry a worker was holding when its session
+ * broke, so there is always room for it at the head of its own deque.
+ */
+static void mget_push_front(mget_deque_t *dq, file_list_t *fent) {
+
+	sys_mutex_lock(&dq->mtx);
+	dq->ents[--dq->head] = fent;
+	sys_mutex_unlock(&dq->mtx);
+}
+
+/*
+ * Workers consume their own deque from the head, where the largest files
+ * sit, and once it is empty they steal from the tail of the others, which
+ * holds the smallest files still pending.
+ */
+static file_list_t *mget_next(mget_worker_t *wk) {
+	int i;
+	file_list_t *fent;
+	mget_ctx_t *ctx = wk->ctx;
+
+	if (SYS_LOAD_ACQ(&ctx->works[0].qc->abort))
+		return NULL;
+	if ((fent = mget_pop(&wk->dq)) != NULL)
+		return fent;
+	for (i = 1; i < ctx->nwork; i++)
+		if ((fent = mget_steal(&ctx->works[(wk->id + i) %
+						   ctx->nwork].dq)) != NULL)
+			return fent;
+
+	return NULL;
+}
+
+static void *mget_worker_proc(void *priv) {
+	int res;
+	mget_worker_t *wk = (mget_worker_t *) priv;
+	file_list_t *fent;
+	char rfile[1024], lfile[1024];
+
+	if (wk->id > 0)
+		trace_thread("mget-worker");
+	while ((fent = mget_next(wk)) != NULL) {
+		flist_path(fent, rfile, sizeof(rfile));
+		mget_local_path(rfile, wk->ctx->rpath, wk->ctx->lpath, lfile,
+				sizeof(lfile));
+		prepare_path(lfile);
+		res = local_get(wk->qc, rfile, lfile, wk->ctx->gflags,
+				wk->ctx->flerr);
+		if (res < 0) {
+			mget_push_front(&wk->dq, fent);
+			wk->lost = 1;
+			fprintf(wk->ctx->flerr, "[%d] %s\n->\t%s\nSession lost\n",
+				wk->id, rfile, lfile);
+			break;
+		}
+		if (res == 0) {
+			fprintf(wk->ctx->flerr, "[%d] %s\n->\t%s\nOK\n",
+				wk->id, rfile, lfile);
+			wk->nfiles++;
+		} else
+			wk->nerrs++;
+	}
+
+	return NULL;
+}
+
+/*
+ * Fetches the files in "flist" over "nsess" sessions, the caller's one
+ * plus "nsess - 1" freshly authenticated ones, or just the caller's one
+ * when the server address cannot be dialed again. Files are sorted by
+ * size, largest first, and dealt round robin over the per-session deques.
+ */
+int par_mget(qtty_conn_t *qc, file_list_t *flist, char const *rpath,
+	     char const *lpath, int nsess, int gflags, FILE *flerr) {
+	int i, nents, nfiles, nerrs, nleft, lost, dqsize;
+	file_list_t *fcur, **ents;
+	mget_worker_t *wk;
+	mget_ctx_t ctx;
+	char rfile[1024], lfile[1024];
+
+	for (nents = 0, fcur = flist; fcur != NULL; fcur = fcur->next)
+		if (mget_local_path(flist_path(fcur, rfile, sizeof(rfile)), rpath, lpath,
+				    lfile, sizeof(lfile)) != NULL)
+			nents++;
+	if (nsess > QTTY_MAX_SESSIONS)
+		nsess = QTTY_MAX_SESSIONS;
+	if (nsess > nents)
+		nsess = nents;
+	if (nsess < 1)
+		return 0;
+	if (nsess > 1 && !bt_sock_redialable(qc->cfg->qcaddr)) {
+		fprintf(flerr, "No extra sessions over %s, going on with 1\n",
+			qc->cfg->qcaddr);
+		nsess = 1;
+	}
+	if ((ents = (file_list_t **) malloc(nents * sizeof(file_list_t *))) == NULL)
+		return -1;
+	for (i = 0, fcur = flist; fcur != NULL; fcur = fcur->next)
+		if (mget_local_path(flist_path(fcur, rfile, sizeof(rfile)), rpath, lpath,
+				    lfile, sizeof(lfile)) != NULL)
+			ents[i++] = fcur;
+	qsort(ents, nents, sizeof(file_list_t *), mget_size_cmp);
+	if ((ctx.works = (mget_worker_t *)
+	     calloc(nsess, sizeof(mget_worker_t))) == NULL) {
+		free(ents);
+		return -1;
+	}
+	ctx.rpath = rpath;
+	ctx.lpath = lpath;
+	ctx.gflags = gflags;
+	ctx.flerr = flerr;
+	for (ctx.nwork = 0; ctx.nwork < nsess; ctx.nwork++) {
+		wk = &ctx.works[ctx.nwork];
+		if (ctx.nwork == 0)
+			wk->qc = qc;
+		else if (qconn_connect(qc->cfg, NULL, flerr, &wk->qc) < 0) {
+			fprintf(flerr, "Unable to open session %d, going on with %d\n",
+				ctx.nwork, ctx.nwork);
+			break;
+		}
+		wk->ctx = &ctx;
+		wk->id = ctx.nwork;
+	}
+
+	/*
+	 * One extra slot at the head of each deque leaves room for the entry
+	 * handed back by a worker whose session broke.
+	 */
+	dqsize = nents / ctx.nwork + 2;
+	for (i = 0; i < ctx.nwork; i++) {
+		wk = &ctx.works[i];
+		if ((wk->dq.ents = (file_list_t **)
+		     malloc(dqsize * sizeof(file_list_t *))) == NULL)
+			break;
+		wk->dq.head = wk->dq.tail = 1;
+		sys_mutex_init(&wk->dq.mtx);
+	}
+	if (i < ctx.nwork) {
+		for (i--; i >= 0; i--) {
+			sys_mutex_free(&ctx.works[i].dq.mtx);
+			free(ctx.works[i].dq.ents);
+		}
+		for (i = 1; i < ctx.nwork; i++)
+			qconn_close(ctx.works[i].qc);
+		free(ctx.works);
+		free(ents);
+		return -1;
+	}
+	for (i = 0; i < nents; i++) {
+		wk = &ctx.works[i % ctx.nwork];
+		wk->dq.ents[wk->dq.tail++] = ents[i];
+	}
+	free(ents);
+
+	for (i = 1; i < ctx.nwork; i++)
+		if (sys_thread_create(&ctx.works[i].thr, mget_worker_proc,
+				      &ctx.works[i]) < 0)
+			break;
+	nsess = i;
+	mget_worker_proc(&ctx.works[0]);
+	for (i = 1; i < nsess; i++)
+		sys_thread_join(ctx.works[i].thr);
+
+	/*
+	 * Deques of workers that could not be started are drained by the
+	 * others through stealing, so entries are left over only when every
+	 * running session broke.
+	 */
+	for (nfiles = nerrs = nleft = 0, i = 0; i < ctx.nwork; i++) {
+		wk = &ctx.works[i];
+		nfiles += wk->nfiles;
+		nerrs += wk->nerrs;
+		nleft += wk->dq.tail - wk->dq.head;
+		sys_mutex_free(&wk->dq.mtx);
+		free(wk->dq.ents);
+		if (i > 0) {
+			stats_merge(&qc->st, &wk->qc->st);
+			qconn_close(wk->qc);
+		}
+	}
+	lost = ctx.works[0].lost;
+	free(ctx.works);
+	fprintf(flerr, "%d files fetched, %d failed, %d not transferred\n",
+		nfiles, nerrs, nleft);
+
+	return nleft || lost ? -1: 0;
+}
+
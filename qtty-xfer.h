@@ -0,0 +1,59 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#if !defined(_QTTY_XFER_H)
+#define _QTTY_XFER_H
+
+
+#define QTTY_XBUF_SIZE (1024 * 64)
+#define QTTY_MAX_XQUEUE 256
+#define QTTY_MAX_SESSIONS 16
+#define QTTY_ADAPT_MIN 1024
+#define QTTY_ADAPT_WINDOW 0.05
+#define QTTY_ADAPT_MINPKTS 4
+#define QTTY_ADAPT_MAXBLOCK 0.1
+
+
+/*
+ * Put chunk size controller. Chunks start at "hi", are sized between
+ * QTTY_ADAPT_MIN and "hi" (in powers of two, below "hi"), and resized once
+ * per measurement window of at least QTTY_ADAPT_WINDOW seconds and
+ * QTTY_ADAPT_MINPKTS packets.
+ */
+typedef struct s_xfer_adapt {
+	int chunk, hi, step, votes, pend;
+	unsigned long bytes, pkts;
+	double t0, sock0, rate;
+} xfer_adapt_t;
+
+
+
+void adapt_init(xfer_adapt_t *xa, qtty_conn_t const *qc, int hi);
+int adapt_sent(xfer_adapt_t *xa, qtty_conn_t const *qc, int size);
+int pipe_get_data(qtty_conn_t *qc, int qsize,
+		  int (*dproc)(void *, void const *, int), void *priv,
+		  unsigned int *tsize);
+int pipe_put_data(qtty_conn_t *qc, int qsize, int chunk, unsigned int fsize,
+		  int (*rproc)(void *, void *, int), void *priv);
+int uring_get_data(qtty_conn_t *qc, file_sink_t *fs, unsigned int *tsize);
+int uring_put_data(qtty_conn_t *qc, int fd, int chunk, unsigned int fsize);
+int par_mget(qtty_conn_t *qc, file_list_t *flist, char const *rpath,
+	     char const *lpath, int nsess, int gflags, FILE *flerr);
+
+
+#endif
+
@@ -0,0 +1,174 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#include "qtty.h"
+#if defined(HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+
+
+/*
+ * Each get/put data packet of a compressed session carries one frame. A
+ * frame is either QTTY_ZIP_RAW followed by the data as is, or
+ * QTTY_ZIP_DEFLATE followed by the LE16 size of the data and its raw
+ * deflate stream. Frames are independent from each other, so a raw
+ * frame (for data which does not compress) can go anywhere.
+ */
+#if defined(HAVE_ZLIB)
+
+qtty_zip_t *zip_create(int level) {
+	qtty_zip_t *qz;
+	z_stream *zenc, *zdec;
+
+	if ((qz = (qtty_zip_t *) malloc(sizeof(qtty_zip_t) +
+					2 * sizeof(z_stream))) == NULL)
+		return NULL;
+	zenc = (z_stream *) (qz + 1);
+	zdec = zenc + 1;
+	memset(zenc, 0, 2 * sizeof(z_stream));
+	if (deflateInit2(zenc, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(qz);
+		return NULL;
+	}
+	if (inflateInit2(zdec, -15) != Z_OK) {
+		deflateEnd(zenc);
+		free(qz);
+		return NULL;
+	}
+	qz->level = level;
+	qz->zenc = zenc;
+	qz->zdec = zdec;
+	qz->rawbytes = qz->wirebytes = 0;
+
+	return qz;
+}
+
+void zip_free(qtty_zip_t *qz) {
+
+	deflateEnd((z_stream *) qz->zenc);
+	inflateEnd((z_stream *) qz->zdec);
+	free(qz);
+}
+
+/*
+ * Encodes "size" (up to QTTY_ZIP_MAXRAW) bytes into "frame", which must
+ * have room for QTTY_PKT_MAXSIZE bytes, and returns the frame size.
+ */
+int zip_encode(qtty_zip_t *qz, void const *data, int size, char *frame) {
+	int zsize;
+	z_stream *zs = (z_stream *) qz->zenc;
+
+	qz->rawbytes += size;
+	if (size > 2 * QTTY_ZIP_HDRSIZE) {
+		/*
+		 * Output room is capped to the raw frame size, so data which
+		 * does not shrink makes deflate stop short, and goes raw.
+		 */
+		deflateReset(zs);
+		zs->next_in = (Bytef *) data;
+		zs->avail_in = (uInt) size;
+		zs->next_out = (Bytef *) frame + QTTY_ZIP_HDRSIZE;
+		zs->avail_out = (uInt) (size - QTTY_ZIP_HDRSIZE);
+		if (deflate(zs, Z_FINISH) == Z_STREAM_END) {
+			zsize = (int) zs->total_out;
+			frame[0] = QTTY_ZIP_DEFLATE;
+			PUT_LE16((unsigned int) size, frame + 1);
+			qz->wirebytes += QTTY_ZIP_HDRSIZE + zsize;
+			return QTTY_ZIP_HDRSIZE + zsize;
+		}
+	}
+	frame[0] = QTTY_ZIP_RAW;
+	memcpy(frame + 1, data, size);
+	qz->wirebytes += 1 + size;
+
+	return 1 + size;
+}
+
+int zip_decode(qtty_zip_t *qz, char const *frame, int size, char *data, int dsize) {
+	int rsize;
+	z_stream *zs = (z_stream *) qz->zdec;
+
+	if ((rsize = zip_frame_size(frame, size)) < 0 || rsize > dsize)
+		return -1;
+	qz->wirebytes += size;
+	qz->rawbytes += rsize;
+	if (frame[0] == QTTY_ZIP_RAW) {
+		memcpy(data, frame + 1, rsize);
+		return rsize;
+	}
+	inflateReset(zs);
+	zs->next_in = (Bytef *) frame + QTTY_ZIP_HDRSIZE;
+	zs->avail_in = (uInt) (size - QTTY_ZIP_HDRSIZE);
+	zs->next_out = (Bytef *) data;
+	zs->avail_out = (uInt) rsize;
+	if (inflate(zs, Z_FINISH) != Z_STREAM_END ||
+	    (int) zs->total_out != rsize)
+		return -1;
+
+	return rsize;
+}
+
+#else
+
+qtty_zip_t *zip_create(int level) {
+
+	return NULL;
+}
+
+void zip_free(qtty_zip_t *qz) {
+
+}
+
+int zip_encode(qtty_zip_t *qz, void const *data, int size, char *frame) {
+
+	frame[0] = QTTY_ZIP_RAW;
+	memcpy(frame + 1, data, size);
+
+	return 1 + size;
+}
+
+int zip_decode(qtty_zip_t *qz, char const *frame, int size, char *data, int dsize) {
+	int rsize;
+
+	if ((rsize = zip_frame_size(frame, size)) < 0 || rsize > dsize ||
+	    frame[0] != QTTY_ZIP_RAW)
+		return -1;
+	memcpy(data, frame + 1, rsize);
+
+	return rsize;
+}
+
+#endif
+
+/*
+ * Returns the size of the data carried by a frame, without decoding it.
+ */
+int zip_frame_size(char const *frame, int size) {
+	unsigned int rsize;
+
+	if (size < 1)
+		return -1;
+	if (frame[0] == QTTY_ZIP_RAW)
+		return size - 1;
+	if (frame[0] != QTTY_ZIP_DEFLATE || size < QTTY_ZIP_HDRSIZE)
+		return -1;
+	GET_LE16(rsize, frame + 1);
+
+	return (int) rsize;
+}
+
@@ -0,0 +1,46 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#if !defined(_QTTY_ZIP_H)
+#define _QTTY_ZIP_H
+
+
+#define QTTY_ZIP_RAW 0
+#define QTTY_ZIP_DEFLATE 1
+#define QTTY_ZIP_HDRSIZE 3
+#define QTTY_ZIP_MAXRAW (QTTY_PKT_MAXSIZE - 1)
+#define QTTY_ZIP_CAPS "$zip.deflate"
+#define QTTY_ZIP_CMD "$zip deflate"
+
+
+typedef struct s_qtty_zip {
+	int level;
+	void *zenc, *zdec;
+	unsigned long rawbytes, wirebytes;
+} qtty_zip_t;
+
+
+
+qtty_zip_t *zip_create(int level);
+void zip_free(qtty_zip_t *qz);
+int zip_encode(qtty_zip_t *qz, void const *data, int size, char *frame);
+int zip_frame_size(char const *frame, int size);
+int zip_decode(qtty_zip_t *qz, char const *frame, int size, char *data, int dsize);
+
+
+#endif
+
@@ -28,7 +28,16 @@
 
 #include "qtty-macro.h"
 #include "qtty-sha1.h"
+#include "qtty-zip.h"
+#include "qtty-uring.h"
+#include "qtty-wild.h"
+#include "qtty-flist.h"
+#include "qtty-stats.h"
+#include "qtty-trace.h"
 #include "qtty-util.h"
+#include "qtty-mfst.h"
+#include "qtty-xfer.h"
+#include "qtty-jobs.h"
 
 
 
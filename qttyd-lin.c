@@ -0,0 +1,597 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#include "qtty.h"
+#include <stdarg.h>
+
+
+#define QTTYD_MAX_PATH 1024
+#define QTTYD_CHALLENGE_SIZE 16
+
+
+typedef struct s_qttyd_cfg {
+	char const *root;
+	char const *user;
+	char const *passwd;
+	int zlevel;
+	int once;
+} qttyd_cfg_t;
+
+
+
+static void qttyd_usage(char const *prg);
+static int srv_listen_tcp(char const *addr);
+static int srv_listen_unix(char const *path);
+static int srv_reply(qtty_conn_t *qc, char const *fmt, ...);
+static int srv_login(qtty_conn_t *qc);
+static char *srv_local_path(char const *rpath, char *lpath, int size);
+static int srv_get(qtty_conn_t *qc, char const *rpath);
+static int srv_put(qtty_conn_t *qc, char const *rpath, int force);
+static int srv_find_dir(qtty_conn_t *qc, char const *ldir, char const *rdir,
+			qtty_wild_t const *wp, int recurse);
+static int srv_find(qtty_conn_t *qc, char *args);
+static int srv_sum(qtty_conn_t *qc, char const *args);
+static int srv_bounce(qtty_conn_t *qc, char const *line);
+static int srv_session(int fd);
+
+
+
+static qttyd_cfg_t dcfg;
+
+
+
+static void qttyd_usage(char const *prg) {
+
+	fprintf(stderr,
+		"QTTYD - Stand-in QConsole server for QTTY testing and benchmarking\n"
+		"\tVersion %s - by Davide Libenzi <davidel@xmailserver.org>\n\n"
+		"use: %s {--tcp [HOST:]PORT | --unix PATH} --user USER --pass PASS\n"
+		"\t[--root DIR] [--compress LEVEL] [--once] [--help]\n\n",
+		QTTY_VERSION, prg);
+}
+
+static int srv_listen_tcp(char const *addr) {
+	int sfd, one = 1;
+	char const *port;
+	char host[256];
+	struct addrinfo hints, *ai;
+
+	if ((port = strrchr(addr, ':')) != NULL) {
+		SNPRINTF(host, sizeof(host), "%.*s", (int) (port - addr), addr);
+		host[sizeof(host) - 1] = 0;
+		port++;
+	} else {
+		strcpy(host, "127.0.0.1");
+		port = addr;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(*host ? host: NULL, port, &hints, &ai)) {
+		fprintf(stderr, "Invalid address: %s\n", addr);
+		return -1;
+	}
+	if ((sfd = socket(ai->ai_family, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		freeaddrinfo(ai);
+		return -1;
+	}
+	setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(sfd, ai->ai_addr, ai->ai_addrlen) || listen(sfd, 16)) {
+		perror(addr);
+		close(sfd);
+		freeaddrinfo(ai);
+		return -1;
+	}
+	freeaddrinfo(ai);
+
+	return sfd;
+}
+
+static int srv_listen_unix(char const *path) {
+	int sfd;
+	struct sockaddr_un sau;
+
+	if (strlen(path) >= sizeof(sau.sun_path)) {
+		fprintf(stderr, "Path too long: %s\n", path);
+		return -1;
+	}
+	if ((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+	memset(&sau, 0, sizeof(sau));
+	sau.sun_family = AF_UNIX;
+	strcpy(sau.sun_path, path);
+	unlink(path);
+	if (bind(sfd, (struct sockaddr *) &sau, sizeof(sau)) || listen(sfd, 16)) {
+		perror(path);
+		close(sfd);
+		return -1;
+	}
+
+	return sfd;
+}
+
+/*
+ * Sends an error message, followed by the empty packet which terminates
+ * every server reply.
+ */
+static int srv_reply(qtty_conn_t *qc, char const *fmt, ...) {
+	int size;
+	va_list args;
+	char msg[1024];
+
+	va_start(args, fmt);
+	size = vsnprintf(msg, sizeof(msg), fmt, args);
+	va_end(args);
+	if (size >= (int) sizeof(msg))
+		size = (int) sizeof(msg) - 1;
+	if (send_pkt(qc, msg, size) < 0)
+		return -1;
+
+	return send_pkt(qc, "", 0);
+}
+
+/*
+ * The banner carries the challenge between angle brackets, and the client
+ * answers with the user name and the hex SHA-1 of "CHALLENGE,PASSWORD".
+ */
+static int srv_login(qtty_conn_t *qc) {
+	int i, size, fd;
+	char const *data;
+	sha1_ctx_t sctx;
+	unsigned char rnd[QTTYD_CHALLENGE_SIZE], digest[SHA1_DIGEST_SIZE];
+	char chal[2 * QTTYD_CHALLENGE_SIZE + 1], sdbuf[2 * SHA1_DIGEST_SIZE + 1];
+	char user[256], banner[512];
+
+	if ((fd = open("/dev/urandom", O_RDONLY)) < 0 ||
+	    read(fd, rnd, sizeof(rnd)) != (int) sizeof(rnd)) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	close(fd);
+	for (i = 0; i < (int) sizeof(rnd); i++)
+		sprintf(chal + 2 * i, "%02x", (unsigned int) rnd[i]);
+	SNPRINTF(banner, sizeof(banner), "QConsole stand-in (qttyd %s) <%s> %s%s%s\n",
+		 QTTY_VERSION, chal, QTTY_SUM_CAPS, dcfg.zlevel > 0 ? " ": "",
+		 dcfg.zlevel > 0 ? QTTY_ZIP_CAPS: "");
+	banner[sizeof(banner) - 1] = 0;
+	if (send_pkt(qc, banner, strlen(banner)) < 0 ||
+	    next_pkt(qc, &data, &size) < 0)
+		return -1;
+	SNPRINTF(user, sizeof(user), "%.*s", size, data);
+	user[sizeof(user) - 1] = 0;
+	if (next_pkt(qc, &data, &size) < 0)
+		return -1;
+
+	sha1_init(&sctx);
+	sha1_update(&sctx, (unsigned char const *) chal, strlen(chal));
+	sha1_update(&sctx, (unsigned char const *) ",", 1);
+	sha1_update(&sctx, (unsigned char const *) dcfg.passwd, strlen(dcfg.passwd));
+	sha1_final(digest, &sctx);
+	for (i = 0; i < (int) sizeof(digest); i++)
+		sprintf(sdbuf + 2 * i, "%02x", (unsigned int) digest[i]);
+
+	if (strcmp(user, dcfg.user) != 0 || size != (int) strlen(sdbuf) ||
+	    strncasecmp(data, sdbuf, size) != 0) {
+		send_pkt(qc, "Login failed\n", 13);
+		flush_pkts(qc);
+		return -1;
+	}
+
+	return send_pkt(qc, "", 0);
+}
+
+/*
+ * Maps a remote (drive letter and backslashes) path inside the served
+ * directory. Any ".." component is refused.
+ */
+static char *srv_local_path(char const *rpath, char *lpath, int size) {
+	int len;
+	char *tmp, *comp;
+
+	if (((*rpath >= 'a' && *rpath <= 'z') || (*rpath >= 'A' && *rpath <= 'Z')) &&
+	    rpath[1] == ':')
+		rpath += 2;
+	for (; *rpath == '\\' || *rpath == '/'; rpath++);
+	len = SNPRINTF(lpath, size, "%s/%s", dcfg.root, rpath);
+	if (len < 0 || len >= size)
+		return NULL;
+	for (tmp = lpath; *tmp; tmp++)
+		if (*tmp == '\\')
+			*tmp = '/';
+	for (len = strlen(lpath); len > 1 && lpath[len - 1] == '/'; len--)
+		lpath[len - 1] = 0;
+	for (comp = lpath; comp != NULL; comp = tmp) {
+		if ((tmp = strchr(comp, '/')) != NULL)
+			tmp++;
+		if (comp[0] == '.' && comp[1] == '.' && (comp[2] == '/' || comp[2] == 0))
+			return NULL;
+	}
+
+	return lpath;
+}
+
+/*
+ * Besides plain paths, "get" accepts "$off.OFFSET.PATH", which streams
+ * the file from OFFSET on, and "$chk.PATH", which is served as a plain
+ * get since there is no device side chunking to model here. Checksummed
+ * sessions get the SHA-1 of the streamed bytes after the terminator.
+ */
+static int srv_get(qtty_conn_t *qc, char const *rpath) {
+	int fd, size;
+	unsigned long off = 0;
+	char *tmp;
+	struct stat stbuf;
+	char lpath[QTTYD_MAX_PATH], buf[QTTY_PKT_MAXSIZE];
+
+	if (strncmp(rpath, "$off.", 5) == 0) {
+		off = strtoul(rpath + 5, &tmp, 10);
+		if (*tmp != '.')
+			return srv_reply(qc, "Invalid offset: %s\n", rpath);
+		rpath = tmp + 1;
+	} else if (strncmp(rpath, "$chk.", 5) == 0)
+		rpath += 5;
+	if (srv_local_path(rpath, lpath, sizeof(lpath)) == NULL)
+		return srv_reply(qc, "Invalid path: %s\n", rpath);
+	if ((fd = open(lpath, O_RDONLY)) < 0)
+		return srv_reply(qc, "Unable to open file: %s\n", rpath);
+	if (fstat(fd, &stbuf) || !S_ISREG(stbuf.st_mode) ||
+	    (unsigned long) stbuf.st_size < off ||
+	    lseek(fd, (off_t) off, SEEK_SET) != (off_t) off) {
+		close(fd);
+		return srv_reply(qc, "Unable to read file: %s\n", rpath);
+	}
+	pkt_batch_begin(qc);
+	PUT_LE32((unsigned int) (stbuf.st_size - off), buf);
+	if (send_pkt(qc, "", 0) < 0 || send_pkt(qc, buf, 4) < 0) {
+		pkt_batch_end(qc);
+		close(fd);
+		return -1;
+	}
+	sha1_init(&qc->xsctx);
+	while ((size = read(fd, buf, qc->zip != NULL ? QTTY_ZIP_MAXRAW:
+			    QTTY_PKT_MAXSIZE)) > 0) {
+		sha1_update(&qc->xsctx, (unsigned char const *) buf, size);
+		if (qc->zip != NULL &&
+		    send_pkt(qc, qc->zbuf, zip_encode(qc->zip, buf, size, qc->zbuf)) < 0) {
+			pkt_batch_end(qc);
+			close(fd);
+			return -1;
+		}
+		if (qc->zip == NULL && send_pkt(qc, buf, size) < 0) {
+			pkt_batch_end(qc);
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	sha1_final(qc->xdigest, &qc->xsctx);
+	if (send_pkt(qc, "", 0) < 0 ||
+	    (qc->xsum && send_pkt(qc, (char const *) qc->xdigest, SHA1_DIGEST_SIZE) < 0))
+		return -1;
+
+	return pkt_batch_end(qc);
+}
+
+/*
+ * A short read leaves the size mismatch to the client, while local write
+ * errors are reported once the whole payload has been drained.
+ */
+static int srv_put(qtty_conn_t *qc, char const *rpath, int force) {
+	int size, error = 0;
+	unsigned int fsize, tsize;
+	FILE *file;
+	char const *data;
+	char lpath[QTTYD_MAX_PATH];
+
+	if (srv_local_path(rpath, lpath, sizeof(lpath)) == NULL)
+		return srv_reply(qc, "Invalid path: %s\n", rpath);
+	if (!force && PATH_EXIST(lpath))
+		return srv_reply(qc, "File already exist: %s\n", rpath);
+	prepare_path(lpath);
+	if ((file = fopen(lpath, "wb")) == NULL)
+		return srv_reply(qc, "Unable to create file: %s\n", rpath);
+	if (send_pkt(qc, "", 0) < 0 ||
+	    next_pkt(qc, &data, &size) < 0 || size != 4) {
+		fclose(file);
+		remove(lpath);
+		return -1;
+	}
+	GET_LE32(fsize, data);
+	sha1_init(&qc->xsctx);
+	for (tsize = 0;;) {
+		if (next_pkt(qc, &data, &size) < 0) {
+			fclose(file);
+			remove(lpath);
+			return -1;
+		}
+		if (!size)
+			break;
+		if (qc->zip != NULL) {
+			if ((size = zip_decode(qc->zip, data, size, qc->zbuf,
+					       sizeof(qc->zbuf))) < 0) {
+				fclose(file);
+				remove(lpath);
+				return -1;
+			}
+			data = qc->zbuf;
+		}
+		if (!error && fwrite(data, 1, size, file) != (size_t) size)
+			error++;
+		sha1_update(&qc->xsctx, (unsigned char const *) data, size);
+		tsize += size;
+	}
+	if (fclose(file))
+		error++;
+	if (error || tsize != fsize) {
+		remove(lpath);
+		return srv_reply(qc, error ? "Write error: %s\n":
+				 "Data size mismatch: %s\n", rpath);
+	}
+	sha1_final(qc->xdigest, &qc->xsctx);
+	if (send_pkt(qc, "", 0) < 0)
+		return -1;
+
+	return qc->xsum ? send_pkt(qc, (char const *) qc->xdigest, SHA1_DIGEST_SIZE): 0;
+}
+
+static int srv_find_dir(qtty_conn_t *qc, char const *ldir, char const *rdir,
+			qtty_wild_t const *wp, int recurse) {
+	int size;
+	DIR *dir;
+	struct dirent *dent;
+	struct stat stbuf;
+	char lpath[QTTYD_MAX_PATH], rpath[QTTYD_MAX_PATH];
+
+	if ((dir = opendir(ldir)) == NULL)
+		return 0;
+	while ((dent = readdir(dir)) != NULL) {
+		if (strcmp(dent->d_name, ".") == 0 ||
+		    strcmp(dent->d_name, "..") == 0)
+			continue;
+		SNPRINTF(lpath, sizeof(lpath), "%s/%s", ldir, dent->d_name);
+		lpath[sizeof(lpath) - 1] = 0;
+		SNPRINTF(rpath, sizeof(rpath), "%s\\%s", rdir, dent->d_name);
+		rpath[sizeof(rpath) - 1] = 0;
+		if (stat(lpath, &stbuf))
+			continue;
+		if (S_ISDIR(stbuf.st_mode)) {
+			if (recurse &&
+			    srv_find_dir(qc, lpath, rpath, wp, recurse) < 0) {
+				closedir(dir);
+				return -1;
+			}
+		} else if (S_ISREG(stbuf.st_mode) && wild_match(wp, dent->d_name)) {
+			size = strlen(rpath);
+			SNPRINTF(rpath + size, sizeof(rpath) - size, "\t%lu\n",
+				 (unsigned long) stbuf.st_size);
+			rpath[sizeof(rpath) - 1] = 0;
+			if (send_pkt(qc, rpath, strlen(rpath)) < 0) {
+				closedir(dir);
+				return -1;
+			}
+		}
+	}
+	closedir(dir);
+
+	return 0;
+}
+
+/*
+ * Matching files are returned one per packet, with their size after a tab,
+ * and the "-s1" flag limits the walk to the given directory.
+ */
+static int srv_find(qtty_conn_t *qc, char *args) {
+	int res, len, recurse = 1;
+	char const *match = "*";
+	char *tok, *rpath = NULL;
+	char lpath[QTTYD_MAX_PATH];
+	qtty_wild_t *wp;
+
+	for (tok = strtok(args, " \t"); tok != NULL; tok = strtok(NULL, " \t")) {
+		if (*tok == '-') {
+			if (strchr(tok, '1') != NULL)
+				recurse = 0;
+		} else if (rpath == NULL)
+			rpath = tok;
+		else
+			match = tok;
+	}
+	if (rpath == NULL)
+		return srv_reply(qc, "Invalid command: find\n");
+	if (rpath[len = strlen(rpath) - 1] == '\\')
+		rpath[len] = 0;
+	if (srv_local_path(rpath, lpath, sizeof(lpath)) == NULL)
+		return srv_reply(qc, "Invalid path: %s\n", rpath);
+	if ((wp = wild_compile(match, QTTY_WILD_ICASE)) == NULL)
+		return srv_reply(qc, "Out of memory\n");
+	pkt_batch_begin(qc);
+	res = srv_find_dir(qc, lpath, rpath, wp, recurse);
+	if (res == 0)
+		res = send_pkt(qc, "", 0);
+	if (pkt_batch_end(qc) < 0)
+		res = -1;
+	wild_free(wp);
+
+	return res;
+}
+
+static int srv_sum(qtty_conn_t *qc, char const *args) {
+
+	if (strcmp(args, "sha1") != 0)
+		return srv_reply(qc, "Unsupported checksum: %s\n", args);
+	qc->xsum = 1;
+
+	return send_pkt(qc, "", 0);
+}
+
+static int srv_bounce(qtty_conn_t *qc, char const *line) {
+	int len = strlen(line);
+	char cwd[QTTYD_MAX_PATH];
+
+	if (ISCMD(line, len, "help"))
+		return srv_reply(qc, "Commands: get PATH, put PATH, putf PATH, "
+				 "find [-s[1]] PATH [MATCH], pwd, echo TEXT, exit\n");
+	if (ISCMD(line, len, "pwd"))
+		return srv_reply(qc, "%s\n", getcwd(cwd, sizeof(cwd)) ? cwd: dcfg.root);
+	if (ISCMD(line, len, "echo"))
+		return srv_reply(qc, "%s\n", len > 5 ? line + 5: "");
+
+	return srv_reply(qc, "Unknown command: %s\n", line);
+}
+
+static int srv_session(int fd) {
+	int res, size, len;
+	char const *data;
+	char *args;
+	bt_sock_t sk;
+	qtty_conn_t *qc;
+	char line[QTTYD_MAX_PATH];
+
+	if ((sk = bt_sock_fdopen(fd)) == INVALID_BT_SOCK) {
+		close(fd);
+		return -1;
+	}
+	if ((qc = qconn_open(sk)) == NULL) {
+		bt_sock_close(sk);
+		return -1;
+	}
+	if (srv_login(qc) < 0) {
+		qconn_close(qc);
+		return -1;
+	}
+
+	/*
+	 * Replies are only queued, and hit the wire when the receive side runs
+	 * out of input, so pipelined commands get their replies coalesced.
+	 */
+	pkt_batch_begin(qc);
+	for (res = 0; res == 0;) {
+		if (next_pkt(qc, &data, &size) < 0)
+			break;
+		SNPRINTF(line, sizeof(line), "%.*s", size, data);
+		line[sizeof(line) - 1] = 0;
+		len = strlen(line);
+		if ((args = strchr(line, ' ')) != NULL)
+			args++;
+		else
+			args = line + len;
+
+		if (ISCMD(line, len, "get"))
+			res = srv_get(qc, args);
+		else if (ISCMD(line, len, "put"))
+			res = srv_put(qc, args, 0);
+		else if (ISCMD(line, len, "putf"))
+			res = srv_put(qc, args, 1);
+		else if (ISCMD(line, len, "find"))
+			res = srv_find(qc, args);
+		else if (ISCMD(line, len, "$zip"))
+			res = qconn_zip_accept(qc, args, dcfg.zlevel);
+		else if (ISCMD(line, len, "$sum"))
+			res = srv_sum(qc, args);
+		else if (ISCMD(line, len, "exit") || ISCMD(line, len, "shutdown") ||
+			 ISCMD(line, len, "reboot")) {
+			srv_reply(qc, "Bye\n");
+			flush_pkts(qc);
+			break;
+		} else
+			res = srv_bounce(qc, line);
+	}
+	qconn_close(qc);
+
+	return 0;
+}
+
+int main(int ac, char **av) {
+	int i, sfd, cfd;
+	char const *tcp = NULL, *unx = NULL;
+	qtty_zip_t *qz;
+
+	sha1_setup();
+	dcfg.root = ".";
+	dcfg.zlevel = 1;
+	for (i = 1; i < ac; i++) {
+		if (!strcmp(av[i], "--tcp")) {
+			if (++i < ac)
+				tcp = av[i];
+		} else if (!strcmp(av[i], "--unix")) {
+			if (++i < ac)
+				unx = av[i];
+		} else if (!strcmp(av[i], "--user")) {
+			if (++i < ac)
+				dcfg.user = av[i];
+		} else if (!strcmp(av[i], "--pass")) {
+			if (++i < ac)
+				dcfg.passwd = av[i];
+		} else if (!strcmp(av[i], "--root")) {
+			if (++i < ac)
+				dcfg.root = av[i];
+		} else if (!strcmp(av[i], "--compress")) {
+			if (++i < ac)
+				dcfg.zlevel = atoi(av[i]);
+		} else if (!strcmp(av[i], "--once")) {
+			dcfg.once = 1;
+		} else {
+			qttyd_usage(av[0]);
+			return 1;
+		}
+	}
+	if ((tcp == NULL) == (unx == NULL) || !dcfg.user || !dcfg.passwd) {
+		qttyd_usage(av[0]);
+		return 1;
+	}
+	if (dcfg.zlevel > 0) {
+		if ((qz = zip_create(dcfg.zlevel)) == NULL)
+			dcfg.zlevel = 0;
+		else
+			zip_free(qz);
+	}
+	if ((sfd = tcp != NULL ? srv_listen_tcp(tcp): srv_listen_unix(unx)) < 0)
+		return 2;
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGCHLD, SIG_IGN);
+	fprintf(stderr, "Serving %s on %s\n", dcfg.root, tcp != NULL ? tcp: unx);
+
+	for (;;) {
+		if ((cfd = accept(sfd, NULL, NULL)) < 0)
+			continue;
+		if (dcfg.once) {
+			close(sfd);
+			srv_session(cfd);
+			break;
+		}
+		switch (fork()) {
+		case 0:
+			close(sfd);
+			srv_session(cfd);
+			exit(0);
+		case -1:
+			perror("fork");
+		default:
+			close(cfd);
+		}
+	}
+	if (unx != NULL)
+		unlink(unx);
+
+	return 0;
+}
+